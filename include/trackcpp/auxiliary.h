@@ -99,6 +99,8 @@ struct Status {
         flat_file_error = 12,
         newton_not_converged = 13,
         not_implemented = 14,
+        partial_file_mismatch = 15,
+        partial_file_repeated = 16,
     };
 };
 
@@ -118,6 +120,8 @@ const std::vector<std::string> string_error_messages = {
         "flat_file_error",
         "newton_not_converged",
         "not_implemented",
+        "partial_file_mismatch",
+        "partial_file_repeated",
 };
 
 #define STR_HELPER(x) #x
@@ -142,6 +146,7 @@ const double light_speed              = 299792458;         // [m/s]   - definiti
 const double vacuum_permeability      = 4*M_PI*1e-7;       // [T.m/A] - definition
 const double electron_charge          = 1.60217656535e-19; // [C]     - 2014-06-11
 const double electron_mass            = 9.1093829140e-31;  // [Kg]    - 2014-06-11
+const double reduced_planck_constant  = 1.05457172647e-34; // [J.s]   - 2014-06-11
 const double electron_rest_energy     = electron_mass * pow(light_speed,2);             // [Kg.m^2/s^2] - derived
 const double vaccum_permitticity      = 1/(vacuum_permeability * pow(light_speed,2));   // [V.s/(A.m)]  - derived
 const double electron_rest_energy_MeV = (electron_rest_energy / electron_charge) / 1e6; // [MeV] - derived
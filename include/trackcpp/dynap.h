@@ -21,7 +21,11 @@
 #include "elements.h"
 #include "pos.h"
 #include "auxiliary.h"
+#include "naff.h"
 #include <vector>
+#include <string>
+#include <functional>
+#include <cmath>
 
 
 struct DynApGridPoint {
@@ -32,8 +36,131 @@ struct DynApGridPoint {
   Plane::type  lost_plane;     // Plane::no_plane,Plane::x,Plane::y,Plane::z
   double       nux1, nuy1;     // tunes at first half number of turns
   double       nux2, nuy2;     // tunes at second half number of turns
+  double       chaos = nan(""); // chaos indicator of the analysis, NaN if not computed
 };
 
+// how dynap_xy and dynap_xyfmap use the y -> -y symmetry of the motion
+struct MidPlaneSymmetry {
+  enum type {
+    off       = 0,   // tracks the full grid
+    automatic = 1,   // tracks half the grid if the accelerator is symmetric
+    on        = 2    // assumes symmetry without checking the accelerator
+  };
+};
+
+// options that control how a dynap run is carried out
+struct DynApRunOptions {
+  // sharding: only the tasks with 'task % nr_shards == shard_index' are computed
+  unsigned int shard_index = 0;
+  unsigned int nr_shards   = 1;
+  // checkpoints: finished grid points and acceptance search states are saved
+  // every 'checkpoint_interval' seconds (not used by 'dynap_staged')
+  std::string  checkpoint_filename;          // no checkpoints if empty
+  double       checkpoint_interval = 300;    // [s]
+  bool         resume = false;               // restores finished tasks from the checkpoint file
+  // output: indices of the grid points computed in the run
+  std::vector<unsigned int> computed;
+};
+
+// per-particle analysis of 'dynap_scan': tracks the particle with initial position 'p'
+// (closed-orbit included) from 'point.start_element' and fills in the results in 'point'.
+// analyses are called concurrently from several threads.
+typedef std::function<Status::type(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point)> DynApAnalysis;
+
+// batched analysis of 'dynap_scan': the analysis of each of the particles with initial positions
+// 'p', whose results are filled in '*points[k]' and 'status[k]'. called concurrently from several
+// threads, each with its own block of grid points.
+typedef std::function<void(const Accelerator& accelerator, unsigned int nr_turns, const std::vector<Pos<double>>& p, const std::vector<DynApGridPoint*>& points, std::vector<Status::type>& status)> DynApBatchAnalysis;
+
+// built-in analyses
+Status::type dynap_analysis_survival(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point);   // lost turn, element and plane
+Status::type dynap_analysis_tunes(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point);      // survival and NAFF tunes in nux1, nuy1
+Status::type dynap_analysis_diffusion(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point);  // NAFF tunes of each half of the turns, as in fmaps
+// as the two above, with the tunes estimated by 'method' instead of NAFF
+DynApAnalysis dynap_analysis_tunes_method(NaffMethod::type method);
+DynApAnalysis dynap_analysis_diffusion_method(NaffMethod::type method);
+// 'dynap_analysis_diffusion' of a block of particles, tracked one after the other, with the tunes
+// of each half of the turns found by 'NaffBatch' for all the particles that survived it. results
+// are the same. fmaps whose analysis is 'dynap_analysis_diffusion' run this one instead.
+void dynap_analysis_diffusion_batch(const Accelerator& accelerator, unsigned int nr_turns, const std::vector<Pos<double>>& p, const std::vector<DynApGridPoint*>& points, std::vector<Status::type>& status);
+
+// chaos indicators in 'point.chaos', all in log10 scale and usually separating regular
+// from chaotic orbits in fewer turns than the tune diffusion:
+// - reversibility error: distance in (rx,px,ry,py) after tracking 'nr_turns' forward and back
+//   through the time-reversed lattice. both ways track the copy of 'accelerator' captured by
+//   'dynap_analysis_rem', with radiation off; the accelerator passed to the analysis is ignored.
+//   reversal through active cavities is not handled, so with cavity_on the error is not only
+//   due to chaos. it is +inf if the particle is lost on the way back.
+// - fast Lyapunov indicator: maximum growth of the tangent vector (1,1,1,1,0,0)/2.
+// - smaller alignment index: minimum of SALI between tangent vectors started along rx and ry.
+DynApAnalysis dynap_analysis_rem(const Accelerator& accelerator);
+Status::type  dynap_analysis_fli(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point);
+Status::type  dynap_analysis_sali(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point);
+
+// a scanned coordinate of 'dynap_scan' and its values
+struct DynApScanAxis {
+  enum coordinate { rx = 0, px = 1, ry = 2, py = 3, de = 4, dl = 5 };
+  coordinate          coord;
+  std::vector<double> values;
+  DynApScanAxis(coordinate coord_ = rx, const std::vector<double>& values_ = std::vector<double>()) : coord(coord_), values(values_) {}
+  static DynApScanAxis range(coordinate coord_, unsigned int nrpts, double first, double last);   // 'nrpts' equally spaced values
+};
+
+// set of initial conditions tracked by 'dynap_scan': either the grid spanned by
+// 'axes' (the first axis varies slowest) or, if there are no axes, the offsets in 'points'.
+struct DynApScan {
+  std::string                label = "scan";     // identifies the scan in checkpoint files and per-task lines
+  std::vector<DynApScanAxis> axes;
+  std::vector<Pos<double>>   points;
+  Pos<double>                p0;                 // offset added to all initial conditions
+  unsigned int               start_element = 0;
+  unsigned int               nr_turns = 0;
+  DynApAnalysis              analysis = dynap_analysis_survival;
+  DynApBatchAnalysis         batch_analysis = nullptr;            // if set, run instead of 'analysis' on
+  unsigned int               batch_size = NaffBatch::block_size;  // blocks of 'batch_size' grid points
+  MidPlaneSymmetry::type     symmetry = MidPlaneSymmetry::off;   // applies to grids with ry and/or py axes
+};
+
+// adaptive refinement of frequency maps: cells of the initial grid are recursively
+// subdivided, up to 'max_depth' times, while their corners differ in survival or
+// their tune diffusion log10(|dnu|) (or chaos indicator, if computed) differs by
+// more than 'diffusion_threshold'
+struct DynApRefinement {
+  unsigned int max_depth = 0;                  // no refinement if 0
+  double       diffusion_threshold = 1.0;
+};
+
+// called at the end of each stage of 'dynap_staged' with the number of turns
+// tracked so far. points still alive have 'lost_plane == Plane::no_plane'.
+typedef std::function<void(unsigned int nr_turns, const std::vector<DynApGridPoint>& grid)> DynApStageCallback;
+
+// true if the lattice has no skew fields, vertical kicks, vertical misalignments,
+// kicktables or asymmetric vertical apertures, so that motion is symmetric under y -> -y
+bool has_midplane_symmetry(const Accelerator& accelerator);
+
+// tracks the initial conditions of 'scan' around the closed-orbit and runs its analysis on each of them
+Status::type dynap_scan(
+    const Accelerator& accelerator,
+    std::vector<Pos<double> >& cod,
+    const DynApScan& scan,
+    bool calculate_closed_orbit,
+    std::vector<DynApGridPoint>& grid,
+    unsigned int nr_threads,
+    DynApRunOptions* run_options = nullptr
+  );
+
+// frequency map of a scan with two axes, refined as in 'refinement'. 'grid' returns
+// the initial grid followed by the points added by each level of refinement.
+Status::type dynap_fmap_adaptive(
+    const Accelerator& accelerator,
+    std::vector<Pos<double> >& cod,
+    const DynApScan& scan,
+    const DynApRefinement& refinement,
+    bool calculate_closed_orbit,
+    std::vector<DynApGridPoint>& grid,
+    unsigned int nr_threads
+  );
+
 Status::type dynap_xy(
     const Accelerator& accelerator,
     std::vector<Pos<double> >& cod,
@@ -43,7 +170,9 @@ Status::type dynap_xy(
     unsigned int nrpts_y, double y_min, double y_max,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    MidPlaneSymmetry::type symmetry = MidPlaneSymmetry::automatic,
+    DynApRunOptions* run_options = nullptr
   );
 
 Status::type dynap_ex(
@@ -55,7 +184,28 @@ Status::type dynap_ex(
     unsigned int nrpts_x, double x_min, double x_max,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    DynApRunOptions* run_options = nullptr
+  );
+
+// tracks the 'dynap_xy' or 'dynap_ex' grid as a batch in successive stages:
+// all points are tracked up to stages[0] turns, lost particles are culled and
+// the survivors continue up to stages[1] turns, and so on. 'symmetry' is used
+// as in 'dynap_xy'.
+Status::type dynap_staged(
+    const std::string calc_type,
+    const Accelerator& accelerator,
+    std::vector<Pos<double> >& cod,
+    const std::vector<unsigned int>& stages,
+    const Pos<double>& p0,
+    unsigned int nrpts_1, double min_1, double max_1,
+    unsigned int nrpts_2, double min_2, double max_2,
+    bool calculate_closed_orbit,
+    std::vector<DynApGridPoint>& grid,
+    unsigned int nr_threads,
+    MidPlaneSymmetry::type symmetry = MidPlaneSymmetry::automatic,
+    DynApStageCallback stage_callback = nullptr,
+    DynApRunOptions* run_options = nullptr
   );
 
 // Status::type dynap_ma(
@@ -87,7 +237,8 @@ Status::type dynap_acceptance(
     const std::vector<std::string>& fam_names,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    DynApRunOptions* run_options = nullptr
   );
 
 Status::type dynap_ma(
@@ -178,7 +329,11 @@ Status::type dynap_xyfmap(
     unsigned int nrpts_y, double y_min, double y_max,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    MidPlaneSymmetry::type symmetry = MidPlaneSymmetry::automatic,
+    DynApRunOptions* run_options = nullptr,
+    const DynApRefinement* refinement = nullptr,
+    DynApAnalysis analysis = dynap_analysis_diffusion
   );
 
 Status::type dynap_exfmap(
@@ -190,7 +345,10 @@ Status::type dynap_exfmap(
     unsigned int nrpts_x, double x_min, double x_max,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    DynApRunOptions* run_options = nullptr,
+    const DynApRefinement* refinement = nullptr,
+    DynApAnalysis analysis = dynap_analysis_diffusion
   );
 
 
@@ -18,14 +18,43 @@
 #define _MULTITHREADS_H
 
 #include <pthread.h>
+#include <atomic>
+#include <functional>
 
 struct ThreadSharedData {
-  long task_id;
+  std::atomic<long> task_id;
 	long nr_tasks;
 	void   (*func)(ThreadSharedData*, int, long);
 	pthread_mutex_t *mutex;
+	// progress counters (particle-turns are added by the task functions)
+	std::atomic<long> nr_tasks_done;
+	std::atomic<unsigned long long> nr_particle_turns;
 };
 
+// snapshot of the progress of a multithreaded run
+struct ThreadProgress {
+  long   nr_tasks_done;
+  long   nr_tasks;
+  double nr_particle_turns;     // turns tracked by finished tasks, summed over particles
+  double elapsed_time;          // [s]
+  double tasks_rate;            // [tasks/s]
+  double particle_turns_rate;   // [particle-turns/s]
+  double eta;                   // [s] estimated time to finish the remaining tasks
+};
+
+typedef std::function<void(const ThreadProgress& progress)> ThreadProgressCallback;
+
+// reports progress of multithreaded runs every 'interval' seconds (no reports if <= 0).
+// reports are printed to stdout and/or passed to 'callback', always from the calling thread.
+// if 'callback' throws, the run stops after the tasks already started and the exception is
+// rethrown by 'start_all_threads' once all worker threads have finished.
+void set_thread_progress_report(double interval, bool print = true, ThreadProgressCallback callback = nullptr);
+void add_thread_particle_turns(ThreadSharedData* thread_data, unsigned long long nr_particle_turns);
 void start_all_threads(ThreadSharedData& thread_data, unsigned int nr_threads);
 
+// runs 'task' for task ids 0 to nr_tasks-1 in 'nr_threads' threads, the calling thread included.
+// unlike 'start_all_threads', it keeps no global state and never reports progress, so short
+// parallel sections of library functions may run concurrently.
+void run_parallel_tasks(long nr_tasks, unsigned int nr_threads, const std::function<void(long)>& task);
+
 #endif
@@ -1,10 +1,75 @@
 #ifndef _NAFF_H
 #define _NAFF_H
 
+#include <trackcpp/auxiliary.h>
 #include <trackcpp/pos.h>
 #include <vector>
 
+// estimators of the tunes, from the most accurate and expensive to the cheapest.
+// the fast ones take the largest line of the Hann-windowed FFT of the first 2^k
+// turns (mean removed) and refine its frequency:
+// - naff:          NAFF with two terms (Laskar), over all turns
+// - fft_refined:   as fft_hann, then maximizes the Hann-windowed Fourier amplitude
+//                  over all turns with three parabolic steps
+// - fft_hann:      interpolation between the line and its largest neighbour for the
+//                  shape of the Hann window (Bartolini et al.)
+// - fft_parabolic: vertex of the parabola through the logarithms of the line and its neighbours
+// deviations from naff for the 109 orbits of tests/si_v07_c05.txt surviving 2048 turns
+// in a 25x7 grid with x in [-10,10] mm and y in [0.1,2.5] mm (90% / 99% / max, and cost):
+//                   500 turns                    1000 turns
+// - fft_refined:   3e-6 / 3e-5 / 1.2e-4 (1/5)    4e-7 / 2e-5 / 4e-5 (1/4)
+// - fft_hann:      9e-6 / 4e-4 / 7.6e-4 (1/15)   9e-7 / 4e-5 / 2e-4 (1/12)
+// - fft_parabolic: 6e-5 / 3e-4 / 8.7e-4 (1/15)   3e-5 / 4e-5 / 2e-4 (1/13)
+// with 2048 turns the three differ from naff by more than 1e-3 for one orbit, whose
+// largest FFT line is not the one selected by naff.
+struct NaffMethod {
+  enum type {
+    naff = 0,
+    fft_refined = 1,
+    fft_hann = 2,
+    fft_parabolic = 3
+  };
+};
+
 /* Frequency Map Analysis */
-void naff_run(const std::vector<Pos<double>>& data, double& tunex, double& tuney);
+void naff_run(const std::vector<Pos<double>>& data, double& tunex, double& tuney, NaffMethod::type method = NaffMethod::naff);
+
+// turn-by-turn data of a particle, received one turn at a time and stored as the
+// complex signals (rx + i px) and (ry + i py) analysed by NAFF. buffers keep their
+// capacity when cleared, so an instance reused by a thread does not allocate per particle.
+class NaffBuffer {
+public:
+  void         clear(unsigned int nr_turns = 0);  // empties the buffer, reserving room for 'nr_turns' turns
+  void         push_back(const Pos<double>& p) { zx.push_back(p.rx); zx.push_back(p.px); zy.push_back(p.ry); zy.push_back(p.py); }
+  unsigned int size() const { return zx.size() / 2; }
+  // tunes of the 'nr_turns' turns starting at turn 'first', as 'naff_run' (inconsistent_dimensions
+  // if the buffer does not hold them)
+  Status::type run(unsigned int first, unsigned int nr_turns, double& tunex, double& tuney, NaffMethod::type method = NaffMethod::naff) const;
+private:
+  std::vector<double> zx, zy;   // interleaved real and imaginary parts
+};
+
+// turn-by-turn data of many particles with the same number of turns, stored by
+// coordinate, turn and particle (particles vary fastest). 'run' analyses the
+// particles in blocks: the windowed FFT that locates the first frequency of each
+// plane is done in lockstep for all particles of a block, and the refinement of
+// the frequencies particle by particle. tunes are the same as those of 'naff_run'
+// on each trajectory. 'run' keeps no shared state, so threads may each run a batch.
+class NaffBatch {
+public:
+  NaffBatch(unsigned int nr_particles = 0, unsigned int nr_turns = 0) { resize(nr_particles, nr_turns); }
+  void         resize(unsigned int nr_particles, unsigned int nr_turns);
+  void         set(unsigned int particle, unsigned int turn, const Pos<double>& p);
+  unsigned int nr_particles() const { return np; }
+  unsigned int nr_turns() const { return nt; }
+  // tunes of each particle over the 'nr_turns' turns starting at turn 'first'
+  // (inconsistent_dimensions, with NaN tunes, if the batch does not hold them)
+  Status::type run(unsigned int first, unsigned int nr_turns, std::vector<double>& tunex, std::vector<double>& tuney) const;
+  static const unsigned int block_size = 8;
+private:
+  void         run_block(unsigned int first, unsigned int nr_turns, unsigned int particle, double* tunex, double* tuney) const;
+  unsigned int np = 0, nt = 0;
+  std::vector<double> rx, px, ry, py;
+};
 
 #endif
@@ -49,6 +49,158 @@ Status::type calc_twiss(const Accelerator& accelerator,
                         Matrix& m66,
                         std::vector<Twiss>& twiss,
                         Twiss twiss0 = Twiss(),
-                        bool closed_flag = false);
+                        bool closed_flag = false,
+                        unsigned int nr_threads = 1);
+
+Status::type calc_twiss_offmomentum(const Accelerator& accelerator,
+                                    const std::vector<double>& energy_offsets,
+                                    std::vector<std::vector<Twiss> >& twiss,
+                                    std::vector<Matrix>& m66,
+                                    std::vector<double>& tunex,
+                                    std::vector<double>& tuney,
+                                    unsigned int nr_threads = 1);
+
+// tunes as power series of the energy deviation, tune(de) = tunex[0] + tunex[1] * de + ...
+// + tunex[order] * de^order (tunex[1] is the linear chromaticity), from a single pass of a
+// truncated power series map around the on-momentum 4D closed orbit 'fixed_point' (cavity off).
+// order is at most 4. the zeroth order terms are fractional tunes.
+Status::type calc_tune_series(const Accelerator& accelerator,
+                              const Pos<double>& fixed_point,
+                              unsigned int order,
+                              std::vector<double>& tunex,
+                              std::vector<double>& tuney);
+
+// an element parameter varied as a single knob over a set of elements (a family, for instance):
+// entry 'n' of polynom_a or polynom_b of multipoles and bends, hkick or vkick of correctors or
+// voltage of cavities.
+class OpticsKnob {
+public:
+  enum parameter_type { polynom_a, polynom_b, hkick, vkick, voltage };
+  parameter_type            parameter;
+  unsigned int              n;
+  std::vector<unsigned int> elements;
+  OpticsKnob(parameter_type parameter_ = polynom_b, unsigned int n_ = 0, const std::vector<unsigned int>& elements_ = std::vector<unsigned int>()) :
+    parameter(parameter_), n(n_), elements(elements_) {}
+};
+
+// twiss at the entrance of the given elements (index of the last one plus one for the end of the
+// lattice) of the periodic solution around 'fixed_point' (4D, or 6D if the cavity is on), and its
+// first derivatives with respect to the knobs, from a single pass over the lattice:
+// jacobian[k][i] holds the derivatives of the orbit, beta, alpha, phase and dispersion functions
+// of twiss[i] with respect to knobs[k], and dtunex[k], dtuney[k] those of the tunes. phases are
+// given modulo 2 pi.
+Status::type calc_optics_jacobian(const Accelerator& accelerator,
+                                  const Pos<double>& fixed_point,
+                                  const std::vector<OpticsKnob>& knobs,
+                                  const std::vector<unsigned int>& elements,
+                                  std::vector<Twiss>& twiss,
+                                  std::vector<std::vector<Twiss> >& jacobian,
+                                  std::vector<double>& dtunex,
+                                  std::vector<double>& dtuney);
+
+// orbit response matrix, 'respm' in row-major order: rows are the horizontal orbit at the entrance
+// of the 'bpms' (the number of elements for the end of the lattice), then the vertical one, and
+// columns the kicks [rad] of 'hcorrectors' in their plane, then those of 'vcorrectors'. the
+// analytic mode uses the optics of a single 'calc_twiss' (fixed energy, thin kicks); the tracking
+// mode finds the closed orbit with each corrector kicked by +/- kick/2, with 'nr_threads'
+// threads. correctors are corrector elements or thick multipoles, whose dipolar terms are then
+// kicked; other elements return passmethod_not_implemented in both modes.
+struct OrbitResponse {
+  enum type { analytic = 0, tracking = 1 };
+};
+
+Status::type calc_orbit_response_matrix(const Accelerator& accelerator,
+                                        const std::vector<unsigned int>& bpms,
+                                        const std::vector<unsigned int>& hcorrectors,
+                                        const std::vector<unsigned int>& vcorrectors,
+                                        std::vector<double>& respm,
+                                        OrbitResponse::type mode = OrbitResponse::analytic,
+                                        unsigned int nr_threads = 1,
+                                        double kick = 1e-6);
+
+// radiation integrals of the horizontal bends and equilibrium parameters derived from them
+class RadiationIntegrals {
+public:
+  double i1, i2, i3, i4, i5;      // [m], [1/m], [1/m^2], [1/m], [1/m]
+  double alphac;                  // momentum compaction
+  double u0;                      // [eV] energy loss per turn
+  double jx, jy, je;              // damping partition numbers
+  double taux, tauy, taue;        // [s] damping times
+  double espread;                 // relative energy spread
+  double emitx;                   // [m.rad] natural emittance
+  RadiationIntegrals() : i1(0), i2(0), i3(0), i4(0), i5(0), alphac(0), u0(0),
+                         jx(0), jy(0), je(0), taux(0), tauy(0), taue(0), espread(0), emitx(0) {}
+};
+
+// twiss at the entrance of every element, as in 'calc_twiss' for the periodic solution, and the
+// radiation integrals of the lattice with the equilibrium parameters that follow from them,
+// accumulated in the same propagation of the element matrices. inside bends, the optics are
+// sampled at the kicks of the integrator.
+Status::type calc_radiation_integrals(const Accelerator& accelerator,
+                                      const Pos<double>& fixed_point,
+                                      Matrix& m66,
+                                      std::vector<Twiss>& twiss,
+                                      RadiationIntegrals& integrals,
+                                      unsigned int nr_threads = 1);
+
+// equilibrium parameters of the eigenmodes of the 6D one-turn matrix of a radiating lattice
+class BeamEnvelope {
+public:
+  double tunex, tuney, tunes;     // fractional tunes (synchrotron tune in [0, 0.5])
+  double taux, tauy, taue;        // [s] damping times
+  double emitx, emity, emite;     // [m.rad], [m.rad], [m] equilibrium emittances
+  double espread;                 // relative energy spread
+  double bunlen;                  // [m] bunch length
+  BeamEnvelope() : tunex(0), tuney(0), tunes(0), taux(0), tauy(0), taue(0),
+                   emitx(0), emity(0), emite(0), espread(0), bunlen(0) {}
+};
+
+// equilibrium beam matrices (second moments around the closed orbit) at the entrance of every
+// element of a lattice with radiation and cavity on, from Ohmi's envelope method, and the
+// parameters of the eigenmodes of its one-turn matrix 'm66'. the diffusion of quantum
+// excitation is sampled at the kicks of multipoles and bends and accumulated with the element
+// matrices in a single pass. 'fixed_point' is the 6D closed orbit (see 'track_findorbit6').
+Status::type calc_beam_envelope(const Accelerator& accelerator,
+                                const Pos<double>& fixed_point,
+                                Matrix& m66,
+                                std::vector<Matrix>& sigmas,
+                                BeamEnvelope& envelope);
+
+// first-order maps of the elements of a lattice, linearized around the orbit found in 'build',
+// and their products over segments of the lattice, kept in a balanced binary tree. after some
+// elements of the accelerator are changed (strengths, kicks, misalignments), 'set_dirty' and
+// 'update' recompute only their maps and the O(log n) products above them, so that the one-turn
+// matrix, closed orbit, tunes and twiss at chosen elements are cheap to reevaluate in
+// optimization and orbit-correction loops. maps are affine, so orbit changes are followed to
+// first order around the reference orbit; a new 'build' relinearizes around the current one.
+// the accelerator is referenced, not copied, and has to outlive the context.
+class OpticsContext {
+public:
+  OpticsContext() : nodes(2) {}
+  Status::type build(const Accelerator& accelerator, const Pos<double>& fixed_point);
+  void         set_dirty(unsigned int element);   // element whose parameters have changed
+  Status::type update();
+  void         get_m66(Matrix& m66) const;
+  Pos<double>  get_closed_orbit() const;          // 6D if the cavity is on, otherwise 4D
+  void         get_tunes(double& tunex, double& tuney) const;
+  // twiss at the entrance of the given elements (index of the last one plus one for the end of the
+  // lattice), from the periodic solution if 'twiss0' is undefined. phases are given modulo 2 pi.
+  Status::type get_twiss(const std::vector<unsigned int>& elements, std::vector<Twiss>& twiss, Twiss twiss0 = Twiss()) const;
+private:
+  struct AffineMap {
+    double m[6][6];
+    double v[6];
+    double length;
+    AffineMap();
+  };
+  static AffineMap compose(const AffineMap& first, const AffineMap& second);
+  Status::type element_map(unsigned int element, AffineMap& map) const;
+  AffineMap    prefix_map(unsigned int element) const;
+  const Accelerator*         accelerator = nullptr;
+  unsigned int               leaves = 0;
+  std::vector<AffineMap>     nodes;    // node i has children 2i and 2i+1; element maps start at 'leaves'
+  std::vector<Pos<double> >  orbit;    // reference orbit at the entrance of each element
+  std::vector<unsigned int>  dirty;
+};
 
 #endif
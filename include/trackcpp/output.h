@@ -25,7 +25,9 @@
 #include <cstdlib>
 
 Status::type print_closed_orbit      (const Accelerator& accelerator, const std::vector<Pos<double>>&    cod,  const std::string& filename = "cod_out.txt");
-Status::type print_dynapgrid         (const Accelerator& accelerator, const std::vector<DynApGridPoint>& grid, const std::string& label, const std::string& filename = "dynap_out.txt", bool print_tunes=false);
+Status::type print_dynapgrid         (const Accelerator& accelerator, const std::vector<DynApGridPoint>& grid, const std::string& label, const std::string& filename = "dynap_out.txt", bool print_tunes=false, bool print_chaos=false);
+Status::type print_dynapgrid_partial (const Accelerator& accelerator, const std::vector<DynApGridPoint>& grid, const std::vector<unsigned int>& points, unsigned int shard_index, unsigned int nr_shards, const std::string& label, const std::string& filename, bool print_tunes=false, bool print_chaos=false);
+Status::type merge_dynapgrid_partials(const std::vector<std::string>& partial_filenames, const std::string& filename = "dynap_out.txt");
 Status::type print_tracking_ringpass (const Accelerator& accelerator, const std::vector<Pos<double>>& points, const std::string& filename = "track_linepass_out.txt");
 Status::type print_tracking_linepass (const Accelerator& accelerator, const std::vector<Pos<double>>& points, const unsigned int start_element, const std::string& filename);
 void         print_header            (FILE* fp);
@@ -47,14 +47,23 @@
 template <typename T> inline T SQR(const T& X) { return X*X; }
 template <typename T> inline T POW3(const T& X) { return X*X*X; }
 
+// r += a * b and r -= a * b. the overloads for Tpsa (tpsa.h) accumulate the products in
+// place, without the temporaries of the expressions; for doubles results are the same.
+template <typename T, typename S> inline void add_product(T& r, const S& a, const T& b) { r += a * b; }
+template <typename T, typename S> inline void sub_product(T& r, const S& a, const T& b) { r -= a * b; }
+
 template <typename T>
 inline void drift(Pos<T>& pos, const double& length) {
 
   T pnorm = 1 / (1 + pos.de);
   T norml = length * pnorm;
-  pos.rx += norml * pos.px;
-  pos.ry += norml * pos.py;
-  pos.dl += 0.5 * norml * pnorm * (pos.px*pos.px + pos.py*pos.py);
+  add_product(pos.rx, norml, pos.px);
+  add_product(pos.ry, norml, pos.py);
+  T p2 = pos.px * pos.px;
+  add_product(p2, pos.py, pos.py);
+  T f = norml * pnorm;
+  f *= 0.5;
+  add_product(pos.dl, f, p2);
 }
 
 //template <typename T>
@@ -62,9 +71,9 @@ inline void drift(Pos<T>& pos, const double& length) {
 //  drift(pos, length);
 //}
 
-template <typename T>
-inline void calcpolykick(const Pos<T> &pos, const std::vector<double>& polynom_a,
-                         const std::vector<double>& polynom_b,
+template <typename T, typename P>
+inline void calcpolykick(const Pos<T> &pos, const std::vector<P>& polynom_a,
+                         const std::vector<P>& polynom_b,
                          T& real_sum, T& imag_sum) {
 
   const int n = std::min(polynom_b.size(), polynom_a.size());
@@ -74,9 +83,14 @@ inline void calcpolykick(const Pos<T> &pos, const std::vector<double>& polynom_a
     real_sum = polynom_b[n-1];
     imag_sum = polynom_a[n-1];
     for(int i=n-2;i>=0;--i) {
-      T real_sum_tmp = real_sum * pos.rx - imag_sum * pos.ry + polynom_b[i];
-      imag_sum = imag_sum * pos.rx + real_sum * pos.ry + polynom_a[i];
+      T real_sum_tmp = real_sum * pos.rx;
+      sub_product(real_sum_tmp, imag_sum, pos.ry);
+      real_sum_tmp += polynom_b[i];
+      T imag_sum_tmp = imag_sum * pos.rx;
+      add_product(imag_sum_tmp, real_sum, pos.ry);
+      imag_sum_tmp += polynom_a[i];
       real_sum = real_sum_tmp;
+      imag_sum = imag_sum_tmp;
     }
   }
 }
@@ -96,8 +110,19 @@ T b2_perp(const T& bx, const T& by, const T& rx, const T& px,
           const T& ry, const T& py, const double& irho = 0) {
 
   // Calculates sqr(|B x e|) , where e is a unit vector in the direction of velocity
-  T v_norm2 = 1 /(SQR(1+irho*rx) + SQR(px) + SQR(py));
-  return((SQR(by*(1+irho*rx)) + SQR(bx*(1+irho*rx)) + SQR(bx*py - by*px))*v_norm2);
+  T h = irho * rx;
+  h += 1;
+  T v2 = h * h;
+  add_product(v2, px, px);
+  add_product(v2, py, py);
+  T v_norm2 = 1 / v2;
+  const T bxh = bx * h, byh = by * h;
+  T bxe = bx * py;
+  sub_product(bxe, by, px);
+  T b2 = byh * byh;
+  add_product(b2, bxh, bxh);
+  add_product(b2, bxe, bxe);
+  return b2 * v_norm2;
 }
 
 template <typename T>
@@ -119,10 +144,10 @@ Status::type kicktablethinkick(Pos<T>& pos, const Kicktable* kicktable,
   return status;
 }
 
-template <typename T>
+template <typename T, typename P>
 void strthinkick(Pos<T>& pos, const double& length,
-                 const std::vector<double>& polynom_a,
-                 const std::vector<double>& polynom_b,
+                 const std::vector<P>& polynom_a,
+                 const std::vector<P>& polynom_b,
                  const Accelerator& accelerator) {
 
   T real_sum, imag_sum;
@@ -142,14 +167,14 @@ void strthinkick(Pos<T>& pos, const double& length,
     pos.px = px / pnorm;
     pos.py = py / pnorm;
   }
-  pos.px -= length * real_sum;
-  pos.py += length * imag_sum;
+  sub_product(pos.px, length, real_sum);
+  add_product(pos.py, length, imag_sum);
 }
 
-template <typename T>
+template <typename T, typename P>
 void bndthinkick(Pos<T>& pos, const double& length,
-                 const std::vector<double>& polynom_a,
-                 const std::vector<double>& polynom_b,
+                 const std::vector<P>& polynom_a,
+                 const std::vector<P>& polynom_b,
                  const double& irho,
                  const Accelerator& accelerator) {
 
@@ -171,9 +196,47 @@ void bndthinkick(Pos<T>& pos, const double& length,
     pos.px = px / pnorm;
     pos.py = py / pnorm;
   }
-  pos.px -= length * (real_sum - (de - pos.rx * irho) * irho);
-  pos.py += length * imag_sum;
-  pos.dl += length * irho * pos.rx;
+  // kick of the curvature: (de - rx * irho) * irho
+  sub_product(de, irho, pos.rx);
+  de *= irho;
+  T kick(real_sum);
+  kick -= de;
+  sub_product(pos.px, length, kick);
+  add_product(pos.py, length, imag_sum);
+  add_product(pos.dl, length * irho, pos.rx);
+}
+
+// receives the map around each kick of a multipole or bend, half of the length of the kick
+// before it and half after it, and at the edges of bends (see calc_radiation_integrals and
+// calc_beam_envelope). the default does nothing.
+struct KickObserver {
+  template <typename T> void edge(const Pos<T>& pos, const double& edge_angle) {}
+  template <typename T> void kick(const Pos<T>& pos, const double& length) {}
+};
+
+template <typename T, typename P, typename O>
+inline void observed_strthinkick(Pos<T>& pos, const double& length,
+                                 const std::vector<P>& polynom_a,
+                                 const std::vector<P>& polynom_b,
+                                 const Accelerator& accelerator,
+                                 O& observer) {
+
+  observer.kick(pos, 0.5 * length);
+  strthinkick<T>(pos, length, polynom_a, polynom_b, accelerator);
+  observer.kick(pos, 0.5 * length);
+}
+
+template <typename T, typename P, typename O>
+inline void observed_bndthinkick(Pos<T>& pos, const double& length,
+                                 const std::vector<P>& polynom_a,
+                                 const std::vector<P>& polynom_b,
+                                 const double& irho,
+                                 const Accelerator& accelerator,
+                                 O& observer) {
+
+  observer.kick(pos, 0.5 * length);
+  bndthinkick<T>(pos, length, polynom_a, polynom_b, irho, accelerator);
+  observer.kick(pos, 0.5 * length);
 }
 
 template <typename T>
@@ -200,18 +263,30 @@ inline void translate_pos(Pos<T> &pos, const double* t) {
   pos.de += t[4]; pos.dl += t[5];
 }
 
+// r = Ri[0] * rx0 + Ri[1] * px0 + ... + Ri[5] * dl0
+template <typename T>
+inline void rotate_coordinate(T& r, const double* Ri, const T& rx0, const T& px0, const T& ry0, const T& py0, const T& de0, const T& dl0) {
+
+  r = Ri[0] * rx0;
+  add_product(r, Ri[1], px0);
+  add_product(r, Ri[2], ry0);
+  add_product(r, Ri[3], py0);
+  add_product(r, Ri[4], de0);
+  add_product(r, Ri[5], dl0);
+}
+
 template <typename T>
 inline void rotate_pos(Pos<T> &pos, const double* R) {
 
   const T rx0 = pos.rx, px0 = pos.px;
   const T ry0 = pos.ry, py0 = pos.py;
   const T de0 = pos.de, dl0 = pos.dl;
-  pos.rx = R[0*6+0] * rx0 + R[0*6+1] * px0 + R[0*6+2] * ry0 + R[0*6+3] * py0 + R[0*6+4] * de0 + R[0*6+5] * dl0;
-  pos.px = R[1*6+0] * rx0 + R[1*6+1] * px0 + R[1*6+2] * ry0 + R[1*6+3] * py0 + R[1*6+4] * de0 + R[1*6+5] * dl0;
-  pos.ry = R[2*6+0] * rx0 + R[2*6+1] * px0 + R[2*6+2] * ry0 + R[2*6+3] * py0 + R[2*6+4] * de0 + R[2*6+5] * dl0;
-  pos.py = R[3*6+0] * rx0 + R[3*6+1] * px0 + R[3*6+2] * ry0 + R[3*6+3] * py0 + R[3*6+4] * de0 + R[3*6+5] * dl0;
-  pos.de = R[4*6+0] * rx0 + R[4*6+1] * px0 + R[4*6+2] * ry0 + R[4*6+3] * py0 + R[4*6+4] * de0 + R[4*6+5] * dl0;
-  pos.dl = R[5*6+0] * rx0 + R[5*6+1] * px0 + R[5*6+2] * ry0 + R[5*6+3] * py0 + R[5*6+4] * de0 + R[5*6+5] * dl0;
+  rotate_coordinate(pos.rx, &R[0*6], rx0, px0, ry0, py0, de0, dl0);
+  rotate_coordinate(pos.px, &R[1*6], rx0, px0, ry0, py0, de0, dl0);
+  rotate_coordinate(pos.ry, &R[2*6], rx0, px0, ry0, py0, de0, dl0);
+  rotate_coordinate(pos.py, &R[3*6], rx0, px0, ry0, py0, de0, dl0);
+  rotate_coordinate(pos.de, &R[4*6], rx0, px0, ry0, py0, de0, dl0);
+  rotate_coordinate(pos.dl, &R[5*6], rx0, px0, ry0, py0, de0, dl0);
 }
 
 template <typename T>
@@ -244,9 +319,16 @@ Status::type pm_drift_pass(Pos<T> &pos, const Element &elem,
   return Status::success;
 }
 
-template <typename T>
-Status::type pm_str_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
-                                           const Accelerator& accelerator) {
+// the passes below take the element parameters that they use separately, as values of type P:
+// doubles from the element in the pm_* passes, or truncated power series when the parameters are
+// variables of the map (see calc_optics_jacobian).
+
+template <typename T, typename P, typename O = KickObserver>
+Status::type str_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
+                                        const std::vector<P>& polynom_a,
+                                        const std::vector<P>& polynom_b,
+                                        const Accelerator& accelerator,
+                                        O observer = O()) {
 
   global_2_local(pos, elem);
   double sl = elem.length / float(elem.nr_steps);
@@ -254,15 +336,13 @@ Status::type pm_str_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
   double l2 = sl * DRIFT2;
   double k1 = sl * KICK1;
   double k2 = sl * KICK2;
-  const std::vector<double> &polynom_a = elem.polynom_a;
-  const std::vector<double> &polynom_b = elem.polynom_b;
   for(unsigned int i=0; i<elem.nr_steps; ++i) {
     drift(pos, l1);
-    strthinkick<T>(pos, k1, polynom_a, polynom_b, accelerator);
+    observed_strthinkick(pos, k1, polynom_a, polynom_b, accelerator, observer);
     drift(pos, l2);
-    strthinkick<T>(pos, k2, polynom_a, polynom_b, accelerator);
+    observed_strthinkick(pos, k2, polynom_a, polynom_b, accelerator, observer);
     drift<T>(pos, l2);
-    strthinkick<T>(pos, k1, polynom_a, polynom_b, accelerator);
+    observed_strthinkick(pos, k1, polynom_a, polynom_b, accelerator, observer);
     drift<T>(pos, l1);
   }
   local_2_global(pos, elem);
@@ -270,43 +350,59 @@ Status::type pm_str_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
 }
 
 template <typename T>
-Status::type pm_bnd_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
+Status::type pm_str_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
                                            const Accelerator& accelerator) {
 
+  return str_mpole_symplectic4_pass(pos, elem, elem.polynom_a, elem.polynom_b, accelerator);
+}
+
+template <typename T, typename P, typename O = KickObserver>
+Status::type bnd_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
+                                        const std::vector<P>& polynom_a,
+                                        const std::vector<P>& polynom_b,
+                                        const Accelerator& accelerator,
+                                        O observer = O()) {
+
   double sl = elem.length / float(elem.nr_steps);
   double l1 = sl * DRIFT1;
   double l2 = sl * DRIFT2;
   double k1 = sl * KICK1;
   double k2 = sl * KICK2;
   double irho = elem.angle / elem.length;
-  const std::vector<double> &polynom_a = elem.polynom_a;
-  const std::vector<double> &polynom_b = elem.polynom_b;
 
   global_2_local(pos, elem);
+  observer.edge(pos, elem.angle_in);
   edge_fringe(pos, irho, elem.angle_in, elem.fint_in, elem.gap);
   for(unsigned int i=0; i<elem.nr_steps; ++i) {
     drift<T>(pos, l1);
-    bndthinkick<T>(pos, k1, polynom_a, polynom_b, irho, accelerator);
+    observed_bndthinkick(pos, k1, polynom_a, polynom_b, irho, accelerator, observer);
     drift<T>(pos, l2);
-    bndthinkick<T>(pos, k2, polynom_a, polynom_b, irho, accelerator);
+    observed_bndthinkick(pos, k2, polynom_a, polynom_b, irho, accelerator, observer);
     drift<T>(pos, l2);
-    bndthinkick<T>(pos, k1, polynom_a, polynom_b, irho, accelerator);
+    observed_bndthinkick(pos, k1, polynom_a, polynom_b, irho, accelerator, observer);
     drift<T>(pos, l1);
   }
   edge_fringe(pos, irho, elem.angle_out, elem.fint_out, elem.gap);
+  observer.edge(pos, elem.angle_out);
   local_2_global(pos, elem);
 
   return Status::success;
 }
 
-
 template <typename T>
-Status::type pm_corrector_pass(Pos<T> &pos, const Element &elem,
-                               const Accelerator& accelerator) {
+Status::type pm_bnd_mpole_symplectic4_pass(Pos<T> &pos, const Element &elem,
+                                           const Accelerator& accelerator) {
+
+  return bnd_mpole_symplectic4_pass(pos, elem, elem.polynom_a, elem.polynom_b, accelerator);
+}
+
+
+template <typename T, typename P>
+Status::type corrector_pass(Pos<T> &pos, const Element &elem,
+                            const P& xkick, const P& ykick,
+                            const Accelerator& accelerator) {
 
   global_2_local(pos, elem);
-  const double& xkick = elem.hkick;
-  const double& ykick = elem.vkick;
   if (elem.length == 0) {
     T &px = pos.px, &py = pos.py;
     px += xkick;
@@ -331,15 +427,23 @@ Status::type pm_corrector_pass(Pos<T> &pos, const Element &elem,
   return Status::success;
 }
 
-
 template <typename T>
-Status::type pm_cavity_pass(Pos<T> &pos, const Element &elem,
-                            const Accelerator& accelerator) {
+Status::type pm_corrector_pass(Pos<T> &pos, const Element &elem,
+                               const Accelerator& accelerator) {
+
+  return corrector_pass(pos, elem, elem.hkick, elem.vkick, accelerator);
+}
+
+
+template <typename T, typename P>
+Status::type cavity_pass(Pos<T> &pos, const Element &elem,
+                         const P& voltage,
+                         const Accelerator& accelerator) {
 
   if (not accelerator.cavity_on) return pm_drift_pass(pos, elem, accelerator);
 
   global_2_local(pos, elem);
-  double nv = elem.voltage / accelerator.energy;
+  P nv = voltage / accelerator.energy;
   if (elem.length == 0) {
     T &de = pos.de, &dl = pos.dl;
     de +=  -nv * sin(TWOPI*elem.frequency * dl/ light_speed);
@@ -366,6 +470,13 @@ Status::type pm_cavity_pass(Pos<T> &pos, const Element &elem,
   return Status::success;
 }
 
+template <typename T>
+Status::type pm_cavity_pass(Pos<T> &pos, const Element &elem,
+                            const Accelerator& accelerator) {
+
+  return cavity_pass(pos, elem, elem.voltage, accelerator);
+}
+
 template <typename T>
 Status::type pm_thinquad_pass(Pos<T> &pos, const Element &elem,
                               const Accelerator& accelerator) {
@@ -40,11 +40,21 @@
 //     from the C++ community?
 // 04. Is it worth trying to implement syntactic sugars with expression templates in order
 //     to minimize the problem of temporaries? It is not clear for me that, for the TPS class,
-//     something is to be gained in terms of efficiency...
+//     something is to be gained in terms of efficiency... 'add_product' and 'sub_product'
+//     accumulate products in place instead, and are what passmethods use for the hot
+//     expressions (the non-member versions also take doubles).
 // 05. Is it worth trying to implement multiplication with FFT? How to map multivariate
 //     polynomials into (can it be onto?) univariate polynomials of higher order? The prospects
 //     of using FFT are interesting since the Beam Dynamics community does not seem to have
 //     realized that the method could speed up calculation of taylor maps...
+// 06. Each element keeps in 'order' an upper bound of the order of its non-zero coefficients,
+//     so that products skip the blocks of higher orders, and products also skip the rows of
+//     zero coefficients of the left operand. Maps of drifts and low-order elements, and maps
+//     of midplane symmetric lattices, have many of them. Code that writes to 'c' directly
+//     has to keep 'order' consistent ('set_c' sets it to N).
+// 07. The static tables are thread-safe: binomial coefficients are built at compile time and
+//     the OSIP tables are filled by 'tables' on the first product, once, even if several
+//     threads start computing maps at the same time. Constructors do not touch them.
 
 
 
@@ -65,6 +75,21 @@ template <>                    struct et_binomial<0,0> { enum { val = 1 }; };
 template <int V, int N, int n> struct et_osip          { enum { val = (V * et_binomial<V+n,n>::val * et_binomial<V+N-n,N-n>::val)/(V+n) + et_osip<V,N,n-1>::val }; };
 template <int V, int N>        struct et_osip<V,N,0>   { enum { val = et_binomial<V,0>::val * et_binomial<V+N,N>::val }; };
 
+// table of binomial coefficients built at compile time (constant initialization, so it is ready
+// before any code runs and is safely shared among threads). entry k holds the number of monomials
+// of order n in v variables, with k = ((v+n-1)*(v+n))/2 + n, as read by Tpsa::C.
+template <unsigned int... I>                struct et_indices {};
+template <unsigned int M, unsigned int... I> struct et_make_indices : et_make_indices<M-1, M-1, I...> {};
+template <unsigned int... I>                struct et_make_indices<0, I...> { typedef et_indices<I...> type; };
+
+constexpr unsigned int et_binomial_value(unsigned int s, unsigned int n) { return (n == 0) ? 1 : (et_binomial_value(s, n-1) * (s-n+1)) / n; }
+constexpr unsigned int et_binomial_row  (unsigned int k, unsigned int s = 0) { return (k <= (s*(s+1))/2) ? s : et_binomial_row(k, s+1); }
+constexpr unsigned int et_binomial_entry(unsigned int k) { return et_binomial_value(et_binomial_row(k), k - ((et_binomial_row(k)-1)*et_binomial_row(k))/2); }
+
+template <unsigned int SIZE, typename = typename et_make_indices<SIZE>::type> struct et_binomial_table;
+template <unsigned int SIZE, unsigned int... I> struct et_binomial_table<SIZE, et_indices<I...>> { static const unsigned int val[SIZE]; };
+template <unsigned int SIZE, unsigned int... I> const unsigned int et_binomial_table<SIZE, et_indices<I...>>::val[SIZE] = { et_binomial_entry(I)... };
+
 
 // Forward Declarations
 // --------------------
@@ -132,6 +157,12 @@ public:
 	Tpsa& operator *= (const Tpsa& o_);
 	Tpsa& operator /= (const Tpsa& o_);
 
+	// in-place accumulation of products, without the temporaries of '*this += a_ * b_'
+	Tpsa& add_product (const Tpsa& a_, const Tpsa& b_) { return accumulate_product(a_, b_, false); }
+	Tpsa& sub_product (const Tpsa& a_, const Tpsa& b_) { return accumulate_product(a_, b_, true); }
+	Tpsa& add_product (const TYPE& a_, const Tpsa& b_) { return accumulate_product(a_, b_); }
+	Tpsa& sub_product (const TYPE& a_, const Tpsa& b_) { return accumulate_product(-a_, b_); }
+
 	// boolean operators
 	bool operator == (const TYPE& o_) const;
 	bool operator != (const TYPE& o_) const;
@@ -155,22 +186,32 @@ public:
 	static unsigned int  get_osip_size() { return et_osip<V,N,N>::val; }
 	static unsigned int  get_index (const unsigned int* power_);
 	static void          get_power (const unsigned int idx, unsigned int* power);
+	unsigned int         get_order()     const { return order; }
 	const TYPE&          get_c(unsigned int index) const { return c[index]; }
-	TYPE&                set_c(unsigned int index)  { return c[index]; }
+	TYPE&                set_c(unsigned int index)  { order = N; return c[index]; }
 
 //private:
 public:
 
 	TYPE                c[et_binomial<N+V,V>::val];
-	static bool         init;
-	static unsigned int binomials[((N+V+1)*(N+V+2))>>1];
+	unsigned int        order;   // coefficients of orders above it are zero
 	static void         initialization();
+	static bool         tables();   // fills osip, osip_row and powers once, on first call from any thread
 	static unsigned int osip[et_osip<V,N,N>::val];
 	static unsigned int powers[et_osip<V,N,N>::val][V];
+	static unsigned int osip_row[et_binomial<N+V,V>::val];   // first osip entry of the products of each coefficient
 
-	static unsigned int& C(unsigned int v, unsigned int n) { return binomials[(((v+n-1)*(n+v))>>1) + n]; }
+	static unsigned int  C(unsigned int v, unsigned int n) { return et_binomial_table<(((N+V+1)*(N+V+2))>>1)>::val[(((v+n-1)*(n+v))>>1) + n]; }
 	static unsigned int  first_at_order(unsigned int order) { return (order==0) ? 0 : C(V,order-1); }
 	static unsigned int  last_at_order (unsigned int order) { return (order==0) ? 1 : C(V,order); }
+	static bool          finite(const TYPE& a) { return a - a == TYPE(0); }
+
+	// scalar operations leave the zero coefficients above 'order' untouched, unless the scalar
+	// would turn them into NaNs (non-finite factors, division by zero), as in the full product.
+	Tpsa& scale(const TYPE& o_, bool divide);
+
+	Tpsa& accumulate_product(const Tpsa& a_, const Tpsa& b_, bool subtract);
+	Tpsa& accumulate_product(const TYPE& a_, const Tpsa& b_);
 
 };
 
@@ -179,10 +220,9 @@ public:
 // Static Members
 // --------------
 
-template <unsigned int V, unsigned int N, typename TYPE> bool Tpsa<V,N,TYPE>::init = true;
-template <unsigned int V, unsigned int N, typename TYPE> unsigned int Tpsa<V,N,TYPE>::binomials[((N+V+1)*(N+V+2))>>1];
 template <unsigned int V, unsigned int N, typename TYPE> unsigned int Tpsa<V,N,TYPE>::osip[et_osip<V,N,N>::val];
 template <unsigned int V, unsigned int N, typename TYPE> unsigned int Tpsa<V,N,TYPE>::powers[et_osip<V,N,N>::val][V];
+template <unsigned int V, unsigned int N, typename TYPE> unsigned int Tpsa<V,N,TYPE>::osip_row[et_binomial<N+V,V>::val];
 
 
 // Implementations: CONSTRUCTORS
@@ -190,16 +230,17 @@ template <unsigned int V, unsigned int N, typename TYPE> unsigned int Tpsa<V,N,T
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE>::Tpsa(const TYPE& a_, const unsigned int v_) {
-	if (init) initialization();
 	memset(this->c, 0, sizeof(TYPE)*get_size());
 	//for(unsigned int i=1; i<get_size(); i++) c[i] = 0;
 	c[0] = a_;
-	if (v_<V) c[v_+1] = 1;
+	order = 0;
+	if ((v_<V) and (N>0)) { c[v_+1] = 1; order = 1; }
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE>::Tpsa(const Tpsa<V,N,TYPE>& a_)  {
 	for(unsigned int i=0; i<get_size(); i++) c[i] = a_.c[i];
+	order = a_.order;
 }
 
 
@@ -210,15 +251,13 @@ Tpsa<V,N,TYPE>::Tpsa(const Tpsa<V,N,TYPE>& a_)  {
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::operator * (const TYPE& o_) const {
 	Tpsa<V,N,TYPE> r(*this);
-	for(unsigned int i=0; i<get_size(); i++) r.c[i] *= o_;
-	return r;
+	return r.scale(o_, false);
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::operator / (const TYPE& o_) const {
 	Tpsa<V,N,TYPE> r(*this);
-	for(unsigned int i=0; i<get_size(); i++) r.c[i] /= o_;
-	return r;
+	return r.scale(o_, true);
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
@@ -235,13 +274,22 @@ Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::operator -= (const TYPE& o_) {
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::operator *= (const TYPE& o_) {
-	for(unsigned int i=0; i<get_size(); i++) c[i] *= o_;
-	return *this;
+	return scale(o_, false);
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::operator /= (const TYPE& o_) {
-	for(unsigned int i=0; i<get_size(); i++) c[i] /= o_;
+	return scale(o_, true);
+};
+
+template <unsigned int V, unsigned int N, typename TYPE>
+Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::scale(const TYPE& o_, bool divide) {
+	if (not finite(o_) or (divide and (o_ == TYPE(0)))) order = N;
+	if (divide) {
+		for(unsigned int i=0; i<last_at_order(order); i++) c[i] /= o_;
+	} else {
+		for(unsigned int i=0; i<last_at_order(order); i++) c[i] *= o_;
+	}
 	return *this;
 };
 
@@ -252,40 +300,74 @@ Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::operator /= (const TYPE& o_) {
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::operator - () const {
 	Tpsa<V,N,TYPE> r(*this);
-	for(unsigned int i=0; i<get_size(); i++) r.c[i] = -r.c[i];
+	for(unsigned int i=0; i<last_at_order(order); i++) r.c[i] = -r.c[i];   // zeros above 'order' stay zero
 	return r;
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::operator + (const Tpsa<V,N,TYPE>& o_) const {
 	Tpsa<V,N,TYPE> r(*this);
-	for(unsigned int i=0; i<get_size(); i++) r.c[i] += o_.c[i];
+	for(unsigned int i=0; i<last_at_order(o_.order); i++) r.c[i] += o_.c[i];
+	if (o_.order > r.order) r.order = o_.order;
 	return r;
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::operator - (const Tpsa<V,N,TYPE>& o_) const {
 	Tpsa<V,N,TYPE> r(*this);
-	for(unsigned int i=0; i<get_size(); i++) r.c[i] -= o_.c[i];
+	for(unsigned int i=0; i<last_at_order(o_.order); i++) r.c[i] -= o_.c[i];
+	if (o_.order > r.order) r.order = o_.order;
 	return r;
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::operator * (const Tpsa<V,N,TYPE>& o_) const {
 	Tpsa<V,N,TYPE> r;
-	unsigned int counter = 0;
-	for(unsigned int n1 = 0; n1 <= N; n1++) {
+	r.add_product(*this, o_);
+	return r;
+};
+
+template <unsigned int V, unsigned int N, typename TYPE>
+Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::accumulate_product(const Tpsa<V,N,TYPE>& a_, const Tpsa<V,N,TYPE>& b_, bool subtract) {
+	if ((this == &a_) or (this == &b_)) {
+		if (subtract) *this -= a_ * b_; else *this += a_ * b_;
+		return *this;
+	}
+	tables();
+	// the products of coefficient i1 of a_ with coefficients 0,1,... of b_ are the row of osip
+	// starting at osip_row[i1]. rows of zero coefficients are skipped only if b_ is finite, so
+	// that infinities and NaNs still propagate as in the full product.
+	TYPE* __restrict rc = c;
+	const TYPE* __restrict bc = b_.c;
+	int b_finite = -1;
+	for(unsigned int n1 = 0; n1 <= a_.order; n1++) {
+		const unsigned int n2_max = (b_.order < N-n1) ? b_.order : N-n1;
+		const unsigned int i2_end = last_at_order(n2_max);
 		for(unsigned int i1 = first_at_order(n1); i1 < last_at_order(n1); i1++) {
-			for(unsigned int n2 = 0; n1+n2 <= N; n2++) {
-				for(unsigned int i2 = first_at_order(n2); i2 < last_at_order(n2); i2++) {
-					r.c[osip[counter]] += this->c[i1] * o_.c[i2];
-					counter++;
+			const TYPE a = subtract ? -a_.c[i1] : a_.c[i1];
+			if ((a == TYPE(0)) and (i2_end > 1)) {
+				if (b_finite < 0) {
+					b_finite = 1;
+					for(unsigned int i=0; i<last_at_order(b_.order); i++) if (not finite(b_.c[i])) { b_finite = 0; break; }
 				}
+				if (b_finite) continue;
 			}
+			const unsigned int* p = &osip[osip_row[i1]];
+			for(unsigned int i2 = 0; i2 < i2_end; i2++) rc[p[i2]] += a * bc[i2];
 		}
 	}
-	return r;
-};
+	const unsigned int n = (a_.order + b_.order < N) ? a_.order + b_.order : N;
+	if (n > order) order = n;
+	return *this;
+}
+
+template <unsigned int V, unsigned int N, typename TYPE>
+Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::accumulate_product(const TYPE& a_, const Tpsa<V,N,TYPE>& b_) {
+	const unsigned int n = finite(a_) ? b_.order : N;
+	for(unsigned int i=0; i<last_at_order(n); i++) c[i] += a_ * b_.c[i];
+	if (n > order) order = n;
+	return *this;
+}
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::inverse() const {
@@ -294,7 +376,7 @@ Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::inverse() const {
 	Tpsa<V,N,TYPE> x(*this); x.c[0] = 0; x /= a;
 	Tpsa<V,N,TYPE> p(1);
 	for(unsigned int i=0; i<=N; i++) {
-		r += p * (i&1?-1:1);
+		r.add_product(TYPE(i&1?-1:1), p);
 		p *= x;
 	}
 	return r / a;
@@ -307,13 +389,15 @@ Tpsa<V,N,TYPE> Tpsa<V,N,TYPE>::operator / (const Tpsa<V,N,TYPE>& o_) const {
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::operator += (const Tpsa<V,N,TYPE>& o_) {
-	for(unsigned int i=0; i<get_size(); i++) c[i] += o_.c[i];
+	for(unsigned int i=0; i<last_at_order(o_.order); i++) c[i] += o_.c[i];
+	if (o_.order > order) order = o_.order;
 	return *this;
 };
 
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE>& Tpsa<V,N,TYPE>::operator -= (const Tpsa<V,N,TYPE>& o_) {
-	for(unsigned int i=0; i<get_size(); i++) c[i] -= o_.c[i];
+	for(unsigned int i=0; i<last_at_order(o_.order); i++) c[i] -= o_.c[i];
+	if (o_.order > order) order = o_.order;
 	return *this;
 };
 
@@ -393,17 +477,13 @@ bool Tpsa<V,N,TYPE>::operator > (const Tpsa<V,N,TYPE>& o_) const {
 
 template <unsigned int V, unsigned int N, typename TYPE>
 void Tpsa<V,N,TYPE>::initialization() {
-	// sets binomial coefficients
-	for(unsigned int s=0; s<=N+V; s++) {
-		C(s,0) = C(0,s) = 1;
-		for(unsigned int n=1; n < s; n++) C(s-n,n) = C((s-1)-n,n) + C((s-1)-(n-1),(n-1));
-	}
 	// sets one-step index pointers
 	unsigned int counter = 0;
 	unsigned int power1[V], power2[V], power[V];
 	for(unsigned int n1 = 0; n1 <= N; n1++) {
 		for(unsigned int i1 = first_at_order(n1); i1 < last_at_order(n1); i1++) {
 			get_power(i1,power1);
+			osip_row[i1] = counter;
 			for(unsigned int n2 = 0; n1+n2 <= N; n2++) {
 				for(unsigned int i2 = first_at_order(n2); i2 < last_at_order(n2); i2++) {
 					get_power(i2,power2);
@@ -417,7 +497,13 @@ void Tpsa<V,N,TYPE>::initialization() {
 			}
 		}
 	}
-	init = false;
+}
+
+template <unsigned int V, unsigned int N, typename TYPE>
+bool Tpsa<V,N,TYPE>::tables() {
+	// initialization of a local static is done exactly once, with concurrent callers waiting for it (C++11)
+	static const bool initialized = (initialization(), true);
+	return initialized;
 }
 
 template <unsigned int V, unsigned int N, typename TYPE>
@@ -464,6 +550,20 @@ template <typename T, unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> operator / (const T& o1, const Tpsa<V,N,TYPE>& o2) { return o2.inverse() * o1; }
 
 
+// r += a * b and r -= a * b, in place (see note 04). overloads for doubles are in passmethods.hpp.
+template <unsigned int V, unsigned int N, typename TYPE>
+void add_product(Tpsa<V,N,TYPE>& r, const Tpsa<V,N,TYPE>& a, const Tpsa<V,N,TYPE>& b) { r.add_product(a, b); }
+
+template <unsigned int V, unsigned int N, typename TYPE>
+void sub_product(Tpsa<V,N,TYPE>& r, const Tpsa<V,N,TYPE>& a, const Tpsa<V,N,TYPE>& b) { r.sub_product(a, b); }
+
+template <typename T, unsigned int V, unsigned int N, typename TYPE>
+void add_product(Tpsa<V,N,TYPE>& r, const T& a, const Tpsa<V,N,TYPE>& b) { r.add_product(TYPE(a), b); }
+
+template <typename T, unsigned int V, unsigned int N, typename TYPE>
+void sub_product(Tpsa<V,N,TYPE>& r, const T& a, const Tpsa<V,N,TYPE>& b) { r.sub_product(TYPE(a), b); }
+
+
 template <unsigned int V, unsigned int N, typename TYPE>
 Tpsa<V,N,TYPE> abs(const Tpsa<V,N,TYPE>& a_) {
 	if (a_ >= 0) return a_; else return -a_;
@@ -480,7 +580,7 @@ Tpsa<V,N,TYPE> sqrt(const Tpsa<V,N,TYPE>& a_) {
 	Tpsa<V,N,TYPE> p(1);
 	TYPE          f = 1;
 	for(unsigned int i=0; i<=N; i++) {
-		r += p * f;
+		r.add_product(f, p);
 		f *= (0.5 - i)/(i+1);
 		p *= x;
 	}
@@ -607,9 +707,11 @@ Tpsa<V,N,TYPE> asin(const Tpsa<V,N,TYPE>& a_) {
 	Tpsa<V,N,TYPE> t1 = sqrt(1-a_*a_);
 	Tpsa<V,N,std::complex<TYPE> > t2;
 	for(unsigned int i=0; i<a_.get_size(); i++) t2.c[i] = I * a_.c[i] + t1.c[i];
+	t2.order = (a_.order > t1.order) ? a_.order : t1.order;
 	Tpsa<V,N,std::complex<TYPE> > t3 = log(t2);
 	Tpsa<V,N,TYPE> r;
 	for(unsigned int i=0; i<a_.get_size(); i++) r.c[i] = t3.c[i].imag();
+	r.order = t3.order;
 	return r;
 
 }
@@ -664,6 +766,7 @@ Tpsa<V,N,TYPE> D(const Tpsa<V,N,TYPE>& a_, const unsigned int v_) {
 			r.c[idx] += a_.c[i] * (TYPE) f;
 		}
 	}
+	r.order = (a_.order > 0) ? a_.order - 1 : 0;
 	return r;
 }
 
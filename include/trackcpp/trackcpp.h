@@ -36,6 +36,7 @@
 #include <string>
 
 extern bool verbose_on;
+extern bool verbose_tasks_on;   // prints one line per finished task in multithreaded runs
 std::string get_timestamp();
 
 #endif
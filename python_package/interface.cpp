@@ -16,6 +16,7 @@
 
 #include "interface.h"
 #include <trackcpp/flat_file.h>
+#include <trackcpp/multithreads.h>
 
 
 Status::type track_elementpass_wrapper (
@@ -108,3 +109,13 @@ Status::type read_flat_file_wrapper(String& fname, Accelerator& accelerator, boo
 Status::type write_flat_file_wrapper(String& fname, const Accelerator& accelerator, bool file_flag) {
   return write_flat_file(fname.data, accelerator, file_flag);
 }
+
+void set_progress_report_wrapper(double interval, bool print, ProgressCallback* callback) {
+  if (callback == nullptr) {
+    set_thread_progress_report(interval, print);
+    return;
+  }
+  set_thread_progress_report(interval, print, [callback](const ThreadProgress& p) {
+    callback->update(p.nr_tasks_done, p.nr_tasks, p.elapsed_time, p.tasks_rate, p.particle_turns_rate, p.eta);
+  });
+}
@@ -76,6 +76,17 @@ Element rbend_wrapper(const std::string& fam_name_, const double& length_,
                       const double& gap_, const double& fint_in_, const double& fint_out_,
                       const std::vector<double>& polynom_a_, const std::vector<double>& polynom_b_,
                       const double& K_, const double& S_);
+// progress reports of multithreaded runs: subclass in python and override 'update'.
+// updates are called from the thread that started the run. 'update' must not raise: an
+// exception cuts the run short, leaving its results incomplete, and surfaces as a C++ error.
+class ProgressCallback {
+public:
+  virtual ~ProgressCallback() {}
+  virtual void update(long nr_tasks_done, long nr_tasks, double elapsed_time, double tasks_rate, double particle_turns_rate, double eta) {}
+};
+
+void set_progress_report_wrapper(double interval, bool print = true, ProgressCallback* callback = nullptr);
+
 Status::type write_flat_file_wrapper(String& fname, const Accelerator& accelerator, bool file_flag = true);
 Status::type read_flat_file_wrapper(String& fname, Accelerator& accelerator, bool file_flag = true);
 
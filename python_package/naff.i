@@ -14,4 +14,31 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-void naff_run(const std::vector<Pos<double> >& data, double& tunex, double& tuney);
+struct NaffMethod {
+  enum type {
+    naff = 0,
+    fft_refined = 1,
+    fft_hann = 2,
+    fft_parabolic = 3
+  };
+};
+
+void naff_run(const std::vector<Pos<double> >& data, double& tunex, double& tuney, NaffMethod::type method = NaffMethod::naff);
+
+class NaffBuffer {
+public:
+  void         clear(unsigned int nr_turns = 0);
+  void         push_back(const Pos<double>& p);
+  unsigned int size() const;
+  Status::type run(unsigned int first, unsigned int nr_turns, double& tunex, double& tuney, NaffMethod::type method = NaffMethod::naff) const;
+};
+
+class NaffBatch {
+public:
+  NaffBatch(unsigned int nr_particles = 0, unsigned int nr_turns = 0);
+  void         resize(unsigned int nr_particles, unsigned int nr_turns);
+  void         set(unsigned int particle, unsigned int turn, const Pos<double>& p);
+  unsigned int nr_particles() const;
+  unsigned int nr_turns() const;
+  Status::type run(unsigned int first, unsigned int nr_turns, std::vector<double>& tunex, std::vector<double>& tuney) const;
+};
@@ -38,4 +38,99 @@ Status::type calc_twiss(const Accelerator& accelerator,
                         Matrix& m66,
                         std::vector<Twiss>& twiss,
                         Twiss twiss0 = Twiss(),
-                        bool closed_flag = false);
+                        bool closed_flag = false,
+                        unsigned int nr_threads = 1);
+
+Status::type calc_twiss_offmomentum(const Accelerator& accelerator,
+                                    const std::vector<double>& energy_offsets,
+                                    std::vector<std::vector<Twiss> >& twiss,
+                                    std::vector<Matrix>& m66,
+                                    std::vector<double>& tunex,
+                                    std::vector<double>& tuney,
+                                    unsigned int nr_threads = 1);
+
+Status::type calc_tune_series(const Accelerator& accelerator,
+                              const Pos<double>& fixed_point,
+                              unsigned int order,
+                              std::vector<double>& tunex,
+                              std::vector<double>& tuney);
+
+class OpticsKnob {
+public:
+  enum parameter_type { polynom_a, polynom_b, hkick, vkick, voltage };
+  parameter_type            parameter;
+  unsigned int              n;
+  std::vector<unsigned int> elements;
+  OpticsKnob(parameter_type parameter_ = polynom_b, unsigned int n_ = 0, const std::vector<unsigned int>& elements_ = std::vector<unsigned int>()) :
+    parameter(parameter_), n(n_), elements(elements_) {}
+};
+
+Status::type calc_optics_jacobian(const Accelerator& accelerator,
+                                  const Pos<double>& fixed_point,
+                                  const std::vector<OpticsKnob>& knobs,
+                                  const std::vector<unsigned int>& elements,
+                                  std::vector<Twiss>& twiss,
+                                  std::vector<std::vector<Twiss> >& jacobian,
+                                  std::vector<double>& dtunex,
+                                  std::vector<double>& dtuney);
+
+struct OrbitResponse {
+  enum type { analytic = 0, tracking = 1 };
+};
+
+Status::type calc_orbit_response_matrix(const Accelerator& accelerator,
+                                        const std::vector<unsigned int>& bpms,
+                                        const std::vector<unsigned int>& hcorrectors,
+                                        const std::vector<unsigned int>& vcorrectors,
+                                        std::vector<double>& respm,
+                                        OrbitResponse::type mode = OrbitResponse::analytic,
+                                        unsigned int nr_threads = 1,
+                                        double kick = 1e-6);
+
+class RadiationIntegrals {
+public:
+  double i1, i2, i3, i4, i5;
+  double alphac;
+  double u0;
+  double jx, jy, je;
+  double taux, tauy, taue;
+  double espread;
+  double emitx;
+  RadiationIntegrals() : i1(0), i2(0), i3(0), i4(0), i5(0), alphac(0), u0(0),
+                         jx(0), jy(0), je(0), taux(0), tauy(0), taue(0), espread(0), emitx(0) {}
+};
+
+Status::type calc_radiation_integrals(const Accelerator& accelerator,
+                                      const Pos<double>& fixed_point,
+                                      Matrix& m66,
+                                      std::vector<Twiss>& twiss,
+                                      RadiationIntegrals& integrals,
+                                      unsigned int nr_threads = 1);
+
+class BeamEnvelope {
+public:
+  double tunex, tuney, tunes;
+  double taux, tauy, taue;
+  double emitx, emity, emite;
+  double espread;
+  double bunlen;
+  BeamEnvelope() : tunex(0), tuney(0), tunes(0), taux(0), tauy(0), taue(0),
+                   emitx(0), emity(0), emite(0), espread(0), bunlen(0) {}
+};
+
+Status::type calc_beam_envelope(const Accelerator& accelerator,
+                                const Pos<double>& fixed_point,
+                                Matrix& m66,
+                                std::vector<Matrix>& sigmas,
+                                BeamEnvelope& envelope);
+
+class OpticsContext {
+public:
+  Status::type build(const Accelerator& accelerator, const Pos<double>& fixed_point);
+  void         set_dirty(unsigned int element);
+  Status::type update();
+  void         get_m66(Matrix& m66) const;
+  Pos<double>  get_closed_orbit() const;
+  void         get_tunes(double& tunex, double& tuney) const;
+  Status::type get_twiss(const std::vector<unsigned int>& elements, std::vector<Twiss>& twiss, Twiss twiss0 = Twiss()) const;
+};
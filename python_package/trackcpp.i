@@ -14,7 +14,7 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-%module trackcpp
+%module(directors="1") trackcpp
 
 %{
 #include <trackcpp/elements.h>
@@ -37,11 +37,14 @@
 namespace std {
     %template(CppStringVector) vector<string>;
     %template(CppDoubleVector) vector<double>;
+    %template(CppUnsignedIntVector) vector<unsigned int>;
     %template(CppElementVector) vector<Element>;
     %template(CppDoublePosVector) vector< Pos<double> >;
     %template(CppDoubleMatrix) vector< vector<double> >;
     %template(CppDoubleMatrixVector) vector< vector< vector<double> > >;
     %template(CppTwissVector) vector<Twiss>;
+    %template(CppTwissMatrix) vector< vector<Twiss> >;
+    %template(CppOpticsKnobVector) vector<OpticsKnob>;
 }
 
 %inline %{
@@ -67,6 +70,7 @@ double get_double_max() {
 %include "../include/trackcpp/auxiliary.h"
 %include "../include/trackcpp/pos.h"
 %include "../include/trackcpp/tracking.h"
+%feature("director") ProgressCallback;
 %include "interface.h"
 
 %template(CppDoublePos) Pos<double>;
@@ -23,17 +23,174 @@
 #include <trackcpp/accelerator.h>
 #include <trackcpp/elements.h>
 #include <trackcpp/auxiliary.h>
+#include <trackcpp/multithreads.h>
+#include <trackcpp/trackcpp.h>
 #include <string>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+
+// separates '--name value' (or '--name=value') options from positional arguments
+static void parse_options(const std::vector<std::string>& all_args, std::vector<std::string>& args, std::map<std::string,std::string>& options) {
+  const std::vector<std::string> flags = {"resume", "verbose"};  // options that take no value
+  for(unsigned int i=0; i<all_args.size(); ++i) {
+    const std::string& arg = all_args[i];
+    if ((arg.size() > 2) and (arg.compare(0, 2, "--") == 0)) {
+      std::string name = arg.substr(2), value;
+      size_t pos = name.find('=');
+      if (pos != std::string::npos) {
+        value = name.substr(pos+1);
+        name = name.substr(0, pos);
+      } else if ((std::find(flags.begin(), flags.end(), name) == flags.end()) and (i+1 < all_args.size())) {
+        value = all_args[++i];
+      }
+      options[name] = value;
+    } else args.push_back(arg);
+  }
+}
+
+// converts the '--symmetry off|auto|on' option
+static MidPlaneSymmetry::type parse_symmetry(const std::map<std::string,std::string>& options) {
+  std::map<std::string,std::string>::const_iterator it = options.find("symmetry");
+  if (it == options.end()) return MidPlaneSymmetry::automatic;
+  if (it->second == "off") return MidPlaneSymmetry::off;
+  if (it->second == "on") return MidPlaneSymmetry::on;
+  return MidPlaneSymmetry::automatic;
+}
+
+// converts the '--shard i/N' option (0 <= i < N)
+static bool parse_shard(const std::map<std::string,std::string>& options, DynApRunOptions& run_options) {
+  std::map<std::string,std::string>::const_iterator it = options.find("shard");
+  if (it == options.end()) return true;
+  unsigned int shard_index, nr_shards;
+  if (sscanf(it->second.c_str(), "%u/%u", &shard_index, &nr_shards) != 2) return false;
+  if ((nr_shards == 0) or (shard_index >= nr_shards)) return false;
+  run_options.shard_index = shard_index;
+  run_options.nr_shards = nr_shards;
+  return true;
+}
+
+// converts the '--checkpoint seconds' and '--resume' options. checkpoint files are
+// named after the output file of the run
+static bool parse_checkpoint(const std::map<std::string,std::string>& options, const std::string& basename, DynApRunOptions& run_options) {
+  std::map<std::string,std::string>::const_iterator it = options.find("checkpoint");
+  run_options.resume = (options.find("resume") != options.end());
+  if ((it == options.end()) and (not run_options.resume)) return true;
+  if (it != options.end()) {
+    char* end;
+    run_options.checkpoint_interval = std::strtod(it->second.c_str(), &end);
+    if ((it->second.empty()) or (*end != '\0') or (run_options.checkpoint_interval < 0)) return false;
+  }
+  run_options.checkpoint_filename = basename;
+  if (run_options.nr_shards > 1) run_options.checkpoint_filename += "_shard_" + std::to_string(run_options.shard_index) + "_of_" + std::to_string(run_options.nr_shards);
+  run_options.checkpoint_filename += "_checkpoint.txt";
+  return true;
+}
+
+// converts the '--progress seconds' (default 10, 0 disables reports) and '--verbose' options
+static bool parse_progress(const std::map<std::string,std::string>& options) {
+  std::map<std::string,std::string>::const_iterator it = options.find("progress");
+  double interval = 10;
+  if (it != options.end()) {
+    char* end;
+    interval = std::strtod(it->second.c_str(), &end);
+    if ((it->second.empty()) or (*end != '\0') or (interval < 0)) return false;
+  }
+  verbose_tasks_on = (options.find("verbose") != options.end());
+  set_thread_progress_report(interval);
+  return true;
+}
+
+// converts the '--refine depth' and '--refine-threshold log10_dnu' options of fmaps.
+// refined fmaps depend on all points of the grid, so they cannot be sharded or checkpointed.
+static bool parse_refinement(const std::map<std::string,std::string>& options, const DynApRunOptions& run_options, DynApRefinement& refinement) {
+  std::map<std::string,std::string>::const_iterator it = options.find("refine");
+  if (it != options.end()) refinement.max_depth = std::atoi(it->second.c_str());
+  it = options.find("refine-threshold");
+  if (it != options.end()) refinement.diffusion_threshold = std::atof(it->second.c_str());
+  if (refinement.max_depth == 0) return true;
+  return (refinement.diffusion_threshold > 0) and (run_options.nr_shards == 1) and run_options.checkpoint_filename.empty();
+}
 
-int cmd_dynap_xy(const std::vector<std::string>& args) {
+// converts the '--chaos rem|fli|sali' option of fmaps. with it, fmaps compute the chaos
+// indicator over all turns instead of the tune diffusion between the two halves of the turns.
+static bool parse_chaos(const std::map<std::string,std::string>& options, std::string& chaos) {
+  std::map<std::string,std::string>::const_iterator it = options.find("chaos");
+  chaos = (it == options.end()) ? "" : it->second;
+  return chaos.empty() or (chaos == "rem") or (chaos == "fli") or (chaos == "sali");
+}
+
+// converts the '--tunes naff|refined|hann|parabolic' option of fmaps, which selects the
+// estimator of the tunes of each half of the turns (NAFF, by default, or a fast FFT one)
+static bool parse_tunes(const std::map<std::string,std::string>& options, std::string& tunes, NaffMethod::type& method) {
+  std::map<std::string,std::string>::const_iterator it = options.find("tunes");
+  tunes = (it == options.end()) ? "naff" : it->second;
+  if (tunes == "naff")      { method = NaffMethod::naff;          return true; }
+  if (tunes == "refined")   { method = NaffMethod::fft_refined;   return true; }
+  if (tunes == "hann")      { method = NaffMethod::fft_hann;      return true; }
+  if (tunes == "parabolic") { method = NaffMethod::fft_parabolic; return true; }
+  return false;
+}
+
+static DynApAnalysis fmap_analysis(const std::string& chaos, NaffMethod::type method, const Accelerator& accelerator) {
+  if (chaos == "rem")  return dynap_analysis_rem(accelerator);
+  if (chaos == "fli")  return dynap_analysis_fli;
+  if (chaos == "sali") return dynap_analysis_sali;
+  if (method != NaffMethod::naff) return dynap_analysis_diffusion_method(method);
+  return dynap_analysis_diffusion;
+}
+
+// saves the grid or, in sharded runs, the partial file with the points computed by this process
+static Status::type save_dynapgrid(const Accelerator& accelerator, const std::vector<DynApGridPoint>& grid, const DynApRunOptions& run_options, const std::string& label, const std::string& basename, bool print_tunes = false, bool print_chaos = false) {
+  if (run_options.nr_shards > 1) {
+    std::string filename = basename + "_shard_" + std::to_string(run_options.shard_index) + "_of_" + std::to_string(run_options.nr_shards) + "_out.txt";
+    return print_dynapgrid_partial(accelerator, grid, run_options.computed, run_options.shard_index, run_options.nr_shards, label, filename, print_tunes, print_chaos);
+  }
+  return print_dynapgrid(accelerator, grid, label, basename + "_out.txt", print_tunes, print_chaos);
+}
+
+// converts a comma-separated list of turns into sorted stages ending at nr_turns
+static std::vector<unsigned int> parse_stages(const std::string& str, unsigned int nr_turns) {
+  std::vector<unsigned int> stages;
+  std::stringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    unsigned int turns = std::atoi(item.c_str());
+    if ((turns > 0) and (turns < nr_turns)) stages.push_back(turns);
+  }
+  stages.push_back(nr_turns);
+  std::sort(stages.begin(), stages.end());
+  stages.erase(std::unique(stages.begin(), stages.end()), stages.end());
+  return stages;
+}
+
+int cmd_dynap_xy(const std::vector<std::string>& all_args) {
+
+  std::vector<std::string> args;
+  std::map<std::string,std::string> options;
+  parse_options(all_args, args, options);
 
   if ((args.size() < 16) or (args.size() > 17)) {
     std::cerr << "dynap_xy: invalid number of arguments!" << std::endl;
     return EXIT_FAILURE;
   }
 
+  DynApRunOptions run_options;
+  if (not parse_shard(options, run_options)) {
+    std::cerr << "dynap_xy: invalid shard specification!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_checkpoint(options, "dynap_xy", run_options)) {
+    std::cerr << "dynap_xy: invalid checkpoint interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_progress(options)) {
+    std::cerr << "dynap_xy: invalid progress interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   std::cout << std::endl;
   std::cout << "[cmd_dynap_xy]" << std::endl << std::endl;
 
@@ -55,6 +212,9 @@ int cmd_dynap_xy(const std::vector<std::string>& args) {
   if (args.size() == 17) {
     nr_threads = std::atoi(args[16].c_str());
   }
+  std::vector<unsigned int> stages;
+  if (options.count("stages")) stages = parse_stages(options["stages"], nr_turns);
+  MidPlaneSymmetry::type symmetry = parse_symmetry(options);
 
   print_header(stdout);
   std::cout << std::endl;
@@ -73,6 +233,14 @@ int cmd_dynap_xy(const std::vector<std::string>& args) {
   std::cout << "y_min[m]        : " << y_min << std::endl;
   std::cout << "y_max[m]        : " << y_max << std::endl;
   std::cout << "nr_threads      : " << nr_threads << std::endl;
+  if (run_options.nr_shards > 1) std::cout << "shard           : " << run_options.shard_index << "/" << run_options.nr_shards << std::endl;
+  if (not run_options.checkpoint_filename.empty()) std::cout << "checkpoint      : " << run_options.checkpoint_filename << " every " << run_options.checkpoint_interval << " s" << (run_options.resume ? " (resume)" : "") << std::endl;
+  std::cout << "symmetry        : " << ((symmetry == MidPlaneSymmetry::off) ? "off" : ((symmetry == MidPlaneSymmetry::on) ? "on" : "auto")) << std::endl;
+  if (not stages.empty()) {
+    std::cout << "stages          : ";
+    for(unsigned int i=0; i<stages.size(); ++i) std::cout << stages[i] << " ";
+    std::cout << std::endl;
+  }
 
   std::cout << std::endl;
   std::cout << get_timestamp() << " begin timestamp" << std::endl;
@@ -98,14 +266,26 @@ int cmd_dynap_xy(const std::vector<std::string>& args) {
   std::vector<Pos<double> > cod;
   Pos<double> p0(0,0,0,0,de,0);
   std::vector<DynApGridPoint> grid;
-  dynap_xy(accelerator, cod, nr_turns, p0, x_nrpts, x_min, x_max, y_nrpts, y_min, y_max, true, grid, nr_threads);
+  if (stages.empty()) {
+    status = dynap_xy(accelerator, cod, nr_turns, p0, x_nrpts, x_min, x_max, y_nrpts, y_min, y_max, true, grid, nr_threads, symmetry, &run_options);
+    if (status != Status::success) {
+      std::cerr << string_error_messages[status] << std::endl;
+      return EXIT_FAILURE;
+    }
+  } else {
+    // saves partial results at the end of each intermediate stage
+    auto save_stage = [&](unsigned int turns, const std::vector<DynApGridPoint>& stage_grid) {
+      if (turns < nr_turns) save_dynapgrid(accelerator, stage_grid, run_options, "[dynap_xy]", "dynap_xy_stage_" + std::to_string(turns));
+    };
+    dynap_staged("dynap_xy", accelerator, cod, stages, p0, x_nrpts, x_min, x_max, y_nrpts, y_min, y_max, true, grid, nr_threads, symmetry, save_stage, &run_options);
+  }
 
   // generates output files
   std::cout << get_timestamp() << " saving closed-orbit to file" << std::endl;
   status = print_closed_orbit(accelerator, cod);
   if (status == Status::file_not_opened) return status;
   std::cout << get_timestamp() << " saving dynap_xy grid to file" << std::endl;
-  status = print_dynapgrid (accelerator, grid, "[dynap_xy]", "dynap_xy_out.txt");
+  status = save_dynapgrid(accelerator, grid, run_options, "[dynap_xy]", "dynap_xy");
   if (status == Status::file_not_opened) return status;
 
   std::cout << get_timestamp() << " end timestamp" << std::endl;
@@ -113,13 +293,31 @@ int cmd_dynap_xy(const std::vector<std::string>& args) {
 
 }
 
-int cmd_dynap_ex(const std::vector<std::string>& args) {
+int cmd_dynap_ex(const std::vector<std::string>& all_args) {
+
+  std::vector<std::string> args;
+  std::map<std::string,std::string> options;
+  parse_options(all_args, args, options);
 
   if ((args.size() < 16) or (args.size() > 17)) {
     std::cerr << "dynap_ex: invalid number of arguments!" << std::endl;
     return EXIT_FAILURE;
   }
 
+  DynApRunOptions run_options;
+  if (not parse_shard(options, run_options)) {
+    std::cerr << "dynap_ex: invalid shard specification!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_checkpoint(options, "dynap_ex", run_options)) {
+    std::cerr << "dynap_ex: invalid checkpoint interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_progress(options)) {
+    std::cerr << "dynap_ex: invalid progress interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   std::cout << std::endl;
   std::cout << "[cmd_dynap_ex]" << std::endl << std::endl;
 
@@ -141,6 +339,8 @@ int cmd_dynap_ex(const std::vector<std::string>& args) {
   if (args.size() == 17) {
     nr_threads = std::atoi(args[16].c_str());
   }
+  std::vector<unsigned int> stages;
+  if (options.count("stages")) stages = parse_stages(options["stages"], nr_turns);
 
   print_header(stdout);
   std::cout << std::endl;
@@ -159,6 +359,13 @@ int cmd_dynap_ex(const std::vector<std::string>& args) {
   std::cout << "x_min[m]        : " << x_min << std::endl;
   std::cout << "x_max[m]        : " << x_max << std::endl;
   std::cout << "nr_threads      : " << nr_threads << std::endl;
+  if (run_options.nr_shards > 1) std::cout << "shard           : " << run_options.shard_index << "/" << run_options.nr_shards << std::endl;
+  if (not run_options.checkpoint_filename.empty()) std::cout << "checkpoint      : " << run_options.checkpoint_filename << " every " << run_options.checkpoint_interval << " s" << (run_options.resume ? " (resume)" : "") << std::endl;
+  if (not stages.empty()) {
+    std::cout << "stages          : ";
+    for(unsigned int i=0; i<stages.size(); ++i) std::cout << stages[i] << " ";
+    std::cout << std::endl;
+  }
 
   std::cout << std::endl;
   std::cout << get_timestamp() << " begin timestamp" << std::endl;
@@ -183,14 +390,26 @@ int cmd_dynap_ex(const std::vector<std::string>& args) {
   std::vector<Pos<double> > cod;
   Pos<double> p0(0,0,y,0,0,0);
   std::vector<DynApGridPoint> grid;
-  dynap_ex(accelerator, cod, nr_turns, p0, e_nrpts, e_min, e_max, x_nrpts, x_min, x_max, true, grid, nr_threads);
+  if (stages.empty()) {
+    status = dynap_ex(accelerator, cod, nr_turns, p0, e_nrpts, e_min, e_max, x_nrpts, x_min, x_max, true, grid, nr_threads, &run_options);
+    if (status != Status::success) {
+      std::cerr << string_error_messages[status] << std::endl;
+      return EXIT_FAILURE;
+    }
+  } else {
+    // saves partial results at the end of each intermediate stage
+    auto save_stage = [&](unsigned int turns, const std::vector<DynApGridPoint>& stage_grid) {
+      if (turns < nr_turns) save_dynapgrid(accelerator, stage_grid, run_options, "[dynap_ex]", "dynap_ex_stage_" + std::to_string(turns));
+    };
+    dynap_staged("dynap_ex", accelerator, cod, stages, p0, e_nrpts, e_min, e_max, x_nrpts, x_min, x_max, true, grid, nr_threads, MidPlaneSymmetry::off, save_stage, &run_options);
+  }
 
   // generates output files
   std::cout << get_timestamp() << " saving closed-orbit to file" << std::endl;
   status = print_closed_orbit(accelerator, cod);
   if (status == Status::file_not_opened) return status;
   std::cout << get_timestamp() << " saving dynap_ex grid to file" << std::endl;
-  status = print_dynapgrid (accelerator, grid, "[dynap_ex]", "dynap_ex_out.txt");
+  status = save_dynapgrid(accelerator, grid, run_options, "[dynap_ex]", "dynap_ex");
   if (status == Status::file_not_opened) return status;
 
   std::cout << get_timestamp() << " end timestamp" << std::endl;
@@ -287,7 +506,11 @@ int cmd_dynap_ex(const std::vector<std::string>& args) {
 //
 // }
 
-int cmd_dynap_acceptance(const std::vector<std::string>& args) {
+int cmd_dynap_acceptance(const std::vector<std::string>& all_args) {
+
+  std::vector<std::string> args;
+  std::map<std::string,std::string> options;
+  parse_options(all_args, args, options);
 
   std::string calc_type_str, p_init_str, p_delta_str;
   if (args[1] == "dynap_ma") {
@@ -303,6 +526,20 @@ int cmd_dynap_acceptance(const std::vector<std::string>& args) {
     return EXIT_FAILURE;
   }
 
+  DynApRunOptions run_options;
+  if (not parse_shard(options, run_options)) {
+    std::cerr << args[1] << ": invalid shard specification!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_checkpoint(options, args[1], run_options)) {
+    std::cerr << args[1] << ": invalid checkpoint interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_progress(options)) {
+    std::cerr << args[1] << ": invalid progress interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   std::cout << std::endl;
   std::cout << "[" << args[1] << "]" << std::endl << std::endl;
 
@@ -348,6 +585,8 @@ int cmd_dynap_acceptance(const std::vector<std::string>& args) {
   std::cout <<   "s_min[m]        : " << s_min << std::endl;
   std::cout <<   "s_max[m]        : " << s_max << std::endl;
   std::cout <<   "nr_threads      : " << nr_threads << std::endl;
+  if (run_options.nr_shards > 1) std::cout << "shard           : " << run_options.shard_index << "/" << run_options.nr_shards << std::endl;
+  if (not run_options.checkpoint_filename.empty()) std::cout << "checkpoint      : " << run_options.checkpoint_filename << " every " << run_options.checkpoint_interval << " s" << (run_options.resume ? " (resume)" : "") << std::endl;
   std::cout <<   "fam_names       : ";
   for(unsigned int i=0; i<fam_names.size(); ++i) std::cout << fam_names[i] << " "; std::cout << std::endl;
 
@@ -375,14 +614,18 @@ int cmd_dynap_acceptance(const std::vector<std::string>& args) {
   Pos<double> p0(0,0,y0,0,0,0);
   std::vector<DynApGridPoint> grid;
   //dynap_pxa(accelerator, cod, nr_turns, p0, p_init, p_delta, nr_steps_back, rescale, nr_iterations, s_min, s_max, fam_names, true, grid, nr_threads);
-  dynap_acceptance(args[1], accelerator, cod, nr_turns, p0, p_init, p_delta, nr_steps_back, rescale, nr_iterations, s_min, s_max, fam_names, true, grid, nr_threads);
+  status = dynap_acceptance(args[1], accelerator, cod, nr_turns, p0, p_init, p_delta, nr_steps_back, rescale, nr_iterations, s_min, s_max, fam_names, true, grid, nr_threads, &run_options);
+  if (status != Status::success) {
+    std::cerr << string_error_messages[status] << std::endl;
+    return EXIT_FAILURE;
+  }
 
   // generates output files
   std::cout << get_timestamp() << " saving closed-orbit to file" << std::endl;
   status = print_closed_orbit(accelerator, cod);
   if (status == Status::file_not_opened) return status;
   std::cout << get_timestamp() << " saving " << args[1] << " grid to file" << std::endl;
-  status = print_dynapgrid (accelerator, grid, "["+args[1]+"]", args[1]+"_out.txt");
+  status = save_dynapgrid(accelerator, grid, run_options, "["+args[1]+"]", args[1]);
   if (status == Status::file_not_opened) return status;
 
   std::cout << get_timestamp() << " end timestamp" << std::endl;
@@ -847,13 +1090,47 @@ int cmd_dynap_acceptance(const std::vector<std::string>& args) {
 //
 // }
 
-int cmd_dynap_xyfmap(const std::vector<std::string>& args) {
+int cmd_dynap_xyfmap(const std::vector<std::string>& all_args) {
+
+  std::vector<std::string> args;
+  std::map<std::string,std::string> options;
+  parse_options(all_args, args, options);
 
   if (args.size() != 17) {
     std::cerr << "dynap_xyfmap: invalid number of arguments!" << std::endl;
     return EXIT_FAILURE;
   }
 
+  DynApRunOptions run_options;
+  if (not parse_shard(options, run_options)) {
+    std::cerr << "dynap_xyfmap: invalid shard specification!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_checkpoint(options, "dynap_xyfmap", run_options)) {
+    std::cerr << "dynap_xyfmap: invalid checkpoint interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_progress(options)) {
+    std::cerr << "dynap_xyfmap: invalid progress interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  DynApRefinement refinement;
+  if (not parse_refinement(options, run_options, refinement)) {
+    std::cerr << "dynap_xyfmap: invalid refinement (it cannot be combined with shards or checkpoints)!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string chaos;
+  if (not parse_chaos(options, chaos)) {
+    std::cerr << "dynap_xyfmap: invalid chaos indicator!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string tunes;
+  NaffMethod::type tunes_method;
+  if (not parse_tunes(options, tunes, tunes_method) or (not chaos.empty() and (tunes_method != NaffMethod::naff))) {
+    std::cerr << "dynap_xyfmap: invalid tune estimator (it cannot be combined with chaos indicators)!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   std::cout << std::endl;
   std::cout << "[cmd_dynap_xyfmap]" << std::endl << std::endl;
 
@@ -872,6 +1149,7 @@ int cmd_dynap_xyfmap(const std::vector<std::string>& args) {
   double       y_min = std::atof(args[14].c_str());
   double       y_max = std::atof(args[15].c_str());
   unsigned int nr_threads = std::atoi(args[16].c_str());
+  MidPlaneSymmetry::type symmetry = parse_symmetry(options);
 
   print_header(stdout);
   std::cout << std::endl;
@@ -890,6 +1168,12 @@ int cmd_dynap_xyfmap(const std::vector<std::string>& args) {
   std::cout << "y_min[m]        : " << y_min << std::endl;
   std::cout << "y_max[m]        : " << y_max << std::endl;
   std::cout << "nr_threads      : " << nr_threads << std::endl;
+  if (run_options.nr_shards > 1) std::cout << "shard           : " << run_options.shard_index << "/" << run_options.nr_shards << std::endl;
+  if (not run_options.checkpoint_filename.empty()) std::cout << "checkpoint      : " << run_options.checkpoint_filename << " every " << run_options.checkpoint_interval << " s" << (run_options.resume ? " (resume)" : "") << std::endl;
+  std::cout << "symmetry        : " << ((symmetry == MidPlaneSymmetry::off) ? "off" : ((symmetry == MidPlaneSymmetry::on) ? "on" : "auto")) << std::endl;
+  if (refinement.max_depth > 0) std::cout << "refinement      : " << refinement.max_depth << " levels, threshold " << refinement.diffusion_threshold << std::endl;
+  if (not chaos.empty()) std::cout << "chaos_indicator : " << chaos << std::endl;
+  if (tunes_method != NaffMethod::naff) std::cout << "tunes           : " << tunes << std::endl;
 
   std::cout << std::endl;
   std::cout << get_timestamp() << " begin timestamp" << std::endl;
@@ -915,14 +1199,18 @@ int cmd_dynap_xyfmap(const std::vector<std::string>& args) {
   std::vector<Pos<double> > cod;
   Pos<double> p0(0,0,0,0,de,0);
   std::vector<DynApGridPoint> grid;
-  dynap_xyfmap(accelerator, cod, nr_turns, p0, x_nrpts, x_min, x_max, y_nrpts, y_min, y_max, true, grid, nr_threads);
+  status = dynap_xyfmap(accelerator, cod, nr_turns, p0, x_nrpts, x_min, x_max, y_nrpts, y_min, y_max, true, grid, nr_threads, symmetry, &run_options, &refinement, fmap_analysis(chaos, tunes_method, accelerator));
+  if (status != Status::success) {
+    std::cerr << string_error_messages[status] << std::endl;
+    return EXIT_FAILURE;
+  }
 
   // generates output files
   std::cout << get_timestamp() << " saving closed-orbit to file" << std::endl;
   status = print_closed_orbit(accelerator, cod);
   if (status == Status::file_not_opened) return status;
   std::cout << get_timestamp() << " saving dynap_xyfmap grid to file" << std::endl;
-  status = print_dynapgrid (accelerator, grid, "[dynap_fmap]", "dynap_xyfmap_out.txt", true);
+  status = save_dynapgrid(accelerator, grid, run_options, "[dynap_fmap]", "dynap_xyfmap", chaos.empty(), not chaos.empty());
   if (status == Status::file_not_opened) return status;
 
   std::cout << get_timestamp() << " end timestamp" << std::endl;
@@ -930,13 +1218,47 @@ int cmd_dynap_xyfmap(const std::vector<std::string>& args) {
 
 }
 
-int cmd_dynap_exfmap(const std::vector<std::string>& args) {
+int cmd_dynap_exfmap(const std::vector<std::string>& all_args) {
+
+  std::vector<std::string> args;
+  std::map<std::string,std::string> options;
+  parse_options(all_args, args, options);
 
   if (args.size() != 17) {
     std::cerr << "dynap_exfmap: invalid number of arguments!" << std::endl;
     return EXIT_FAILURE;
   }
 
+  DynApRunOptions run_options;
+  if (not parse_shard(options, run_options)) {
+    std::cerr << "dynap_exfmap: invalid shard specification!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_checkpoint(options, "dynap_exfmap", run_options)) {
+    std::cerr << "dynap_exfmap: invalid checkpoint interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (not parse_progress(options)) {
+    std::cerr << "dynap_exfmap: invalid progress interval!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  DynApRefinement refinement;
+  if (not parse_refinement(options, run_options, refinement)) {
+    std::cerr << "dynap_exfmap: invalid refinement (it cannot be combined with shards or checkpoints)!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string chaos;
+  if (not parse_chaos(options, chaos)) {
+    std::cerr << "dynap_exfmap: invalid chaos indicator!" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string tunes;
+  NaffMethod::type tunes_method;
+  if (not parse_tunes(options, tunes, tunes_method) or (not chaos.empty() and (tunes_method != NaffMethod::naff))) {
+    std::cerr << "dynap_exfmap: invalid tune estimator (it cannot be combined with chaos indicators)!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   std::cout << std::endl;
   std::cout << "[cmd_dynap_exfmap]" << std::endl << std::endl;
 
@@ -973,6 +1295,11 @@ int cmd_dynap_exfmap(const std::vector<std::string>& args) {
   std::cout << "x_min[m]        : " << x_min << std::endl;
   std::cout << "x_max[m]        : " << x_max << std::endl;
   std::cout << "nr_threads      : " << nr_threads << std::endl;
+  if (run_options.nr_shards > 1) std::cout << "shard           : " << run_options.shard_index << "/" << run_options.nr_shards << std::endl;
+  if (not run_options.checkpoint_filename.empty()) std::cout << "checkpoint      : " << run_options.checkpoint_filename << " every " << run_options.checkpoint_interval << " s" << (run_options.resume ? " (resume)" : "") << std::endl;
+  if (refinement.max_depth > 0) std::cout << "refinement      : " << refinement.max_depth << " levels, threshold " << refinement.diffusion_threshold << std::endl;
+  if (not chaos.empty()) std::cout << "chaos_indicator : " << chaos << std::endl;
+  if (tunes_method != NaffMethod::naff) std::cout << "tunes           : " << tunes << std::endl;
 
   std::cout << std::endl;
   std::cout << get_timestamp() << " begin timestamp" << std::endl;
@@ -998,14 +1325,18 @@ int cmd_dynap_exfmap(const std::vector<std::string>& args) {
   std::vector<Pos<double> > cod;
   Pos<double> p0(0,0,y,0,0,0);
   std::vector<DynApGridPoint> grid;
-  dynap_exfmap(accelerator, cod, nr_turns, p0, e_nrpts, e_min, e_max, x_nrpts, x_min, x_max, true, grid, nr_threads);
+  status = dynap_exfmap(accelerator, cod, nr_turns, p0, e_nrpts, e_min, e_max, x_nrpts, x_min, x_max, true, grid, nr_threads, &run_options, &refinement, fmap_analysis(chaos, tunes_method, accelerator));
+  if (status != Status::success) {
+    std::cerr << string_error_messages[status] << std::endl;
+    return EXIT_FAILURE;
+  }
 
   // generates output files
   std::cout << get_timestamp() << " saving closed-orbit to file" << std::endl;
   status = print_closed_orbit(accelerator, cod);
   if (status == Status::file_not_opened) return status;
   std::cout << get_timestamp() << " saving dynap_exfmap grid to file" << std::endl;
-  status = print_dynapgrid (accelerator, grid, "[dynap_fmap]", "dynap_exfmap_out.txt", true);
+  status = save_dynapgrid(accelerator, grid, run_options, "[dynap_fmap]", "dynap_exfmap", chaos.empty(), not chaos.empty());
   if (status == Status::file_not_opened) return status;
 
   std::cout << get_timestamp() << " end timestamp" << std::endl;
@@ -1013,6 +1344,40 @@ int cmd_dynap_exfmap(const std::vector<std::string>& args) {
 
 }
 
+int cmd_dynap_merge(const std::vector<std::string>& args) {
+
+  if (args.size() < 4) {
+    std::cerr << "dynap_merge: invalid number of arguments!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << std::endl;
+  std::cout << "[cmd_dynap_merge]" << std::endl << std::endl;
+
+  std::string output_filename(args[2]);
+  std::vector<std::string> partial_filenames(args.begin()+3, args.end());
+
+  print_header(stdout);
+  std::cout << std::endl;
+  std::cout << "output_filename : " << output_filename << std::endl;
+  std::cout << "partial_files   : ";
+  for(unsigned int i=0; i<partial_filenames.size(); ++i) std::cout << partial_filenames[i] << " ";
+  std::cout << std::endl;
+
+  std::cout << std::endl;
+  std::cout << get_timestamp() << " begin timestamp" << std::endl;
+
+  Status::type status = merge_dynapgrid_partials(partial_filenames, output_filename);
+  if (status != Status::success) {
+    std::cerr << "dynap_merge: could not merge partial files (" << string_error_messages[status] << ")!" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << get_timestamp() << " end timestamp" << std::endl;
+  return EXIT_SUCCESS;
+
+}
+
 int cmd_track_linepass(const std::vector<std::string>& args) {
 
   if (args.size() != 15) {
@@ -1108,8 +1473,23 @@ int cmd_help(const std::vector<std::string>& args) {
     "dynap_pya:      calculates maximum px along the ring",
     "dynap_xyfmap:   calculates fmap in xy plane",
     "dynap_exfmap:   calculates fmap in ex plane",
+    "dynap_merge:    merges partial files of sharded dynap runs: output_file partial_file_1 partial_file_2 ...",
     "track_linepass: does one turn tracking of a initial condition",
-    "tests:          used for debugging and testing trackcpp"
+    "tests:          used for debugging and testing trackcpp",
+    "",
+    "options (appended to positional arguments):",
+    "",
+    "--stages T1,T2,...: dynap_xy|dynap_ex track all points up to T1 turns, cull lost ones and continue up to T2, ...",
+    "--symmetry off|auto|on: dynap_xy|dynap_xyfmap track only y >= 0 points and mirror them if motion is symmetric under y -> -y",
+    "--shard i/N: dynap commands compute only the i-th (0 <= i < N) of N interleaved subsets of the tasks and save a partial file",
+    "--checkpoint S: dynap commands (except staged runs) save finished tasks to '<output>_checkpoint.txt' every S seconds",
+    "--resume: dynap commands restore finished tasks from the checkpoint file and compute only the remaining ones",
+    "--progress S: dynap commands report progress, rates and ETA every S seconds (default 10, 0 disables reports)",
+    "--verbose: dynap commands print one line per finished task",
+    "--refine D: dynap_xyfmap|dynap_exfmap subdivide up to D times the grid cells near the DA border or with diffusion contrast",
+    "--refine-threshold T: difference in log10(|dnu|) between cell corners above which cells are subdivided (default 1)",
+    "--chaos rem|fli|sali: dynap_xyfmap|dynap_exfmap compute the reversibility error, fast Lyapunov indicator or SALI instead of tunes",
+    "--tunes naff|refined|hann|parabolic: dynap_xyfmap|dynap_exfmap estimate tunes with NAFF (default) or faster interpolated FFTs of decreasing accuracy"
   };
 
   std::vector<std::string> dynap_ma_help = {
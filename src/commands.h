@@ -29,6 +29,7 @@ int cmd_dynap_acceptance (const std::vector<std::string>& args);
 //int cmd_dynap_pya      (const std::vector<std::string>& args);
 int cmd_dynap_xyfmap   (const std::vector<std::string>& args);
 int cmd_dynap_exfmap   (const std::vector<std::string>& args);
+int cmd_dynap_merge    (const std::vector<std::string>& args);
 int cmd_track_linepass (const std::vector<std::string>& args);
 int cmd_help           (const std::vector<std::string>& args);
 
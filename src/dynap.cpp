@@ -21,16 +21,34 @@
 #include <trackcpp/lattice.h>
 #include <trackcpp/pos.h>
 #include <trackcpp/auxiliary.h>
+#include <trackcpp/tpsa.h>
+#include <trackcpp/naff.h>
 #include <algorithm>
+#include <numeric>
 #include <vector>
 #include <cfloat>
+#include <fstream>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <map>
+#include <memory>
 
-extern void naff_run(const std::vector<Pos<double>>& data, double& tunex, double& tuney);
 static const double tiny_y_amp = 1e-7; // [m]
 
 
 // declaration of auxiliary functions
 static Status::type   calc_closed_orbit(const Accelerator& accelerator, std::vector<Pos<double> >& cod, const char* function_name);
+static double&        scan_coordinate(Pos<double>& p, DynApScanAxis::coordinate coord);
+static void           create_scan_grid(const DynApScan& scan, std::vector<DynApGridPoint>& grid);
+static void           find_midplane_mirrors(const Accelerator& accelerator, const std::vector<Pos<double> >& cod, const DynApScan& scan, const std::vector<DynApGridPoint>& grid, std::vector<unsigned int>& tasks, std::vector<unsigned int>& mirrors);
+static void           select_run_tasks(DynApRunOptions* run_options, const std::vector<unsigned int>* mirrors, std::vector<unsigned int>& tasks);
+static Status::type   checkpoint_start(DynApRunOptions* run_options, const std::string& calc_type, std::vector<DynApGridPoint>& grid, std::vector<unsigned int>& tasks);
+static void           checkpoint_finish();
+static void           checkpoint_task_done(unsigned int idx);
+static void           checkpoint_set_search(unsigned int idx, double pa, double p_delta, double nr_iterations);
+static bool           checkpoint_get_search(unsigned int idx, double& pa, double& p_delta, double& nr_iterations);
+static void           copy_midplane_mirrors(const std::vector<unsigned int>& mirrors, std::vector<DynApGridPoint>& grid);
 //static DynApGridPoint find_momentum_acceptance(const Accelerator& accelerator, const std::vector<Pos<double> >& cod, unsigned int nr_turns, const Pos<double>& p0, double e0, double e_tol, unsigned int element_idx);
 //static DynApGridPoint find_fine_momentum_acceptance(const Accelerator& accelerator, const std::vector<Pos<double> >& cod, unsigned int nr_turns, const Pos<double>& p0, double e_init, double e_tol, unsigned int element_idx);
 //static DynApGridPoint find_px_acceptance(const Accelerator& accelerator, const std::vector<Pos<double> >& cod, unsigned int nr_turns, const Pos<double>& p0, double px0, double px_tol, unsigned int element_idx);
@@ -44,6 +62,8 @@ static std::string                      thread_type = "";
 static const Accelerator*               thread_accelerator = NULL;
 static const std::vector<Pos<double>>*  thread_cod = NULL;
 static std::vector<DynApGridPoint>*     thread_grid = NULL;
+static const std::vector<unsigned int>* thread_tasks = NULL;         // grid indices to be tracked (all, if NULL)
+static const DynApScan*                 thread_scan = NULL;
 static const std::vector<unsigned int>* thread_elements = NULL;
 static const double*                    thread_ma_e0    = NULL;
 static const double*                    thread_ma_e_tol = NULL;
@@ -53,26 +73,43 @@ static const unsigned int*              thread_ma_nr_steps_back = NULL;
 static const double*                    thread_ma_rescale = NULL;
 static const unsigned int*              thread_ma_nr_iterations = NULL;
 static const Pos<double>*               thread_ma_p0 = NULL;
-
-static void           thread_dynap_naff(ThreadSharedData* thread_data, int thread_id, long task_id);
+static std::vector<Pos<double>>*        thread_stage_pos = NULL;     // current positions of surviving particles
+static const std::vector<unsigned int>* thread_stage_idx = NULL;     // grid indices of surviving particles
+static std::vector<Status::type>*       thread_stage_status = NULL;
+static unsigned int                     thread_stage_turn = 0;       // number of turns already tracked
+
+// state of checkpointed runs
+struct AcceptanceSearch {
+  bool   valid;
+  double pa, p_delta, nr_iterations;
+};
+static const DynApRunOptions*             checkpoint_options = NULL;   // NULL if checkpoints are off
+static std::string                        checkpoint_type = "";
+static const std::vector<DynApGridPoint>* checkpoint_grid = NULL;
+static std::vector<char>                  checkpoint_done;             // finished grid points
+static std::vector<AcceptanceSearch>      checkpoint_search;           // in-progress acceptance searches
+static time_t                             checkpoint_time = 0;         // time of last checkpoint
+static pthread_mutex_t                    checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void           thread_dynap_scan(ThreadSharedData* thread_data, int thread_id, long task_id);
+static void           thread_dynap_scan_batch(ThreadSharedData* thread_data, int thread_id, long task_id);
+static DynApBatchAnalysis batched_analysis(const DynApAnalysis& analysis);
 static void           thread_dynap_acceptance(ThreadSharedData* thread_data, int thread_id, long task_id);
-static void           thread_dynap(ThreadSharedData* thread_data, int thread_id, long task_id);
+static void           thread_dynap_stage(ThreadSharedData* thread_data, int thread_id, long task_id);
 //static void           thread_dynap_ma(ThreadSharedData* thread_data, int thread_id, long task_id);
 //static void           thread_dynap_pxa(ThreadSharedData* thread_data, int thread_id, long task_id);
 //static void           thread_dynap_pya(ThreadSharedData* thread_data, int thread_id, long task_id);
 
 // main functions
 
-Status::type dynap_xy(
+Status::type dynap_scan(
     const Accelerator& accelerator,
     std::vector<Pos<double> >& cod,
-    unsigned int nr_turns,
-    const Pos<double>& p0,
-    unsigned int nrpts_x, double x_min, double x_max,
-    unsigned int nrpts_y, double y_min, double y_max,
+    const DynApScan& scan,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    DynApRunOptions* run_options
   ) {
 
   Status::type status = Status::success;
@@ -86,40 +123,75 @@ Status::type dynap_xy(
     }
   }
 
-
   // creates grid with tracking points
-  grid.resize(nrpts_x * nrpts_y);
-  int idx = 0;
-  for(unsigned int i=0; i<nrpts_x; ++i) {
-    double x = x_min + i * (x_max - x_min) / (nrpts_x - 1.0);
-    for(unsigned int j=0; j<nrpts_y; ++j) {
-      double y = y_max + j * (y_min - y_max) / (nrpts_y - 1.0);
-      // prepares initial position
-      grid[idx].p = p0;     // offset
-      grid[idx].p.rx += x;  // dynapt around closed-orbit
-      grid[idx].p.ry += y;  // dynapt around closed-orbit
-      grid[idx].start_element = 0; grid[idx].lost_turn = 0; grid[idx].lost_element = 0; grid[idx].lost_plane = Plane::no_plane;
-      idx++;
-    }
-  }
+  create_scan_grid(scan, grid);
 
   if (status == Status::success) {
-    //std::vector<double> output;
+    // tracks only one half of the grid if motion is symmetric under y -> -y
+    std::vector<unsigned int> tasks, mirrors;
+    find_midplane_mirrors(accelerator, cod, scan, grid, tasks, mirrors);
+    select_run_tasks(run_options, &mirrors, tasks);
+    Status::type checkpoint_status = checkpoint_start(run_options, scan.label, grid, tasks);
+    if (checkpoint_status != Status::success) return checkpoint_status;
+
+    // batched analyses run on blocks of grid points, one per thread task
     ThreadSharedData thread_data;
-    thread_type = "xy";
-    thread_data.nr_tasks = grid.size();
-    thread_data.func =  thread_dynap;
-    thread_nr_turns = nr_turns;
+    thread_type = scan.label;
+    thread_data.nr_tasks = tasks.size();
+    thread_data.func = thread_dynap_scan;
+    if (scan.batch_analysis and (scan.batch_size > 1)) {
+      thread_data.nr_tasks = (tasks.size() + scan.batch_size - 1) / scan.batch_size;
+      thread_data.func = thread_dynap_scan_batch;
+    }
+    thread_nr_turns = scan.nr_turns;
     thread_accelerator = &accelerator;
     thread_cod = &cod;
     thread_grid = &grid;
+    thread_scan = &scan;
+    thread_tasks = &tasks;
     start_all_threads(thread_data, nr_threads);
+    thread_tasks = NULL;
+    thread_scan = NULL;
+    checkpoint_finish();
+
+    copy_midplane_mirrors(mirrors, grid);
   }
 
   return Status::success;
 
 }
 
+DynApScanAxis DynApScanAxis::range(coordinate coord_, unsigned int nrpts, double first, double last) {
+  DynApScanAxis axis(coord_, std::vector<double>(nrpts, first));
+  for(unsigned int i=1; i<nrpts; ++i) axis.values[i] = first + i * (last - first) / (nrpts - 1.0);
+  return axis;
+}
+
+Status::type dynap_xy(
+    const Accelerator& accelerator,
+    std::vector<Pos<double> >& cod,
+    unsigned int nr_turns,
+    const Pos<double>& p0,
+    unsigned int nrpts_x, double x_min, double x_max,
+    unsigned int nrpts_y, double y_min, double y_max,
+    bool calculate_closed_orbit,
+    std::vector<DynApGridPoint>& grid,
+    unsigned int nr_threads,
+    MidPlaneSymmetry::type symmetry,
+    DynApRunOptions* run_options
+  ) {
+
+  DynApScan scan;
+  scan.label = "xy";
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::rx, nrpts_x, x_min, x_max));
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::ry, nrpts_y, y_max, y_min));
+  scan.p0 = p0;
+  scan.nr_turns = nr_turns;
+  scan.symmetry = symmetry;
+  return dynap_scan(accelerator, cod, scan, calculate_closed_orbit, grid, nr_threads, run_options);
+
+}
+
 Status::type dynap_ex(
     const Accelerator& accelerator,
     std::vector<Pos<double> >& cod,
@@ -129,7 +201,34 @@ Status::type dynap_ex(
     unsigned int nrpts_x, double x_min, double x_max,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    DynApRunOptions* run_options
+  ) {
+
+  DynApScan scan;
+  scan.label = "ex";
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::de, nrpts_e, e_min, e_max));
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::rx, nrpts_x, x_max, x_min));
+  scan.p0 = p0;
+  scan.nr_turns = nr_turns;
+  return dynap_scan(accelerator, cod, scan, calculate_closed_orbit, grid, nr_threads, run_options);
+
+}
+
+Status::type dynap_staged(
+    const std::string calc_type,
+    const Accelerator& accelerator,
+    std::vector<Pos<double> >& cod,
+    const std::vector<unsigned int>& stages,
+    const Pos<double>& p0,
+    unsigned int nrpts_1, double min_1, double max_1,
+    unsigned int nrpts_2, double min_2, double max_2,
+    bool calculate_closed_orbit,
+    std::vector<DynApGridPoint>& grid,
+    unsigned int nr_threads,
+    MidPlaneSymmetry::type symmetry,
+    DynApStageCallback stage_callback,
+    DynApRunOptions* run_options
   ) {
 
   Status::type status = Status::success;
@@ -143,34 +242,73 @@ Status::type dynap_ex(
     }
   }
 
-
   // creates grid with tracking points
-  grid.resize(nrpts_e * nrpts_x);
-  int idx = 0;
-  for(unsigned int i=0; i<nrpts_e; ++i) {
-    double e = e_min + i * (e_max - e_min) / (nrpts_e - 1.0);
-    for(unsigned int j=0; j<nrpts_x; ++j) {
-      double x = x_max + j * (x_min - x_max) / (nrpts_x - 1.0);
-      // prepares initial position
-      grid[idx].p = p0;     // offset
-      grid[idx].p.de += e;  // dynapt around closed-orbit
-      grid[idx].p.rx += x;  // dynapt around closed-orbit
-      grid[idx].start_element = 0; grid[idx].lost_turn = 0; grid[idx].lost_element = 0; grid[idx].lost_plane = Plane::no_plane;
-      idx++;
-    }
+  DynApScan scan;
+  scan.p0 = p0;
+  scan.symmetry = symmetry;
+  if (calc_type == "dynap_xy") {
+    scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::rx, nrpts_1, min_1, max_1));
+    scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::ry, nrpts_2, max_2, min_2));
+  } else if (calc_type == "dynap_ex") {
+    scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::de, nrpts_1, min_1, max_1));
+    scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::rx, nrpts_2, max_2, min_2));
+  } else {
+    std::cerr << "undefined staged dynap calculation type" << std::endl;
+    return Status::success;
+  }
+  create_scan_grid(scan, grid);
+
+  if (status != Status::success) return Status::success;
+
+  // compact arrays with surviving particles: positions of live particles are
+  // kept contiguous and each stage resumes tracking from where the last ended.
+  // only one half of the grid is tracked if motion is symmetric under y -> -y.
+  std::vector<unsigned int> survivors, mirrors;
+  find_midplane_mirrors(accelerator, cod, scan, grid, survivors, mirrors);
+  select_run_tasks(run_options, &mirrors, survivors);
+  std::vector<Pos<double>>  positions(survivors.size());
+  std::vector<Status::type> stage_status(survivors.size());
+  for(unsigned int i=0; i<survivors.size(); ++i) {
+    positions[i] = grid[survivors[i]].p + cod[0]; // adds closed-orbit
+    if (fabs(positions[i].ry) < tiny_y_amp) positions[i].ry = sgn(positions[i].ry) * tiny_y_amp;
   }
+  unsigned int nr_points = survivors.size();
+
+  unsigned int turns_done = 0;
+  for(unsigned int s=0; s<stages.size(); ++s) {
+    if (stages[s] <= turns_done) continue;
+
+    if (survivors.size() > 0) {
+      ThreadSharedData thread_data;
+      thread_type = calc_type;
+      thread_data.nr_tasks = survivors.size();
+      thread_data.func = thread_dynap_stage;
+      thread_nr_turns = stages[s] - turns_done;
+      thread_stage_turn = turns_done;
+      thread_accelerator = &accelerator;
+      thread_cod = &cod;
+      thread_grid = &grid;
+      thread_stage_pos = &positions;
+      thread_stage_idx = &survivors;
+      thread_stage_status = &stage_status;
+      start_all_threads(thread_data, nr_threads);
+    }
+    turns_done = stages[s];
+
+    // culls lost particles
+    unsigned int nr_survivors = 0;
+    for(unsigned int i=0; i<survivors.size(); ++i) {
+      if (stage_status[i] != Status::success) continue;
+      survivors[nr_survivors] = survivors[i];
+      positions[nr_survivors] = positions[i];
+      nr_survivors++;
+    }
+    survivors.resize(nr_survivors);
+    positions.resize(nr_survivors);
+    copy_midplane_mirrors(mirrors, grid);
 
-  if (status == Status::success) {
-    //std::vector<double> output;
-    ThreadSharedData thread_data;
-    thread_type = "ex";
-    thread_data.nr_tasks = grid.size();
-    thread_data.func =  thread_dynap;
-    thread_nr_turns = nr_turns;
-    thread_accelerator = &accelerator;
-    thread_cod = &cod;
-    thread_grid = &grid;
-    start_all_threads(thread_data, nr_threads);
+    std::cout << get_timestamp() << " stage " << s+1 << ": " << nr_survivors << " of " << nr_points << " particles survived " << turns_done << " turns" << std::endl;
+    if (stage_callback) stage_callback(turns_done, grid);
   }
 
   return Status::success;
@@ -257,7 +395,8 @@ Status::type dynap_acceptance(
     const std::vector<std::string>& fam_names,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    DynApRunOptions* run_options
   ) {
 
   Status::type status = Status::success;
@@ -294,10 +433,16 @@ Status::type dynap_acceptance(
   if (verbose_on) std::cout << get_timestamp() << " number of elements within range is " << elements.size() << std::endl;
 
   if (status == Status::success) {
+    std::vector<unsigned int> tasks(grid.size());
+    std::iota(tasks.begin(), tasks.end(), 0);
+    select_run_tasks(run_options, NULL, tasks);
+    Status::type checkpoint_status = checkpoint_start(run_options, calc_type, grid, tasks);
+    if (checkpoint_status != Status::success) return checkpoint_status;
+
     //std::vector<double> output;
     ThreadSharedData thread_data;
     thread_type = calc_type;
-    thread_data.nr_tasks = grid.size();
+    thread_data.nr_tasks = tasks.size();
     thread_data.func =  thread_dynap_acceptance;
     thread_nr_turns = nr_turns;
     thread_accelerator = &accelerator;
@@ -310,7 +455,10 @@ Status::type dynap_acceptance(
     thread_ma_nr_iterations = &nr_iterations;
     thread_ma_p0 = &p0;
     thread_elements = &elements;
+    thread_tasks = &tasks;
     start_all_threads(thread_data, nr_threads);
+    thread_tasks = NULL;
+    checkpoint_finish();
   }
 
   return Status::success;
@@ -666,54 +814,26 @@ Status::type dynap_xyfmap(
     unsigned int nrpts_y, double y_min, double y_max,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
-    unsigned int nr_threads
+    unsigned int nr_threads,
+    MidPlaneSymmetry::type symmetry,
+    DynApRunOptions* run_options,
+    const DynApRefinement* refinement,
+    DynApAnalysis analysis
   ) {
 
-  Status::type status = Status::success;
-
-  // finds 6D closed-orbit
-  if (calculate_closed_orbit) {
-    status = calc_closed_orbit(accelerator, cod, __FUNCTION__);
-    if (status != Status::success) {
-      cod.clear();
-      for(unsigned int i=0; i<1+accelerator.lattice.size(); ++i) cod.push_back(Pos<double>(nan("")));
-    }
+  DynApScan scan;
+  scan.label = "xyfmap";
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::rx, nrpts_x, x_min, x_max));
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::ry, nrpts_y, y_max, y_min));
+  scan.p0 = p0;
+  scan.nr_turns = nr_turns;
+  scan.analysis = analysis;
+  scan.batch_analysis = batched_analysis(analysis);
+  scan.symmetry = symmetry;
+  if ((refinement != nullptr) and (refinement->max_depth > 0)) {
+    return dynap_fmap_adaptive(accelerator, cod, scan, *refinement, calculate_closed_orbit, grid, nr_threads);
   }
-
-
-  // creates grid with tracking points
-  grid.resize(nrpts_x * nrpts_y);
-  //std::cout << "teste: " << nrpts_x << " " << nrpts_y << " " << grid.size() << std::endl;
-  int idx = 0;
-  for(unsigned int i=0; i<nrpts_x; ++i) {
-    double x = x_min + i * (x_max - x_min) / (nrpts_x - 1.0);
-    for(unsigned int j=0; j<nrpts_y; ++j) {
-      double y = y_max + j * (y_min - y_max) / (nrpts_y - 1.0);
-      // prepares initial position
-      grid[idx].p = p0;     // offset
-      grid[idx].p.rx += x;  // dynapt around closed-orbit
-      grid[idx].p.ry += y;  // dynapt around closed-orbit
-      grid[idx].start_element = 0; grid[idx].lost_turn = 0; grid[idx].lost_element = 0; grid[idx].lost_plane = Plane::no_plane;
-      grid[idx].nux1 = grid[idx].nuy1 = 0.0;
-      grid[idx].nux2 = grid[idx].nuy2 = 0.0;
-      idx++;
-    }
-  }
-
-  if (status == Status::success) {
-    std::vector<double> output;
-    thread_type = "xyfmap";
-    ThreadSharedData thread_data;
-    thread_data.nr_tasks = grid.size();
-    thread_data.func =  thread_dynap_naff;
-    thread_nr_turns = nr_turns;
-    thread_accelerator = &accelerator;
-    thread_cod = &cod;
-    thread_grid = &grid;
-    start_all_threads(thread_data, nr_threads);
-  }
-
-  return Status::success;
+  return dynap_scan(accelerator, cod, scan, calculate_closed_orbit, grid, nr_threads, run_options);
 
 }
 
@@ -726,56 +846,413 @@ Status::type dynap_exfmap(
     unsigned int nrpts_x, double x_min, double x_max,
     bool calculate_closed_orbit,
     std::vector<DynApGridPoint>& grid,
+    unsigned int nr_threads,
+    DynApRunOptions* run_options,
+    const DynApRefinement* refinement,
+    DynApAnalysis analysis
+  ) {
+
+  DynApScan scan;
+  scan.label = "exfmap";
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::de, nrpts_e, e_min, e_max));
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::rx, nrpts_x, x_max, x_min));
+  scan.p0 = p0;
+  scan.nr_turns = nr_turns;
+  scan.analysis = analysis;
+  scan.batch_analysis = batched_analysis(analysis);
+  if ((refinement != nullptr) and (refinement->max_depth > 0)) {
+    return dynap_fmap_adaptive(accelerator, cod, scan, *refinement, calculate_closed_orbit, grid, nr_threads);
+  }
+  return dynap_scan(accelerator, cod, scan, calculate_closed_orbit, grid, nr_threads, run_options);
+
+}
+
+// cells of adaptive fmaps, in units of the finest grid spacing
+struct FmapCell {
+  long i, j, size;
+};
+
+// tune diffusion log10(|dnu|) of a point of a frequency map, or its chaos indicator
+static double fmap_diffusion(const DynApGridPoint& point) {
+  if (not std::isnan(point.chaos)) return point.chaos;
+  double dnux = point.nux2 - point.nux1, dnuy = point.nuy2 - point.nuy1;
+  return log10(std::max(sqrt(dnux*dnux + dnuy*dnuy), 1e-16));
+}
+
+Status::type dynap_fmap_adaptive(
+    const Accelerator& accelerator,
+    std::vector<Pos<double> >& cod,
+    const DynApScan& scan,
+    const DynApRefinement& refinement,
+    bool calculate_closed_orbit,
+    std::vector<DynApGridPoint>& grid,
     unsigned int nr_threads
   ) {
 
-  Status::type status = Status::success;
+  if (scan.axes.size() != 2) return Status::inconsistent_dimensions;
+  const DynApScanAxis& axis1 = scan.axes[0];
+  const DynApScanAxis& axis2 = scan.axes[1];
+  const unsigned int n1 = axis1.values.size(), n2 = axis2.values.size();
+
+  // initial grid
+  Status::type status = dynap_scan(accelerator, cod, scan, calculate_closed_orbit, grid, nr_threads);
+  if (status != Status::success) return status;
+  if (cod.empty() or std::isnan(cod[0].rx)) return Status::success;  // no closed-orbit, nothing tracked
+
+  // points of the finest grid are indexed by (i,j), with initial grid points at multiples of 'scale'
+  const long scale = 1L << refinement.max_depth;
+  std::map<std::pair<long,long>, unsigned int> points;
+  std::vector<FmapCell> cells;
+  for(unsigned int i=0; i<n1; ++i) {
+    for(unsigned int j=0; j<n2; ++j) {
+      points[std::make_pair(i*scale, j*scale)] = i*n2 + j;
+      if ((i+1 < n1) and (j+1 < n2)) cells.push_back({i*scale, j*scale, scale});
+    }
+  }
+  // coordinate of finest grid index k, interpolated between initial grid values
+  auto coordinate = [scale](const std::vector<double>& values, long k) {
+    long c = std::min(k / scale, (long) values.size() - 1);
+    return (k % scale == 0) ? values[c] : values[c] + (values[c+1] - values[c]) * (k % scale) / double(scale);
+  };
+
+  for(unsigned int level=1; level<=refinement.max_depth; ++level) {
+
+    // selects cells to be subdivided
+    std::vector<FmapCell> refined;
+    for(unsigned int c=0; c<cells.size(); ++c) {
+      const FmapCell& cell = cells[c];
+      const DynApGridPoint* corners[4] = {
+        &grid[points[std::make_pair(cell.i, cell.j)]],
+        &grid[points[std::make_pair(cell.i+cell.size, cell.j)]],
+        &grid[points[std::make_pair(cell.i, cell.j+cell.size)]],
+        &grid[points[std::make_pair(cell.i+cell.size, cell.j+cell.size)]]
+      };
+      unsigned int nr_lost = 0;
+      double d_min = DBL_MAX, d_max = -DBL_MAX;
+      for(unsigned int k=0; k<4; ++k) {
+        if (corners[k]->lost_plane != Plane::no_plane) { nr_lost++; continue; }
+        double d = fmap_diffusion(*corners[k]);
+        d_min = std::min(d_min, d); d_max = std::max(d_max, d);
+      }
+      if (nr_lost == 4) continue;
+      if ((nr_lost > 0) or (d_max - d_min > refinement.diffusion_threshold)) refined.push_back(cell);
+    }
+    if (refined.empty()) break;
+
+    // new points at the edge midpoints and centre of the refined cells
+    DynApScan sub_scan = scan;
+    sub_scan.axes.clear();
+    sub_scan.points.clear();
+    sub_scan.symmetry = MidPlaneSymmetry::off;
+    std::vector<std::pair<long,long>> new_points;
+    cells.clear();
+    for(unsigned int c=0; c<refined.size(); ++c) {
+      const FmapCell& cell = refined[c];
+      long h = cell.size / 2;
+      const long offsets[5][2] = {{h,0}, {0,h}, {h,h}, {2*h,h}, {h,2*h}};
+      for(unsigned int k=0; k<5; ++k) {
+        std::pair<long,long> key(cell.i + offsets[k][0], cell.j + offsets[k][1]);
+        if (points.count(key)) continue;
+        points[key] = grid.size() + new_points.size();
+        new_points.push_back(key);
+        Pos<double> offset(0);
+        scan_coordinate(offset, axis1.coord) = coordinate(axis1.values, key.first);
+        scan_coordinate(offset, axis2.coord) = coordinate(axis2.values, key.second);
+        sub_scan.points.push_back(offset);
+      }
+      cells.push_back({cell.i,   cell.j,   h}); cells.push_back({cell.i+h, cell.j,   h});
+      cells.push_back({cell.i,   cell.j+h, h}); cells.push_back({cell.i+h, cell.j+h, h});
+    }
+    if (verbose_on) std::cout << get_timestamp() << " adaptive fmap: level " << level << " refines " << refined.size() << " cells with " << new_points.size() << " new points" << std::endl;
 
-  // finds 6D closed-orbit
-  if (calculate_closed_orbit) {
-    status = calc_closed_orbit(accelerator, cod, __FUNCTION__);
-    if (status != Status::success) {
-      cod.clear();
-      for(unsigned int i=0; i<1+accelerator.lattice.size(); ++i) cod.push_back(Pos<double>(nan("")));
+    std::vector<DynApGridPoint> new_grid;
+    status = dynap_scan(accelerator, cod, sub_scan, false, new_grid, nr_threads);
+    if (status != Status::success) return status;
+    grid.insert(grid.end(), new_grid.begin(), new_grid.end());
+
+  }
+
+  return Status::success;
+
+}
+
+// built-in analyses of 'dynap_scan'
+
+Status::type dynap_analysis_survival(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
+  std::vector<Pos<double>> new_pos;
+  return track_ringpass(accelerator, p, new_pos, nr_turns, point.lost_turn, point.lost_element, point.lost_plane, false);
+}
+
+// tracks 'nr_turns' turns as 'track_ringpass', appending the position at the end of each turn to
+// 'buffer' (a NaffBuffer or a vector of positions)
+template <typename Buffer>
+static Status::type track_ringpass_naff(const Accelerator& accelerator, Pos<double>& p, unsigned int nr_turns, DynApGridPoint& point, Buffer& buffer) {
+  static thread_local std::vector<Pos<double>> final_pos;
+  for(point.lost_turn=0; point.lost_turn<nr_turns; ++point.lost_turn) {
+    final_pos.clear();
+    Status::type status = track_linepass(accelerator, p, final_pos, point.lost_element, point.lost_plane, false);
+    if (status != Status::success) return status;
+    buffer.push_back(p);
+  }
+  return Status::success;
+}
+
+static Status::type analysis_tunes(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point, NaffMethod::type method) {
+  static thread_local NaffBuffer buffer;
+  buffer.clear(nr_turns);
+  Status::type status = track_ringpass_naff(accelerator, p, nr_turns, point, buffer);
+  if (status == Status::success) buffer.run(0, nr_turns, point.nux1, point.nuy1, method);
+  return status;
+}
+
+static Status::type analysis_diffusion(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point, NaffMethod::type method) {
+
+  // both halves of the turns are kept in the same buffer, reused by the thread
+  static thread_local NaffBuffer buffer;
+  const unsigned int half = nr_turns / 2;
+  buffer.clear(2*half);
+
+  // tunes of the first half of the turns
+  Status::type status = track_ringpass_naff(accelerator, p, half, point, buffer);
+  if (status != Status::success) return status;
+  buffer.run(0, half, point.nux1, point.nuy1, method);
+
+  // tunes of the second half of the turns
+  status = track_ringpass_naff(accelerator, p, half, point, buffer);
+  if (status == Status::success) buffer.run(half, half, point.nux2, point.nuy2, method);
+  return status;
+
+}
+
+void dynap_analysis_diffusion_batch(const Accelerator& accelerator, unsigned int nr_turns, const std::vector<Pos<double>>& p, const std::vector<DynApGridPoint*>& points, std::vector<Status::type>& status) {
+
+  // turns of each particle, and the particles that survived each half of them
+  static thread_local std::vector<std::vector<Pos<double>>> turns;
+  static thread_local NaffBatch batch;
+  const unsigned int half = nr_turns / 2, n = p.size();
+  std::vector<unsigned int> survivors[2];
+  turns.resize(std::max((size_t) n, turns.size()));
+  status.assign(n, Status::success);
+  for(unsigned int k=0; k<n; ++k) {
+    Pos<double> q = p[k];
+    turns[k].clear();
+    for(unsigned int h=0; (h<2) and (status[k] == Status::success); ++h) {
+      status[k] = track_ringpass_naff(accelerator, q, half, *points[k], turns[k]);
+      if (status[k] == Status::success) survivors[h].push_back(k);
     }
   }
 
-  // creates grid with tracking points
-  grid.resize(nrpts_e * nrpts_x);
-  int idx = 0;
-  for(unsigned int i=0; i<nrpts_e; ++i) {
-    double e = e_min + i * (e_max - e_min) / (nrpts_e - 1.0);
-    for(unsigned int j=0; j<nrpts_x; ++j) {
-      double x = x_max + j * (x_min - x_max) / (nrpts_x - 1.0);
-      // prepares initial position
-      grid[idx].p = p0;     // offset
-      grid[idx].p.de += e;  // dynapt around closed-orbit
-      grid[idx].p.rx += x;  // dynapt around closed-orbit
-      grid[idx].start_element = 0; grid[idx].lost_turn = 0; grid[idx].lost_element = 0; grid[idx].lost_plane = Plane::no_plane;
-      grid[idx].nux1 = grid[idx].nuy1 = 0.0;
-      grid[idx].nux2 = grid[idx].nuy2 = 0.0;
-      idx++;
+  // tunes of each half of the turns
+  std::vector<double> tunex, tuney;
+  for(unsigned int h=0; h<2; ++h) {
+    const std::vector<unsigned int>& alive = survivors[h];
+    batch.resize(alive.size(), half);
+    for(unsigned int i=0; i<alive.size(); ++i) {
+      for(unsigned int t=0; t<half; ++t) batch.set(i, t, turns[alive[i]][h*half + t]);
+    }
+    batch.run(0, half, tunex, tuney);
+    for(unsigned int i=0; i<alive.size(); ++i) {
+      DynApGridPoint& point = *points[alive[i]];
+      (h == 0 ? point.nux1 : point.nux2) = tunex[i];
+      (h == 0 ? point.nuy1 : point.nuy2) = tuney[i];
     }
   }
 
-  if (status == Status::success) {
-    std::vector<double> output;
-    thread_type = "exfmap";
-    ThreadSharedData thread_data;
-    thread_data.nr_tasks = grid.size();
-    thread_data.func = thread_dynap_naff;
-    thread_nr_turns = nr_turns;
-    thread_accelerator = &accelerator;
-    thread_cod = &cod;
-    thread_grid = &grid;
-    start_all_threads(thread_data, nr_threads);
+}
+
+// batched version of a built-in analysis, if it has one
+static DynApBatchAnalysis batched_analysis(const DynApAnalysis& analysis) {
+  typedef Status::type (*AnalysisFunction)(const Accelerator&, unsigned int, Pos<double>, DynApGridPoint&);
+  const AnalysisFunction* f = analysis.target<AnalysisFunction>();
+  if ((f != nullptr) and (*f == dynap_analysis_diffusion)) return dynap_analysis_diffusion_batch;
+  return nullptr;
+}
+
+Status::type dynap_analysis_tunes(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
+  return analysis_tunes(accelerator, nr_turns, p, point, NaffMethod::naff);
+}
+
+Status::type dynap_analysis_diffusion(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
+  return analysis_diffusion(accelerator, nr_turns, p, point, NaffMethod::naff);
+}
+
+DynApAnalysis dynap_analysis_tunes_method(NaffMethod::type method) {
+  return [method](const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
+    return analysis_tunes(accelerator, nr_turns, p, point, method);
+  };
+}
+
+DynApAnalysis dynap_analysis_diffusion_method(NaffMethod::type method) {
+  return [method](const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
+    return analysis_diffusion(accelerator, nr_turns, p, point, method);
+  };
+}
+
+// accelerator whose tracking with reversed px, py and dl undoes the tracking of 'accelerator'
+static Accelerator time_reversed_accelerator(const Accelerator& accelerator) {
+
+  const double r[6] = {1, -1, 1, -1, 1, -1};  // time reversal of coordinates
+  Accelerator reversed = accelerator;
+  reversed.radiation_on = false;
+  reversed.lattice = latt_reverse(accelerator.lattice);
+  for(unsigned int i=0; i<reversed.lattice.size(); ++i) {
+    Element& e = reversed.lattice[i];
+    std::swap(e.angle_in, e.angle_out);
+    std::swap(e.fint_in, e.fint_out);
+    // entrance and exit transformations become the inverses of the exit and entrance ones:
+    // the exit 'x -> r_out x + t_out' is undone by translating with -t_out and then rotating
+    // with r_out^-1, and the entrance 'x -> r_in (x + t_in)' by rotating with r_in^-1 and then
+    // translating with -t_in, which is the order in which entrances and exits are applied.
+    double t_in[6], t_out[6];
+    std::copy(e.t_in, e.t_in+6, t_in);   std::copy(e.t_out, e.t_out+6, t_out);
+    Matrix r_in(6), r_out(6);
+    for(unsigned int k=0; k<6; ++k) {
+      for(unsigned int l=0; l<6; ++l) {
+        r_in[k][l] = e.r_in[k*6+l]; r_out[k][l] = e.r_out[k*6+l];
+      }
+    }
+    r_in.inverse(); r_out.inverse();
+    for(unsigned int k=0; k<6; ++k) {
+      e.t_in[k]  = -r[k] * t_out[k];
+      e.t_out[k] = -r[k] * t_in[k];
+      for(unsigned int l=0; l<6; ++l) {
+        e.r_in[k*6+l]  = r[k] * r_out[k][l] * r[l];
+        e.r_out[k*6+l] = r[k] * r_in[k][l] * r[l];
+      }
+    }
   }
+  return reversed;
+
+}
+
+DynApAnalysis dynap_analysis_rem(const Accelerator& accelerator) {
+
+  std::shared_ptr<Accelerator> forward(new Accelerator(accelerator));
+  forward->radiation_on = false;
+  std::shared_ptr<const Accelerator> backward(new Accelerator(time_reversed_accelerator(accelerator)));
+
+  return [forward, backward](const Accelerator&, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
 
+    const Pos<double> p0 = p;
+    std::vector<Pos<double>> new_pos;
+    Status::type status = track_ringpass(*forward, p, new_pos, nr_turns, point.lost_turn, point.lost_element, point.lost_plane, false);
+    if (status != Status::success) return status;
+
+    // tracks back from the start element, which is at the end of element 'n - start_element' of the reversed lattice
+    Pos<double> q = new_pos.back();
+    q.px = -q.px; q.py = -q.py; q.dl = -q.dl;
+    unsigned int n = backward->lattice.size();
+    unsigned int element_offset = (n - point.start_element) % n, lost_turn;
+    Plane::type lost_plane;
+    new_pos.clear();
+    if (track_ringpass(*backward, q, new_pos, nr_turns, lost_turn, element_offset, lost_plane, false) != Status::success) {
+      point.chaos = INFINITY;
+      return status;
+    }
+    q = new_pos.back();
+    double d = std::max(std::max(fabs(q.rx - p0.rx), fabs(q.px + p0.px)), std::max(fabs(q.ry - p0.ry), fabs(q.py + p0.py)));
+    point.chaos = log10(std::max(d, 1e-16));
+    return status;
+
+  };
+
+}
 
+// tracks 'p' turn by turn, calling 'turn_map' with the one-turn jacobian around the particle
+// after each turn. as 'track_ringpass', stops at the turn in which the particle is lost.
+static Status::type track_tangent_map(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point, const std::function<void(const double (&m)[6][6])>& turn_map) {
+
+  std::vector<Pos<Tpsa<6,1>>> final_pos;
+  double m[6][6];
+  for(point.lost_turn=0; point.lost_turn<nr_turns; ++point.lost_turn) {
+    Pos<Tpsa<6,1>> map;
+    map.rx = Tpsa<6,1>(p.rx, 0); map.px = Tpsa<6,1>(p.px, 1);
+    map.ry = Tpsa<6,1>(p.ry, 2); map.py = Tpsa<6,1>(p.py, 3);
+    map.de = Tpsa<6,1>(p.de, 4); map.dl = Tpsa<6,1>(p.dl, 5);
+    final_pos.clear();
+    Status::type status = track_linepass(accelerator, map, final_pos, point.lost_element, point.lost_plane, false);
+    if (status != Status::success) return status;
+    const Tpsa<6,1>* coords[6] = {&map.rx, &map.px, &map.ry, &map.py, &map.de, &map.dl};
+    for(unsigned int i=0; i<6; ++i) {
+      for(unsigned int j=0; j<6; ++j) m[i][j] = coords[i]->get_c(j+1);
+    }
+    p.rx = double(map.rx); p.px = double(map.px); p.ry = double(map.ry);
+    p.py = double(map.py); p.de = double(map.de); p.dl = double(map.dl);
+    turn_map(m);
+  }
   return Status::success;
 
 }
 
+// applies 'm' to the tangent vector 'w' and normalizes it, returning its norm before normalization
+static double propagate_tangent_vector(const double (&m)[6][6], double (&w)[6]) {
+  double v[6], norm = 0;
+  for(unsigned int i=0; i<6; ++i) {
+    v[i] = 0;
+    for(unsigned int j=0; j<6; ++j) v[i] += m[i][j] * w[j];
+    norm += v[i] * v[i];
+  }
+  norm = sqrt(norm);
+  for(unsigned int i=0; i<6; ++i) w[i] = v[i] / norm;
+  return norm;
+}
+
+Status::type dynap_analysis_fli(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
+
+  double w[6] = {0.5, 0.5, 0.5, 0.5, 0, 0};
+  double log_norm = 0, fli = 0;
+  Status::type status = track_tangent_map(accelerator, nr_turns, p, point, [&](const double (&m)[6][6]) {
+    log_norm += log10(propagate_tangent_vector(m, w));
+    fli = std::max(fli, log_norm);
+  });
+  if (status == Status::success) point.chaos = fli;
+  return status;
+
+}
+
+Status::type dynap_analysis_sali(const Accelerator& accelerator, unsigned int nr_turns, Pos<double> p, DynApGridPoint& point) {
+
+  double w1[6] = {1, 0, 0, 0, 0, 0};
+  double w2[6] = {0, 0, 1, 0, 0, 0};
+  double sali = sqrt(2.0);
+  Status::type status = track_tangent_map(accelerator, nr_turns, p, point, [&](const double (&m)[6][6]) {
+    propagate_tangent_vector(m, w1);
+    propagate_tangent_vector(m, w2);
+    double d_plus = 0, d_minus = 0;
+    for(unsigned int i=0; i<6; ++i) {
+      d_plus  += (w1[i] + w2[i]) * (w1[i] + w2[i]);
+      d_minus += (w1[i] - w2[i]) * (w1[i] - w2[i]);
+    }
+    sali = std::min(sali, sqrt(std::min(d_plus, d_minus)));
+  });
+  if (status == Status::success) point.chaos = log10(std::max(sali, 1e-16));
+  return status;
+
+}
+
+bool has_midplane_symmetry(const Accelerator& accelerator) {
+
+  for(unsigned int i=0; i<accelerator.lattice.size(); ++i) {
+    const Element& e = accelerator.lattice[i];
+    // kicktables are not assumed to be symmetric
+    if (e.pass_method == PassMethod::pm_kicktable_pass) return false;
+    if (e.vkick != 0) return false;
+    // skew multipoles
+    for(unsigned int n=0; n<e.polynom_a.size(); ++n) if (e.polynom_a[n] != 0) return false;
+    // vertical misalignments and rotations coupling the vertical plane
+    if ((e.t_in[2] != 0) or (e.t_in[3] != 0) or (e.t_out[2] != 0) or (e.t_out[3] != 0)) return false;
+    for(unsigned int r=0; r<6; ++r) {
+      for(unsigned int c=0; c<6; ++c) {
+        if (((r == 2) or (r == 3)) == ((c == 2) or (c == 3))) continue;
+        if ((e.r_in[r*6+c] != 0) or (e.r_out[r*6+c] != 0)) return false;
+      }
+    }
+    // vertical apertures
+    if (accelerator.vchamber_on and (e.vmin != -e.vmax)) return false;
+  }
+  return true;
+
+}
 
 // implementation of auxiliary functions
 
@@ -799,6 +1276,298 @@ static Status::type calc_closed_orbit(const Accelerator& accelerator, std::vecto
   return status;
 }
 
+static double& scan_coordinate(Pos<double>& p, DynApScanAxis::coordinate coord) {
+  switch (coord) {
+    case DynApScanAxis::rx: return p.rx;
+    case DynApScanAxis::px: return p.px;
+    case DynApScanAxis::ry: return p.ry;
+    case DynApScanAxis::py: return p.py;
+    case DynApScanAxis::de: return p.de;
+    default:                return p.dl;
+  }
+}
+
+static void create_scan_grid(const DynApScan& scan, std::vector<DynApGridPoint>& grid) {
+
+  DynApGridPoint point;
+  point.p = scan.p0;
+  point.start_element = scan.start_element; point.lost_turn = 0; point.lost_element = scan.start_element; point.lost_plane = Plane::no_plane;
+  point.nux1 = point.nuy1 = 0.0;
+  point.nux2 = point.nuy2 = 0.0;
+
+  // explicit list of initial conditions
+  grid.clear();
+  if (scan.axes.empty()) {
+    for(unsigned int i=0; i<scan.points.size(); ++i) {
+      grid.push_back(point);
+      grid.back().p = scan.p0 + scan.points[i];
+    }
+    return;
+  }
+
+  // grid spanned by the axes, the last one varying fastest
+  unsigned int nr_points = 1;
+  for(unsigned int a=0; a<scan.axes.size(); ++a) nr_points *= scan.axes[a].values.size();
+  grid.resize(nr_points, point);
+  std::vector<unsigned int> k(scan.axes.size(), 0);
+  for(unsigned int idx=0; idx<nr_points; ++idx) {
+    for(unsigned int a=0; a<scan.axes.size(); ++a) {
+      scan_coordinate(grid[idx].p, scan.axes[a].coord) += scan.axes[a].values[k[a]];  // dynapt around closed-orbit
+    }
+    for(int a=scan.axes.size()-1; a>=0; --a) {
+      if (++k[a] < scan.axes[a].values.size()) break;
+      k[a] = 0;
+    }
+  }
+
+}
+
+// selects the grid points to be tracked. 'mirrors[i]' is the index of the
+// tracked point whose result is copied to point 'i' (or 'i' itself).
+static void find_midplane_mirrors(const Accelerator& accelerator, const std::vector<Pos<double> >& cod, const DynApScan& scan, const std::vector<DynApGridPoint>& grid, std::vector<unsigned int>& tasks, std::vector<unsigned int>& mirrors) {
+
+  tasks.clear();
+  mirrors.resize(grid.size());
+  for(unsigned int i=0; i<grid.size(); ++i) mirrors[i] = i;
+
+  bool use_symmetry = (scan.symmetry == MidPlaneSymmetry::on);
+  if (scan.symmetry == MidPlaneSymmetry::automatic) {
+    const Pos<double>& co = cod[scan.start_element];
+    use_symmetry = (scan.p0.ry == 0) and (scan.p0.py == 0) and
+                   (co.ry == 0) and (co.py == 0) and
+                   has_midplane_symmetry(accelerator);
+  }
+
+  // index of the value -v for each value v of the vertical axes
+  std::vector<std::vector<long>> mirror_values(scan.axes.size());
+  bool has_vertical_axes = false;
+  for(unsigned int a=0; a<scan.axes.size(); ++a) {
+    const std::vector<double>& v = scan.axes[a].values;
+    std::vector<long>& m = mirror_values[a];
+    m.resize(v.size());
+    for(unsigned int j=0; j<v.size(); ++j) m[j] = j;
+    if ((scan.axes[a].coord != DynApScanAxis::ry) and (scan.axes[a].coord != DynApScanAxis::py)) continue;
+    if (v.size() < 2) continue;
+    has_vertical_axes = true;
+    double tol = 1e-6 * fabs(*std::max_element(v.begin(), v.end()) - *std::min_element(v.begin(), v.end())) / (v.size() - 1.0);
+    for(unsigned int j=0; j<v.size(); ++j) {
+      m[j] = -1;
+      for(unsigned int k=0; k<v.size(); ++k) {
+        if (fabs(v[k] + v[j]) <= tol) { m[j] = k; break; }
+      }
+    }
+  }
+
+  if (use_symmetry and has_vertical_axes) {
+    std::vector<unsigned int> k(scan.axes.size(), 0);
+    for(unsigned int idx=0; idx<grid.size(); ++idx) {
+      // tracks the half with y > 0, or y = 0 and py >= 0
+      double y = 0, py = 0;
+      for(unsigned int a=0; a<scan.axes.size(); ++a) {
+        if (scan.axes[a].coord == DynApScanAxis::ry) y += scan.axes[a].values[k[a]];
+        if (scan.axes[a].coord == DynApScanAxis::py) py += scan.axes[a].values[k[a]];
+      }
+      if ((y < 0) or ((y == 0) and (py < 0))) {
+        // looks for the grid point at (-y,-py)
+        long mirror = 0;
+        for(unsigned int a=0; (a<scan.axes.size()) and (mirror >= 0); ++a) {
+          long m = mirror_values[a][k[a]];
+          mirror = (m < 0) ? -1 : mirror * scan.axes[a].values.size() + m;
+        }
+        if (mirror >= 0) mirrors[idx] = mirror;
+      }
+      for(int a=scan.axes.size()-1; a>=0; --a) {
+        if (++k[a] < scan.axes[a].values.size()) break;
+        k[a] = 0;
+      }
+    }
+  }
+
+  for(unsigned int i=0; i<grid.size(); ++i) if (mirrors[i] == i) tasks.push_back(i);
+  if (verbose_on and (tasks.size() < grid.size())) {
+    std::cout << get_timestamp() << " midplane symmetry: tracking " << tasks.size() << " of " << grid.size() << " grid points" << std::endl;
+  }
+
+}
+
+// keeps only the tasks of this process' shard and records which grid points
+// (tracked ones and their mirror images) are computed in this run.
+static void select_run_tasks(DynApRunOptions* run_options, const std::vector<unsigned int>* mirrors, std::vector<unsigned int>& tasks) {
+
+  if (run_options == NULL) return;
+
+  unsigned int nr_shards = std::max(1u, run_options->nr_shards);
+  unsigned int grid_size = (mirrors == NULL) ? tasks.size() : mirrors->size();
+  std::vector<char> tracked(grid_size, 0);
+  unsigned int nr_tasks = 0;
+  for(unsigned int k=0; k<tasks.size(); ++k) {
+    if ((k % nr_shards) != run_options->shard_index) continue;
+    tracked[tasks[k]] = 1;
+    tasks[nr_tasks++] = tasks[k];
+  }
+  tasks.resize(nr_tasks);
+
+  run_options->computed.clear();
+  for(unsigned int i=0; i<grid_size; ++i) {
+    if (tracked[(mirrors == NULL) ? i : (*mirrors)[i]]) run_options->computed.push_back(i);
+  }
+
+}
+
+// checkpoints: finished grid points and the state of acceptance searches are
+// periodically written to a file. the file is written under a temporary name
+// and then renamed, so that an interrupted write never corrupts it.
+
+static Status::type checkpoint_write() {
+
+  const std::string& filename = checkpoint_options->checkpoint_filename;
+  const std::string tmp_filename = filename + ".tmp";
+  const std::vector<DynApGridPoint>& grid = *checkpoint_grid;
+
+  FILE* fp = fopen(tmp_filename.c_str(), "w");
+  if (fp == nullptr) return Status::file_not_opened;
+  fprintf(fp, "# [dynap_checkpoint]\n");
+  fprintf(fp, "# calc_type         : %s\n", checkpoint_type.c_str());
+  fprintf(fp, "# grid_size         : %lu\n", grid.size());
+  for(unsigned int i=0; i<grid.size(); ++i) {
+    if (not checkpoint_done[i]) continue;
+    const DynApGridPoint& g = grid[i];
+    fprintf(fp, "point %u %u %u %u %i %+.17E %+.17E %+.17E %+.17E %+.17E %+.17E %+.17E %+.17E %+.17E %+.17E %+.17E\n", i, g.start_element, g.lost_turn, g.lost_element, g.lost_plane, g.p.rx, g.p.px, g.p.ry, g.p.py, g.p.de, g.p.dl, g.nux1, g.nuy1, g.nux2, g.nuy2, g.chaos);
+  }
+  for(unsigned int i=0; i<checkpoint_search.size(); ++i) {
+    if (not checkpoint_search[i].valid) continue;
+    const AcceptanceSearch& a = checkpoint_search[i];
+    fprintf(fp, "search %u %+.17E %+.17E %+.17E\n", i, a.pa, a.p_delta, a.nr_iterations);
+  }
+  fflush(fp);
+  fsync(fileno(fp));
+  fclose(fp);
+  if (rename(tmp_filename.c_str(), filename.c_str()) != 0) return Status::file_not_opened;
+  return Status::success;
+
+}
+
+static Status::type checkpoint_read(const std::string& filename, const std::string& calc_type, std::vector<DynApGridPoint>& grid) {
+
+  std::ifstream fi(filename.c_str());
+  if (not fi.is_open()) return Status::file_not_found;
+
+  std::string line;
+  char type[64];
+  unsigned long grid_size;
+  if (not std::getline(fi, line) or (line != "# [dynap_checkpoint]")) return Status::inconsistent_dimensions;
+  if (not std::getline(fi, line) or (sscanf(line.c_str(), "# calc_type : %63s", type) != 1) or (calc_type != type)) return Status::inconsistent_dimensions;
+  if (not std::getline(fi, line) or (sscanf(line.c_str(), "# grid_size : %lu", &grid_size) != 1) or (grid_size != grid.size())) return Status::inconsistent_dimensions;
+
+  while (std::getline(fi, line)) {
+    unsigned int idx;
+    int lost_plane;
+    DynApGridPoint g;
+    AcceptanceSearch a;
+    if (sscanf(line.c_str(), "point %u %u %u %u %i %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", &idx, &g.start_element, &g.lost_turn, &g.lost_element, &lost_plane, &g.p.rx, &g.p.px, &g.p.ry, &g.p.py, &g.p.de, &g.p.dl, &g.nux1, &g.nuy1, &g.nux2, &g.nuy2, &g.chaos) == 16) {
+      if (idx >= grid.size()) return Status::inconsistent_dimensions;
+      g.lost_plane = (Plane::type) lost_plane;
+      grid[idx] = g;
+      checkpoint_done[idx] = 1;
+    } else if (sscanf(line.c_str(), "search %u %lf %lf %lf", &idx, &a.pa, &a.p_delta, &a.nr_iterations) == 4) {
+      if (idx >= grid.size()) return Status::inconsistent_dimensions;
+      a.valid = true;
+      checkpoint_search[idx] = a;
+    }
+  }
+  return Status::success;
+
+}
+
+// enables checkpoints for the run. when resuming, restores finished grid points
+// and removes their tasks from the list.
+static Status::type checkpoint_start(DynApRunOptions* run_options, const std::string& calc_type, std::vector<DynApGridPoint>& grid, std::vector<unsigned int>& tasks) {
+
+  checkpoint_options = NULL;
+  if ((run_options == NULL) or run_options->checkpoint_filename.empty()) return Status::success;
+
+  checkpoint_type = calc_type;
+  checkpoint_grid = &grid;
+  checkpoint_done.assign(grid.size(), 0);
+  checkpoint_search.assign(grid.size(), AcceptanceSearch());
+
+  if (run_options->resume) {
+    Status::type status = checkpoint_read(run_options->checkpoint_filename, calc_type, grid);
+    if (status == Status::inconsistent_dimensions) {
+      std::cerr << "checkpoint file '" << run_options->checkpoint_filename << "' does not correspond to this run" << std::endl;
+      return status;
+    }
+    unsigned int nr_tasks = 0;
+    for(unsigned int k=0; k<tasks.size(); ++k) {
+      if (not checkpoint_done[tasks[k]]) tasks[nr_tasks++] = tasks[k];
+    }
+    if (verbose_on) std::cout << get_timestamp() << " resuming run: " << tasks.size() - nr_tasks << " finished tasks read from checkpoint" << std::endl;
+    tasks.resize(nr_tasks);
+  }
+
+  checkpoint_options = run_options;
+  checkpoint_time = time(NULL);
+  return Status::success;
+
+}
+
+static void checkpoint_finish() {
+  if (checkpoint_options == NULL) return;
+  pthread_mutex_lock(&checkpoint_mutex);
+  if (checkpoint_write() != Status::success) std::cerr << "could not write checkpoint file" << std::endl;
+  pthread_mutex_unlock(&checkpoint_mutex);
+  checkpoint_options = NULL;
+}
+
+// writes a new checkpoint if it is due. checkpoint_mutex must be locked.
+static void checkpoint_update() {
+  time_t now = time(NULL);
+  if (difftime(now, checkpoint_time) < checkpoint_options->checkpoint_interval) return;
+  if (checkpoint_write() != Status::success) std::cerr << "could not write checkpoint file" << std::endl;
+  checkpoint_time = now;
+}
+
+static void checkpoint_task_done(unsigned int idx) {
+  if (checkpoint_options == NULL) return;
+  pthread_mutex_lock(&checkpoint_mutex);
+  checkpoint_done[idx] = 1;
+  checkpoint_search[idx].valid = false;
+  checkpoint_update();
+  pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+static void checkpoint_set_search(unsigned int idx, double pa, double p_delta, double nr_iterations) {
+  if (checkpoint_options == NULL) return;
+  pthread_mutex_lock(&checkpoint_mutex);
+  AcceptanceSearch& a = checkpoint_search[idx];
+  a.valid = true; a.pa = pa; a.p_delta = p_delta; a.nr_iterations = nr_iterations;
+  checkpoint_update();
+  pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+static bool checkpoint_get_search(unsigned int idx, double& pa, double& p_delta, double& nr_iterations) {
+  if (checkpoint_options == NULL) return false;
+  pthread_mutex_lock(&checkpoint_mutex);
+  const AcceptanceSearch a = checkpoint_search[idx];
+  pthread_mutex_unlock(&checkpoint_mutex);
+  if (not a.valid) return false;
+  pa = a.pa; p_delta = a.p_delta; nr_iterations = a.nr_iterations;
+  return true;
+}
+
+static void copy_midplane_mirrors(const std::vector<unsigned int>& mirrors, std::vector<DynApGridPoint>& grid) {
+  for(unsigned int i=0; i<mirrors.size(); ++i) {
+    if (mirrors[i] == i) continue;
+    const DynApGridPoint& tracked = grid[mirrors[i]];
+    grid[i].lost_turn    = tracked.lost_turn;
+    grid[i].lost_element = tracked.lost_element;
+    grid[i].lost_plane   = tracked.lost_plane;
+    grid[i].nux1 = tracked.nux1; grid[i].nuy1 = tracked.nuy1;
+    grid[i].nux2 = tracked.nux2; grid[i].nuy2 = tracked.nuy2;
+    grid[i].chaos = tracked.chaos;
+  }
+}
+
 // static DynApGridPoint find_momentum_acceptance(
 //   const Accelerator& accelerator,
 //   const std::vector<Pos<double> >& cod,
@@ -1069,101 +1838,92 @@ static Status::type calc_closed_orbit(const Accelerator& accelerator, std::vecto
 //   return point;
 // }
 
-static void thread_dynap_naff(ThreadSharedData* thread_data, int thread_id, long task_id) {
-
-  std::vector<DynApGridPoint>& grid = *thread_grid;
-
-  Pos<double> p = grid[task_id].p + (*thread_cod)[0]; // adds closed-orbit
+// initial position of a grid point of 'dynap_scan', closed-orbit included
+static Pos<double> scan_initial_position(DynApGridPoint& point) {
+  Pos<double> p = point.p + (*thread_cod)[point.start_element]; // adds closed-orbit
   if (fabs(p.ry) < tiny_y_amp) p.ry = sgn(p.ry) * tiny_y_amp;
+  point.lost_element = point.start_element;
+  return p;
+}
 
-  std::vector<Pos<double>> new_pos;
-  Status::type lstatus = Status::success;
-  lstatus = track_ringpass (*thread_accelerator,
-                            p,
-                            new_pos,
-                            thread_nr_turns/2,
-                            grid[task_id].lost_turn,
-                            grid[task_id].lost_element,
-                            grid[task_id].lost_plane,
-                            true);
-  //pthread_mutex_lock(thread_data->mutex);
-  if (lstatus == Status::success) naff_run(new_pos, grid[task_id].nux1, grid[task_id].nuy1);
-  //pthread_mutex_unlock(thread_data->mutex);
-  if (lstatus == Status::success) {
-    p = new_pos.back();
-
-    //pthread_mutex_lock(thread_data->mutex);
-    //printf("nan thread:%02i|task:%06lu/%06lu  rx:%+.4e|ry:%+.4e\n", thread_id, (1+task_id), thread_data->nr_tasks, p.rx, p.ry);
-    //pthread_mutex_unlock(thread_data->mutex);
+// progress, per-task line and checkpoint of grid point 'idx', the 'task'-th of 'nr_tasks' of 'dynap_scan'
+static void scan_point_done(ThreadSharedData* thread_data, int thread_id, long task, long nr_tasks, unsigned int idx, Status::type lstatus) {
 
-    std::vector<Pos<double>> new_pos;
-    lstatus = track_ringpass (*thread_accelerator,
-                              p,
-                              new_pos,
-                              thread_nr_turns/2,
-                              grid[task_id].lost_turn,
-                              grid[task_id].lost_element,
-                              grid[task_id].lost_plane,
-                              true);
-
-    //p = new_pos.back();
-    //pthread_mutex_lock(thread_data->mutex);
-    //printf("nan2 thread:%02i|task:%06lu/%06lu  rx:%+.4e|ry:%+.4e\n", thread_id, (1+task_id), thread_data->nr_tasks, p.rx, p.ry);
-    //pthread_mutex_unlock(thread_data->mutex);
-
-    //pthread_mutex_lock(thread_data->mutex);
-    if (lstatus == Status::success) naff_run(new_pos, grid[task_id].nux2, grid[task_id].nuy2);
-    //pthread_mutex_unlock(thread_data->mutex);
-  }
+  DynApGridPoint& point = (*thread_grid)[idx];
+  add_thread_particle_turns(thread_data, (lstatus == Status::success) ? thread_nr_turns : point.lost_turn);
 
-  if (thread_type.compare("xyfmap") == 0) {
-    pthread_mutex_lock(thread_data->mutex);
-    printf("thread:%02i|task:%06lu/%06lu  rx:%+.4e|ry:%+.4e  nu1:%.4e|%.4e  nu2:%.4e|%.4e  dnu:%.4e|%.4e\n", thread_id, (1+task_id), thread_data->nr_tasks, grid[task_id].p.rx, grid[task_id].p.ry, grid[task_id].nux1, grid[task_id].nuy1, grid[task_id].nux2, grid[task_id].nuy2, fabs(grid[task_id].nux2-grid[task_id].nux1), fabs(grid[task_id].nuy2-grid[task_id].nuy1));
-    pthread_mutex_unlock(thread_data->mutex);
-  } else if (thread_type.compare("exfmap") == 0) {
-    pthread_mutex_lock(thread_data->mutex);
-    printf("thread:%02i|task:%06lu/%06lu  de:%+.4e|rx:%+.4e  nu1:%.4e|%.4e  nu2:%.4e|%.4e  dnu:%.4e|%.4e\n", thread_id, (1+task_id), thread_data->nr_tasks, grid[task_id].p.de, grid[task_id].p.rx, grid[task_id].nux1, grid[task_id].nuy1, grid[task_id].nux2, grid[task_id].nuy2, fabs(grid[task_id].nux2-grid[task_id].nux1), fabs(grid[task_id].nuy2-grid[task_id].nuy1));
-    pthread_mutex_unlock(thread_data->mutex);
-  } else {
+  if (verbose_tasks_on) {
+    const char* names[] = {"rx", "px", "ry", "py", "de", "dl"};
+    std::string coords;
+    for(unsigned int a=0; a<thread_scan->axes.size(); ++a) {
+      char buffer[40];
+      DynApScanAxis::coordinate coord = thread_scan->axes[a].coord;
+      sprintf(buffer, "%s%s:%+.4e", (a > 0) ? "|" : "", names[coord], scan_coordinate(point.p, coord));
+      coords += buffer;
+    }
     pthread_mutex_lock(thread_data->mutex);
-    std::cerr << "undefined multithread dynap calculation type" << std::endl;
+    if ((point.nux1 != 0) or (point.nuy1 != 0)) {
+      printf("thread:%02i|task:%06lu/%06lu  %s  nu1:%.4e|%.4e  nu2:%.4e|%.4e  dnu:%.4e|%.4e\n", thread_id, (1+task), nr_tasks, coords.c_str(), point.nux1, point.nuy1, point.nux2, point.nuy2, fabs(point.nux2-point.nux1), fabs(point.nuy2-point.nuy1));
+    } else {
+      printf("thread:%02i|task:%06lu/%06lu  %s  turn:%05i|element:%05i  status:%s\n", thread_id, (1+task), nr_tasks, coords.c_str(), point.lost_turn, point.lost_element, string_error_messages[lstatus].c_str());
+    }
     pthread_mutex_unlock(thread_data->mutex);
   }
 
+  checkpoint_task_done(idx);
+
 }
 
-static void thread_dynap(ThreadSharedData* thread_data, int thread_id, long task_id) {
+static void thread_dynap_scan(ThreadSharedData* thread_data, int thread_id, long task_id) {
 
-  std::vector<DynApGridPoint>& grid = *thread_grid;
+  unsigned int idx = (thread_tasks == NULL) ? task_id : (*thread_tasks)[task_id];
+  DynApGridPoint& point = (*thread_grid)[idx];
+  Pos<double> p = scan_initial_position(point);
+  Status::type lstatus = thread_scan->analysis(*thread_accelerator, thread_nr_turns, p, point);
+  scan_point_done(thread_data, thread_id, task_id, thread_data->nr_tasks, idx, lstatus);
 
-  // pthread_mutex_lock(thread_data->mutex);
-  // printf("thread:%02i|task:%06lu/%06lu -> rx:%+.4e|ry:%+.4e\n", thread_id, (1+task_id), thread_data->nr_tasks, grid[task_id].p.rx, grid[task_id].p.ry);
-  // pthread_mutex_unlock(thread_data->mutex);
+}
 
-  Pos<double> p = grid[task_id].p + (*thread_cod)[0]; // adds closed-orbit
-  if (fabs(p.ry) < tiny_y_amp) p.ry = sgn(p.ry) * tiny_y_amp;
+// task 'task_id' of a batched 'dynap_scan' analyses the grid points of block 'task_id'
+static void thread_dynap_scan_batch(ThreadSharedData* thread_data, int thread_id, long task_id) {
+
+  const long nr_points = (thread_tasks == NULL) ? thread_grid->size() : thread_tasks->size();
+  const long first = task_id * thread_scan->batch_size;
+  const long last = std::min(nr_points, first + (long) thread_scan->batch_size);
+  std::vector<unsigned int> idx;
+  std::vector<Pos<double>> p;
+  std::vector<DynApGridPoint*> points;
+  std::vector<Status::type> lstatus;
+  for(long k=first; k<last; ++k) {
+    idx.push_back((thread_tasks == NULL) ? k : (*thread_tasks)[k]);
+    points.push_back(&(*thread_grid)[idx.back()]);
+    p.push_back(scan_initial_position(*points.back()));
+  }
+  thread_scan->batch_analysis(*thread_accelerator, thread_nr_turns, p, points, lstatus);
+  for(long k=first; k<last; ++k) scan_point_done(thread_data, thread_id, k, nr_points, idx[k-first], lstatus[k-first]);
 
+}
+
+static void thread_dynap_stage(ThreadSharedData* thread_data, int thread_id, long task_id) {
+
+  DynApGridPoint& point = (*thread_grid)[(*thread_stage_idx)[task_id]];
+  Pos<double>& p = (*thread_stage_pos)[task_id];
+
+  // survivors of previous stages are always at the start of the lattice
   std::vector<Pos<double>> new_pos;
-  Status::type lstatus = Status::success;
-  lstatus = track_ringpass (*thread_accelerator,
-                            p,
-                            new_pos,
-                            thread_nr_turns,
-                            grid[task_id].lost_turn,
-                            grid[task_id].lost_element,
-                            grid[task_id].lost_plane,
-                            true);
-  if (thread_type.compare("xy") == 0) {
-    pthread_mutex_lock(thread_data->mutex);
-    printf("thread:%02i|task:%06lu/%06lu  rx:%+.4e|ry:%+.4e  turn:%05i|element:%05i  status:%s\n", thread_id, (1+task_id), thread_data->nr_tasks, grid[task_id].p.rx, grid[task_id].p.ry, grid[task_id].lost_turn, grid[task_id].lost_element, string_error_messages[lstatus].c_str());
-    pthread_mutex_unlock(thread_data->mutex);
-  } else if (thread_type.compare("ex") == 0) {
-    pthread_mutex_lock(thread_data->mutex);
-    printf("thread:%02i|task:%06lu/%06lu  de:%+.4e|dx:%+.4e  turn:%05i|element:%05i  status:%s\n", thread_id, (1+task_id), thread_data->nr_tasks, grid[task_id].p.de, grid[task_id].p.rx, grid[task_id].lost_turn, grid[task_id].lost_element, string_error_messages[lstatus].c_str());
-    pthread_mutex_unlock(thread_data->mutex);
-  } else {
-    std::cerr << "undefined multithread dynap calculation type" << std::endl;
-  }
+  unsigned int lost_turn = 0;
+  point.lost_element = 0;
+  Status::type lstatus = track_ringpass (*thread_accelerator,
+                                         p,
+                                         new_pos,
+                                         thread_nr_turns,
+                                         lost_turn,
+                                         point.lost_element,
+                                         point.lost_plane,
+                                         false);
+  point.lost_turn = thread_stage_turn + lost_turn;
+  (*thread_stage_status)[task_id] = lstatus;
+  add_thread_particle_turns(thread_data, lost_turn);
 
 }
 
@@ -1248,8 +2008,9 @@ static void thread_dynap_acceptance(ThreadSharedData* thread_data, int thread_id
 
   std::vector<DynApGridPoint>& grid = *thread_grid;
   const std::vector<unsigned int>& elements = *thread_elements;
+  unsigned int idx = (thread_tasks == NULL) ? task_id : (*thread_tasks)[task_id];
 
-  DynApGridPoint p = (*thread_grid)[task_id];
+  DynApGridPoint p = (*thread_grid)[idx];
   DynApGridPoint point;
   unsigned int element_nr;
   double p_init, p_delta;
@@ -1259,20 +2020,22 @@ static void thread_dynap_acceptance(ThreadSharedData* thread_data, int thread_id
   const int ma = 0; const int pxa = 1; const int pya = 2;
   int calc_type;
   if (thread_type == "dynap_ma") {
-    element_nr = task_id / 2;
+    element_nr = idx / 2;
     calc_type = ma;
-    p_init = (*thread_ma_e_init) * ((task_id % 2) ? 1.0 : -1.0);
-    p_delta = (*thread_ma_e_delta) * ((task_id % 2) ? 1.0 : -1.0);
+    p_init = (*thread_ma_e_init) * ((idx % 2) ? 1.0 : -1.0);
+    p_delta = (*thread_ma_e_delta) * ((idx % 2) ? 1.0 : -1.0);
   } else if (thread_type == "dynap_pxa") {
-    element_nr = task_id;
+    element_nr = idx;
     calc_type = pxa;
     p_init = (*thread_ma_e_init);
     p_delta = (*thread_ma_e_delta);
   } else if (thread_type == "dynap_pya") {
-    element_nr = task_id;
+    element_nr = idx;
     calc_type = pya;
     p_init = (*thread_ma_e_init);
     p_delta = (*thread_ma_e_delta);
+  } else {
+    return;    // not an acceptance calculation
   }
 
   unsigned int start_element = elements[element_nr];
@@ -1280,9 +2043,12 @@ static void thread_dynap_acceptance(ThreadSharedData* thread_data, int thread_id
   double nr_steps_back = (*thread_ma_nr_steps_back);
   double rescale = (*thread_ma_rescale);
 
+  unsigned long long nr_particle_turns = 0;
   double pa = p_init;
+  checkpoint_get_search(idx, pa, p_delta, nr_iterations);  // resumes an interrupted search
   while (true) {
     while (true) {
+      checkpoint_set_search(idx, pa, p_delta, nr_iterations);
       //std::cout << pa << std::endl;
       point.p = *thread_ma_p0;     // offset
       switch (calc_type) {     // sets trial parameter
@@ -1295,6 +2061,7 @@ static void thread_dynap_acceptance(ThreadSharedData* thread_data, int thread_id
       Pos<double> p = point.p + (*thread_cod)[start_element];  // p initial condition for tracking
       if (fabs(p.ry) < tiny_y_amp) p.ry = sgn(p.ry) * tiny_y_amp;
       Status::type status = track_ringpass (*thread_accelerator, p, new_pos, thread_nr_turns, point.lost_turn, point.lost_element, point.lost_plane, false);
+      nr_particle_turns += point.lost_turn;
       if (status != Status::success) {
         pa -= p_delta;
         if (calc_type == ma)  { point.p.de = pa; break; };
@@ -1310,20 +2077,25 @@ static void thread_dynap_acceptance(ThreadSharedData* thread_data, int thread_id
   }
 
 
-  grid[task_id] = point;
-
-  if (calc_type == ma) {
-    pthread_mutex_lock(thread_data->mutex);
-    printf("thread:%02i|task:%06lu/%06lu  element:%04i|de:%+.4e  %s\n", thread_id, (1+task_id), thread_data->nr_tasks, element_nr, grid[task_id].p.de, thread_accelerator->lattice[(*thread_elements)[element_nr]].fam_name.c_str());
-    pthread_mutex_unlock(thread_data->mutex);
-  } else if (calc_type == pxa) {
-    pthread_mutex_lock(thread_data->mutex);
-    printf("thread:%02i|task:%06lu/%06lu  element:%04i|px:%+.4e  %s\n", thread_id, (1+task_id), thread_data->nr_tasks, element_nr, grid[task_id].p.px, thread_accelerator->lattice[(*thread_elements)[element_nr]].fam_name.c_str());
-    pthread_mutex_unlock(thread_data->mutex);
-  } else if (calc_type == pya) {
-    pthread_mutex_lock(thread_data->mutex);
-    printf("thread:%02i|task:%06lu/%06lu  element:%04i|de:%+.4e  %s\n", thread_id, (1+task_id), thread_data->nr_tasks, element_nr, grid[task_id].p.py, thread_accelerator->lattice[(*thread_elements)[element_nr]].fam_name.c_str());
-    pthread_mutex_unlock(thread_data->mutex);
+  grid[idx] = point;
+  checkpoint_task_done(idx);
+
+  add_thread_particle_turns(thread_data, nr_particle_turns);
+
+  if (verbose_tasks_on) {
+    if (calc_type == ma) {
+      pthread_mutex_lock(thread_data->mutex);
+      printf("thread:%02i|task:%06lu/%06lu  element:%04i|de:%+.4e  %s\n", thread_id, (1+task_id), thread_data->nr_tasks, element_nr, grid[idx].p.de, thread_accelerator->lattice[(*thread_elements)[element_nr]].fam_name.c_str());
+      pthread_mutex_unlock(thread_data->mutex);
+    } else if (calc_type == pxa) {
+      pthread_mutex_lock(thread_data->mutex);
+      printf("thread:%02i|task:%06lu/%06lu  element:%04i|px:%+.4e  %s\n", thread_id, (1+task_id), thread_data->nr_tasks, element_nr, grid[idx].p.px, thread_accelerator->lattice[(*thread_elements)[element_nr]].fam_name.c_str());
+      pthread_mutex_unlock(thread_data->mutex);
+    } else if (calc_type == pya) {
+      pthread_mutex_lock(thread_data->mutex);
+      printf("thread:%02i|task:%06lu/%06lu  element:%04i|de:%+.4e  %s\n", thread_id, (1+task_id), thread_data->nr_tasks, element_nr, grid[idx].p.py, thread_accelerator->lattice[(*thread_elements)[element_nr]].fam_name.c_str());
+      pthread_mutex_unlock(thread_data->mutex);
+    }
   }
 
 
@@ -39,6 +39,7 @@ int main(int argc, char *argv[]) {
     if (cmd == "dynap_pya") return cmd_dynap_acceptance(args);
     if (cmd == "dynap_xyfmap") return cmd_dynap_xyfmap(args);
     if (cmd == "dynap_exfmap") return cmd_dynap_exfmap(args);
+    if (cmd == "dynap_merge") return cmd_dynap_merge(args);
     if (cmd == "track_linepass") return cmd_track_linepass(args);
     std::cerr << "trackcpp: invalid command!" << std::endl;
     return EXIT_FAILURE;
@@ -16,52 +16,152 @@
 
 #include <trackcpp/trackcpp.h>
 
-static int current_thread_id = 0;
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <exception>
+#include <thread>
+#include <vector>
+
+static std::atomic<int> current_thread_id(0);
+static std::atomic<unsigned int> nr_running_threads(0);
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static double                 progress_interval = 0;  // [s]
+static bool                   progress_print = true;
+static ThreadProgressCallback progress_callback = nullptr;
+
 void* start_thread(void* args) {
 
   // gets thread_id from global variable
-  pthread_mutex_lock(&mutex);
   int this_thread_id = current_thread_id++;
-  pthread_mutex_unlock(&mutex);
 
   // gets pointer to shared input data
   ThreadSharedData* data = (ThreadSharedData*) args;
 
   while (true) {
 
-    pthread_mutex_lock(&mutex);
     long this_task_id = data->task_id++;
-    pthread_mutex_unlock(&mutex);
 
     // breaks if there is no more task to be done.
     if (this_task_id >= data->nr_tasks) break;
 
     // run main function
     data->func(data, this_thread_id, this_task_id);
+    data->nr_tasks_done++;
 
   }
 
+  nr_running_threads--;
   return NULL;
 }
 
+void set_thread_progress_report(double interval, bool print, ThreadProgressCallback callback) {
+  progress_interval = interval;
+  progress_print = print;
+  progress_callback = callback;
+}
+
+void add_thread_particle_turns(ThreadSharedData* thread_data, unsigned long long nr_particle_turns) {
+  thread_data->nr_particle_turns += nr_particle_turns;
+}
+
+static double elapsed_since(const timespec& t0) {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec - t0.tv_sec) + 1e-9 * (t.tv_nsec - t0.tv_nsec);
+}
+
+static void report_progress(const ThreadSharedData& thread_data, double elapsed_time) {
+
+  ThreadProgress progress;
+  progress.nr_tasks_done = thread_data.nr_tasks_done;
+  progress.nr_tasks = thread_data.nr_tasks;
+  progress.nr_particle_turns = thread_data.nr_particle_turns;
+  progress.elapsed_time = elapsed_time;
+  progress.tasks_rate = (elapsed_time > 0) ? progress.nr_tasks_done / elapsed_time : 0;
+  progress.particle_turns_rate = (elapsed_time > 0) ? progress.nr_particle_turns / elapsed_time : 0;
+  progress.eta = (progress.tasks_rate > 0) ? (progress.nr_tasks - progress.nr_tasks_done) / progress.tasks_rate : nan("");
+
+  if (progress_print) {
+    char eta[30] = "--:--:--";
+    if (std::isfinite(progress.eta)) {
+      long s = lround(progress.eta);
+      sprintf(eta, "%02li:%02li:%02li", s / 3600, (s / 60) % 60, s % 60);
+    }
+    printf("%s progress: %li/%li tasks (%5.1f%%) | %.3g tasks/s | %.3g particle-turns/s | ETA %s\n", get_timestamp().c_str(), progress.nr_tasks_done, progress.nr_tasks, (progress.nr_tasks > 0) ? 100.0 * progress.nr_tasks_done / progress.nr_tasks : 100.0, progress.tasks_rate, progress.particle_turns_rate, eta);
+    fflush(stdout);
+  }
+  if (progress_callback) progress_callback(progress);
+
+}
+
 void start_all_threads(ThreadSharedData& thread_data, unsigned int nr_threads) {
 
+  // at least one thread runs the tasks, whether or not the calling thread reports
+  if (nr_threads == 0) nr_threads = 1;
+
   thread_data.task_id = 0;
   thread_data.mutex = &mutex;
+  thread_data.nr_tasks_done = 0;
+  thread_data.nr_particle_turns = 0;
+  current_thread_id = 0;
+  nr_running_threads = nr_threads;
+
+  // with progress reports all tasks run in worker threads and the calling
+  // thread only reports, so that callbacks are invoked where they were set.
+  const bool report = (progress_interval > 0);
+  const unsigned int nr_workers = report ? nr_threads : nr_threads - 1;
+  if (report) nr_running_threads = nr_workers;
+
+  timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
 
   pthread_t threads[nr_threads];
-  int thread_id[nr_threads];
+  for(unsigned int i=0; i<nr_workers; i++) {
+  	pthread_create(&(threads[i]), NULL, start_thread, (void*) &thread_data);
+  }
 
-  for(int i=0; i<nr_threads-1; i++) {
-  	thread_id[i] = i;
-  	int iret = pthread_create(&(threads[i]), NULL, start_thread, (void*) &thread_data);
+  // an exception thrown by the progress callback (a failing python callback, for instance)
+  // stops the remaining tasks and is rethrown only after the workers have been joined.
+  std::exception_ptr callback_error;
+  if (report) {
+    double last_report = 0;
+    const timespec nap = {0, 50000000};  // 50 ms
+    while (nr_running_threads > 0) {
+      nanosleep(&nap, NULL);
+      double elapsed_time = elapsed_since(t0);
+      if ((not callback_error) and (elapsed_time - last_report >= progress_interval)) {
+        try {
+          report_progress(thread_data, elapsed_time);
+        } catch (...) {
+          callback_error = std::current_exception();
+          thread_data.task_id = thread_data.nr_tasks;
+        }
+        last_report = elapsed_time;
+      }
+    }
+  } else {
+    start_thread((void*) &thread_data);
   }
 
-  thread_id[nr_threads-1] = current_thread_id;
-  start_thread((void*) &thread_data);
+  for(unsigned int i=0; i<nr_workers; ++i) pthread_join(threads[i], NULL);
+
+  if (callback_error) std::rethrow_exception(callback_error);
+  if (report) report_progress(thread_data, elapsed_since(t0));
+
+}
+
+void run_parallel_tasks(long nr_tasks, unsigned int nr_threads, const std::function<void(long)>& task) {
+
+  std::atomic<long> task_id(0);
+  auto run = [&]() {
+    for(long id = task_id++; id < nr_tasks; id = task_id++) task(id);
+  };
 
-  for(int i=0; i<nr_threads-1; ++i) pthread_join(threads[i], NULL);
+  std::vector<std::thread> threads;
+  for(unsigned int i=1; i<nr_threads; ++i) threads.push_back(std::thread(run));
+  run();
+  for(unsigned int i=0; i<threads.size(); ++i) threads[i].join();
 
 }
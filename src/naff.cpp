@@ -17,24 +17,249 @@
 #include <trackcpp/trackcpp.h>
 #include <trackcpp/naff.h>
 #include "naff_utils.h"
+#include <algorithm>
+#ifdef NAF_USE_FFTW
+#include <fftw3.h>
+#include <mutex>
+#endif
+
+static void Get_NAFF(int nterm, long ndata, const double* zx, const double* zy, long stride, double *fx, double *fz, int nb_freq[2]);
+
+// NAFF variables, buffers and window for a given number of terms and data. each thread
+// keeps one between calls, so that 'Get_NAFF' neither allocates nor recomputes the window.
+class NaffWorkspace {
+public:
+  ~NaffWorkspace() { if (initialized) naf_cleannaf(naf); }
+  t_naf& get(int nterm, long ndata);
+private:
+  t_naf naf;
+  bool  initialized = false;
+};
+static thread_local NaffWorkspace naff_workspace;
+
+static void naff_tunes(long ndata, const double* zx, const double* zy, long stride, double& tunex, double& tuney);
+static void fft_tunes(long ndata, const double* zx, const double* zy, long stride, NaffMethod::type method, double& tunex, double& tuney);
+static void naf_fft(t_naf& g_NAFVariable, int KTABS2);
+static void naf_puiss2(int NT, int *N2);
+static double naff_main_tune(const double* nu) { return (fabs(nu[0])<1e-4) ? fabs(nu[1]) : fabs(nu[0]); }
+static int  naff_plane(t_naf& g_NAFVariable, int nterm, double* f);
+#if NAF_USE_OPTIMIZE>0 && !defined(NAF_USE_FFTW)
+static void naf_fftpeak_batch(t_naf& g_NAFVariable, int nb, const double* zr, const double* zi, std::vector<double>& tr, std::vector<double>& ti, int* ifr);
+#endif
 
-static void Get_NAFF(int nterm, long ndata, const std::vector<Pos<double>>& Tab, double *fx, double *fz, int nb_freq[2]);
+static long naff_ndata(long ndata) {
+  /* Test whether ndata is divisible by 6 -- for NAFF -- */
+  /* Otherwise truncate ndata to lower value */
+  long r = 0; /* remainder of the euclidian division of ndata by 6 */
+  if ((r = ndata % 6) != 0) {
+    printf("Get_NAFF: Warning ndata = %ld, \n", ndata);
+    ndata -= r;
+    printf("New value for NAFF ndata = %ld \n", ndata);
+  }
+  return ndata;
+}
+
+void naff_run(const std::vector<Pos<double>>& data, double& tunex, double& tuney, NaffMethod::type method) {
+
+  // (rx,px) and (ry,py) are read in place, 'stride' doubles apart
+  const double* z = reinterpret_cast<const double*>(data.data());
+  const long stride = sizeof(Pos<double>) / sizeof(double);
+  if (method == NaffMethod::naff) naff_tunes(data.size(), z, z+2, stride, tunex, tuney);
+  else fft_tunes(data.size(), z, z+2, stride, method, tunex, tuney);
+
+}
+
+void NaffBuffer::clear(unsigned int nr_turns) {
+  zx.clear(); zx.reserve(2*nr_turns);
+  zy.clear(); zy.reserve(2*nr_turns);
+}
+
+Status::type NaffBuffer::run(unsigned int first, unsigned int nr_turns, double& tunex, double& tuney, NaffMethod::type method) const {
+  if ((unsigned long) first + nr_turns > size()) {
+    tunex = tuney = nan("");
+    return Status::inconsistent_dimensions;
+  }
+  if (method == NaffMethod::naff) naff_tunes(nr_turns, zx.data() + 2*first, zy.data() + 2*first, 2, tunex, tuney);
+  else fft_tunes(nr_turns, zx.data() + 2*first, zy.data() + 2*first, 2, method, tunex, tuney);
+  return Status::success;
+}
 
-void naff_run(const std::vector<Pos<double>>& data, double& tunex, double& tuney) {
+static void naff_tunes(long ndata, const double* zx, const double* zy, long stride, double& tunex, double& tuney) {
 
   //int nterm = 4;
   int nterm = 2;
   int nb_freq[2] = {0,0};
   double nux[4], nuy[4];
-  Get_NAFF(nterm, data.size(), data, nux, nuy, nb_freq);
+  Get_NAFF(nterm, ndata, zx, zy, stride, nux, nuy, nb_freq);
   // tunex = fabs(nux[0]);
   // tuney = fabs(nuy[0]);
-  if (fabs(nux[0])<1e-4) tunex = fabs(nux[1]); else tunex = fabs(nux[0]);
-  if (fabs(nuy[0])<1e-4) tuney = fabs(nuy[1]); else tuney = fabs(nuy[0]);
+  tunex = naff_main_tune(nux);
+  tuney = naff_main_tune(nuy);
+
+}
+
+// fast tune estimators: the FFT uses the buffers and backend of NAFF, in a workspace of
+// its own sized to a power of 2 (KTABS = 2^k, so that KTABS2 = KTABS)
+static thread_local NaffWorkspace fft_workspace;
+
+// modulus of the Hann-windowed Fourier transform of z (mean removed) at 'nu' [1/turn]
+static double fft_amplitude(long ndata, const double* z, long stride, double zr0, double zi0, double nu) {
+  const double c = cos(2*M_PI*nu), s = -sin(2*M_PI*nu);
+  const double cw = cos(2*M_PI/ndata), sw = sin(2*M_PI/ndata);
+  double er = 1, ei = 0, wr = 1, wi = 0, ar = 0, ai = 0;
+  for(long n=0; n<ndata; ++n, z+=stride) {
+    const double w = 1 - wr;
+    const double zr = w*(z[0]-zr0), zi = w*(z[1]-zi0);
+    ar += zr*er - zi*ei;
+    ai += zr*ei + zi*er;
+    double t = er*c - ei*s; ei = er*s + ei*c; er = t;
+    t = wr*cw - wi*sw; wi = wr*sw + wi*cw; wr = t;
+  }
+  return sqrt(ar*ar + ai*ai);
+}
+
+// frequency [1/turn] of the largest line of the complex signal z, as selected by 'method'
+static double fft_tune(long ndata, const double* z, long stride, NaffMethod::type method) {
+
+  // mean of all turns and Hann-windowed FFT of the first KTABS2 = 2^k of them
+  int KTABS2;
+  naf_puiss2(ndata, &KTABS2);
+  t_naf& g_NAFVariable = fft_workspace.get(1, KTABS2);
+  double zr0 = 0, zi0 = 0;
+  for(long n=0; n<ndata; ++n) { zr0 += z[n*stride]; zi0 += z[n*stride+1]; }
+  zr0 /= ndata; zi0 /= ndata;
+  double* tab = g_NAFVariable.FFTTAB;
+  double* rtab = g_NAFVariable.RTAB;
+  for(int n=0; n<KTABS2; ++n) {
+    const double w = 1 - cos(2*M_PI*n/KTABS2);
+    tab[2*n]   = w * (z[n*stride]   - zr0);
+    tab[2*n+1] = w * (z[n*stride+1] - zi0);
+  }
+  naf_fft(g_NAFVariable, KTABS2);
+  for(int k=0; k<KTABS2; ++k) rtab[k] = sqrt(tab[2*k]*tab[2*k] + tab[2*k+1]*tab[2*k+1]);
+
+  // largest line, the constant term excluded
+  int k = 1;
+  for(int i=2; i<KTABS2; ++i) if (rtab[i] > rtab[k]) k = i;
+  const double a = rtab[(k+KTABS2-1)%KTABS2], b = rtab[k], c = rtab[(k+1)%KTABS2];
+  double delta = 0;
+  if (method == NaffMethod::fft_parabolic) {
+    const double la = log(std::max(a, DBL_MIN)), lb = log(b), lc = log(std::max(c, DBL_MIN));
+    delta = 0.5 * (la - lc) / (la - 2*lb + lc);
+  } else {
+    // Hann window: a line 'delta' bins from 'k' has neighbour/peak ratio (1+delta)/(2-delta)
+    const double r = std::max(a, c) / b;
+    delta = ((c >= a) ? 1 : -1) * (2*r - 1) / (r + 1);
+  }
+  double nu = (((k <= KTABS2/2) ? k : k - KTABS2) + delta) / KTABS2;
+  if (method != NaffMethod::fft_refined) return nu;
+
+  // parabolic steps on the amplitude over all turns, with steps shrinking with the error
+  double h = 0.5 / ndata;
+  for(int i=0; i<3; ++i, h *= 0.1) {
+    const double fa = fft_amplitude(ndata, z, stride, zr0, zi0, nu - h);
+    const double fb = fft_amplitude(ndata, z, stride, zr0, zi0, nu);
+    const double fc = fft_amplitude(ndata, z, stride, zr0, zi0, nu + h);
+    const double d = fa - 2*fb + fc;
+    if (d >= 0) break;   // not near a maximum: keeps the interpolated frequency
+    nu += std::max(-2.0, std::min(2.0, 0.5 * (fa - fc) / d)) * h;
+  }
+  return nu;
+
+}
+
+static void fft_tunes(long ndata, const double* zx, const double* zy, long stride, NaffMethod::type method, double& tunex, double& tuney) {
+  if (ndata < 4) { tunex = tuney = nan(""); return; }
+  tunex = fabs(fft_tune(ndata, zx, stride, method));
+  tuney = fabs(fft_tune(ndata, zy, stride, method));
+}
+
+const unsigned int NaffBatch::block_size;
+
+void NaffBatch::resize(unsigned int nr_particles, unsigned int nr_turns) {
+  np = nr_particles; nt = nr_turns;
+  rx.assign(np*nt, 0); px.assign(np*nt, 0);
+  ry.assign(np*nt, 0); py.assign(np*nt, 0);
+}
+
+void NaffBatch::set(unsigned int particle, unsigned int turn, const Pos<double>& p) {
+  const unsigned int i = turn*np + particle;
+  rx[i] = p.rx; px[i] = p.px; ry[i] = p.ry; py[i] = p.py;
+}
+
+Status::type NaffBatch::run(unsigned int first, unsigned int nr_turns, std::vector<double>& tunex, std::vector<double>& tuney) const {
 
+  tunex.assign(np, nan(""));
+  tuney.assign(np, nan(""));
+  if ((unsigned long) first + nr_turns > nt) return Status::inconsistent_dimensions;
+  for(unsigned int particle=0; particle<np; particle+=block_size) {
+    run_block(first, nr_turns, particle, &tunex[particle], &tuney[particle]);
+  }
+  return Status::success;
 
 }
 
+void NaffBatch::run_block(unsigned int first, unsigned int nr_turns, unsigned int particle, double* tunex, double* tuney) const {
+
+  const int  nterm = 2;
+  const long ndata = naff_ndata(nr_turns);
+  const unsigned int nb = std::min(block_size, np - particle);
+  t_naf& g_NAFVariable = naff_workspace.get(nterm, ndata);
+  const int KTABS = g_NAFVariable.KTABS;
+
+  // signals of the block, by sample and particle; row KTABS is the extra point of ZTABS(0:KTABS)
+  static thread_local std::vector<double> xr, xi, yr, yi, tr, ti;
+  for(auto v : {&xr, &xi, &yr, &yi}) v->assign((KTABS+1)*block_size, 0);
+  for(long n=0; n<ndata; ++n) {
+    const unsigned int i = (first+n)*np + particle;
+    for(unsigned int k=0; k<nb; ++k) {
+      xr[n*block_size+k] = rx[i+k]; xi[n*block_size+k] = px[i+k];
+      yr[n*block_size+k] = ry[i+k]; yi[n*block_size+k] = py[i+k];
+    }
+  }
+
+  // 'Get_NAFF' calls 'naf_smoy' with ZTABS(0) as its accumulator, which zeroes the first
+  // horizontal sample and leaves the others as they are. done here too, so that tunes match.
+  for(unsigned int k=0; k<nb; ++k) xr[k] = xi[k] = 0;
+
+  // FFT bins of the first frequency of each particle, found in lockstep
+  int ifrx[block_size] = {0}, ifry[block_size] = {0};
+  bool peaks = false;
+#if NAF_USE_OPTIMIZE>0 && !defined(NAF_USE_FFTW)
+  naf_fftpeak_batch(g_NAFVariable, nb, xr.data(), xi.data(), tr, ti, ifrx);
+  naf_fftpeak_batch(g_NAFVariable, nb, yr.data(), yi.data(), tr, ti, ifry);
+  peaks = true;
+#endif
+
+  // refinement of the frequencies of each particle, in the order of 'Get_NAFF'
+  double nux[4], nuy[4];
+  for(unsigned int k=0; k<nb; ++k) {
+    for(int n=0; n<=KTABS; ++n) {
+      g_NAFVariable.ZTABS[n].reel = xr[n*block_size+k];
+      g_NAFVariable.ZTABS[n].imag = xi[n*block_size+k];
+    }
+    g_NAFVariable.IFR0 = ifrx[k]; g_NAFVariable.IFR0SET = peaks;
+    naff_plane(g_NAFVariable, nterm, nux);
+    for(int n=0; n<KTABS; ++n) {
+      g_NAFVariable.ZTABS[n].reel = yr[n*block_size+k];
+      g_NAFVariable.ZTABS[n].imag = yi[n*block_size+k];
+    }
+    g_NAFVariable.IFR0 = ifry[k]; g_NAFVariable.IFR0SET = peaks;
+    naff_plane(g_NAFVariable, nterm, nuy);
+    tunex[k] = naff_main_tune(nux);
+    tuney[k] = naff_main_tune(nuy);
+  }
+
+}
+
+// frequencies of the signal in ZTABS: NAFF terms stored in 'f', returns their number
+static int naff_plane(t_naf& g_NAFVariable, int nterm, double* f) {
+  naf_mftnaf(g_NAFVariable, nterm, fabs(g_NAFVariable.FREFON)/g_NAFVariable.m_dneps);
+  for (int i = 1; i <= g_NAFVariable.NFS; i++) f[i-1] = g_NAFVariable.TFS[i];
+  for (int i = g_NAFVariable.NFS; i < nterm; i++) f[i] = nan("");   // terms not found
+  return g_NAFVariable.NFS;
+}
+
 
 // ******************************************************************************
 // * -- Functions below this line have been created by Laskar/L.Nadolski/etc -- *
@@ -67,7 +292,8 @@ void naff_run(const std::vector<Pos<double>>& data, double& tunex, double& tuney
        nterm number of frequencies to look for
              if not multiple of 6, truncated to lower value
        ndata size of the data to analyse
-       T     6D vector to analyse
+       zx    (x,x') data to analyse, pairs 'stride' doubles apart
+       zy    (z,z') data to analyse, pairs 'stride' doubles apart
 
    Output:
        fx frequencies found in the H-plane
@@ -94,83 +320,11 @@ void naff_run(const std::vector<Pos<double>>& data, double& tunex, double& tuney
 /* Analyse en Frequence */
 //void Get_NAFF(int nterm, long ndata, double Tab[DIM][NTURN],
 //              double *fx, double *fz, int nb_freq[2])
-void Get_NAFF(int nterm, long ndata, const std::vector<Pos<double>>& Tab, double *fx, double *fz, int nb_freq[2]) {
-  /* Test whether ndata is divisible by 6 -- for NAFF -- */
-  /* Otherwise truncate ndata to lower value */
-  long r = 0; /* remainder of the euclidian division of ndata by 6 */
+void Get_NAFF(int nterm, long ndata, const double* zx, const double* zy, long stride, double *fx, double *fz, int nb_freq[2]) {
   int i;
 
-  if ((r = ndata % 6) != 0) {
-    printf("Get_NAFF: Warning ndata = %ld, \n", ndata);
-    ndata -= r;
-    printf("New value for NAFF ndata = %ld \n", ndata);
-  }
-
-  t_naf g_NAFVariable;
-
-  // g_NAFVariable.DTOUR      = M_2_PI;    /* size of one "cadran" */
-  // g_NAFVariable.XH         = M_2_PI;    /* step */
-  // g_NAFVariable.T0         = 0.0;       /* time t0 */
-  // g_NAFVariable.NTERM      = nterm;     /* max term to find */
-  // g_NAFVariable.KTABS      = ndata;     /* number of data: must be a multiple of 6 */
-  // g_NAFVariable.m_pListFen = NULL;      /* no window */
-  // g_NAFVariable.TFS        = NULL;      /* will contain frequency */
-  // g_NAFVariable.ZAMP       = NULL;      /* will contain amplitude */
-  // g_NAFVariable.ZTABS      = NULL;      /* will contain data to analyze */
-  //
-  // /****************************************************/
-  // /*               internal use in naf                */
-  // g_NAFVariable.NERROR            = 0;
-  // g_NAFVariable.ICPLX             = 1;
-  // g_NAFVariable.IPRT              = 0;     /* 1 for diagnostics */
-  // g_NAFVariable.NFPRT             = stdout; /* NULL   */
-  // g_NAFVariable.NFS               = 0;
-  // g_NAFVariable.IW                = 1;
-  // g_NAFVariable.ISEC              = 1;
-  // g_NAFVariable.EPSM              = 0;
-  // g_NAFVariable.UNIANG            = 0;
-  // g_NAFVariable.FREFON            = 0;
-  // g_NAFVariable.ZALP              = NULL;
-  // g_NAFVariable.m_iNbLineToIgnore = 1;      /* unused */
-  // g_NAFVariable.m_dneps           = 1.e10;
-  // g_NAFVariable.m_bFSTAB          = FALSE;  /* unused */
-  // /*             end of interl use in naf             */
-  // /****************************************************/
-
-
-  g_NAFVariable.DTOUR      = M_2_PI;    /* size of one "cadran" */
-  g_NAFVariable.XH         = M_2_PI;    /* step */  /* value = 1 */
-  g_NAFVariable.T0         = 0.0;       /* time t0 */
-  g_NAFVariable.NTERM      = nterm;     /* max term to find */
-  g_NAFVariable.KTABS      = ndata;     /* number of data: must be a multiple of 6 */
-  g_NAFVariable.m_pListFen = NULL;      /* no window */
-  g_NAFVariable.TFS        = NULL;      /* will contain frequency */
-  g_NAFVariable.ZAMP       = NULL;      /* will contain amplitude */
-  g_NAFVariable.ZTABS      = NULL;      /* will contain data to analyze */
-
-  /****************************************************/
-  /*               internal use in naf                */
-  g_NAFVariable.NERROR            = 0;
-  g_NAFVariable.ICPLX             = 1;
-  g_NAFVariable.IPRT              = 0;     /* 1 for diagnostics */
-  g_NAFVariable.NFPRT             = stdout; /* NULL   */
-  g_NAFVariable.NFS               = 0;
-  g_NAFVariable.IW                = 1;
-  g_NAFVariable.ISEC              = 1;
-  g_NAFVariable.EPSM              = 2.2204e-16;
-  g_NAFVariable.UNIANG            = 0;
-  g_NAFVariable.FREFON            = 0;
-  g_NAFVariable.ZALP              = NULL;
-  g_NAFVariable.m_iNbLineToIgnore = 1;      /* unused */
-  g_NAFVariable.m_dneps           = 1.E100;
-  g_NAFVariable.m_bFSTAB          = FALSE;  /* unused */
-  /*             end of interl use in naf             */
-  /****************************************************/
-
-  g_NAFVariable.TWIN = NULL; /* XRR */
-
-  /* NAFF initialization */
-  naf_initnaf(g_NAFVariable);
+  ndata = naff_ndata(ndata);
+  t_naf& g_NAFVariable = naff_workspace.get(nterm, ndata);
 
   /**********************/
   /* Analyse in H-plane */
@@ -178,23 +332,18 @@ void Get_NAFF(int nterm, long ndata, const std::vector<Pos<double>>& Tab, double
 
   /* fills up complexe vector for NAFF analysis */
   for(i = 0; i < ndata; i++) {
-    g_NAFVariable.ZTABS[i].reel = Tab[i].rx; /* x  */
-    g_NAFVariable.ZTABS[i].imag = Tab[i].px; /* xp */
+    g_NAFVariable.ZTABS[i].reel = zx[i*stride];   /* x  */
+    g_NAFVariable.ZTABS[i].imag = zx[i*stride+1]; /* xp */
   }
+  g_NAFVariable.ZTABS[ndata].reel = g_NAFVariable.ZTABS[ndata].imag = 0; /* ZTABS(0:KTABS) has one more point than the data */
 
   /* Get out the mean value */
   naf_smoy(g_NAFVariable, g_NAFVariable.ZTABS);
 
   naf_prtabs(g_NAFVariable, g_NAFVariable.KTABS,g_NAFVariable.ZTABS, 20);
 
-  naf_mftnaf(g_NAFVariable, nterm,fabs(g_NAFVariable.FREFON)/g_NAFVariable.m_dneps);
-
   /* fill up H-frequency vector */
-  for (i = 1; i <= g_NAFVariable.NFS; i++)  {
-    fx[i-1] = g_NAFVariable.TFS[i];
-  }
-
-  nb_freq[0] = g_NAFVariable.NFS; /* nb of frequencies found out by NAFF */
+  nb_freq[0] = naff_plane(g_NAFVariable, nterm, fx); /* nb of frequencies found out by NAFF */
 
   // if (trace)   /* print out results */
   // {
@@ -214,18 +363,12 @@ void Get_NAFF(int nterm, long ndata, const std::vector<Pos<double>>& Tab, double
 
   /* fill up complexe vector for NAFF analysis */
   for (i = 0; i < ndata; i++) {
-    g_NAFVariable.ZTABS[i].reel = Tab[i].ry;  /* z */
-    g_NAFVariable.ZTABS[i].imag = Tab[i].py;  /*zp */
+    g_NAFVariable.ZTABS[i].reel = zy[i*stride];   /* z */
+    g_NAFVariable.ZTABS[i].imag = zy[i*stride+1]; /*zp */
   }
 
-  naf_mftnaf(g_NAFVariable, nterm,fabs(g_NAFVariable.FREFON)/g_NAFVariable.m_dneps);
-
   /* fills up V-frequency vector */
-  for (i = 1; i <= g_NAFVariable.NFS; i++) {
-    fz[i-1] =  g_NAFVariable.TFS[i];
-  }
-
-  nb_freq[1] = g_NAFVariable.NFS; /* nb of frequencies found out by NAFF */
+  nb_freq[1] = naff_plane(g_NAFVariable, nterm, fz); /* nb of frequencies found out by NAFF */
 
   // if (trace)    /* print out results */
   // {
@@ -239,8 +382,80 @@ void Get_NAFF(int nterm, long ndata, const std::vector<Pos<double>>& Tab, double
   //   }
   // }
 
-  /* free out memory used by NAFF */
-  naf_cleannaf(g_NAFVariable);
+}
+
+t_naf& NaffWorkspace::get(int nterm, long ndata) {
+
+  if (initialized and (naf.NTERM == nterm) and (naf.KTABS == ndata)) return naf;
+  if (initialized) naf_cleannaf(naf);
+
+  // naf.DTOUR      = M_2_PI;    /* size of one "cadran" */
+  // naf.XH         = M_2_PI;    /* step */
+  // naf.T0         = 0.0;       /* time t0 */
+  // naf.NTERM      = nterm;     /* max term to find */
+  // naf.KTABS      = ndata;     /* number of data: must be a multiple of 6 */
+  // naf.m_pListFen = NULL;      /* no window */
+  // naf.TFS        = NULL;      /* will contain frequency */
+  // naf.ZAMP       = NULL;      /* will contain amplitude */
+  // naf.ZTABS      = NULL;      /* will contain data to analyze */
+  //
+  // /****************************************************/
+  // /*               internal use in naf                */
+  // naf.NERROR            = 0;
+  // naf.ICPLX             = 1;
+  // naf.IPRT              = 0;     /* 1 for diagnostics */
+  // naf.NFPRT             = stdout; /* NULL   */
+  // naf.NFS               = 0;
+  // naf.IW                = 1;
+  // naf.ISEC              = 1;
+  // naf.EPSM              = 0;
+  // naf.UNIANG            = 0;
+  // naf.FREFON            = 0;
+  // naf.ZALP              = NULL;
+  // naf.m_iNbLineToIgnore = 1;      /* unused */
+  // naf.m_dneps           = 1.e10;
+  // naf.m_bFSTAB          = FALSE;  /* unused */
+  // /*             end of interl use in naf             */
+  // /****************************************************/
+
+
+  naf.DTOUR      = M_2_PI;    /* size of one "cadran" */
+  naf.XH         = M_2_PI;    /* step */  /* value = 1 */
+  naf.T0         = 0.0;       /* time t0 */
+  naf.NTERM      = nterm;     /* max term to find */
+  naf.KTABS      = ndata;     /* number of data: must be a multiple of 6 */
+  naf.m_pListFen = NULL;      /* no window */
+  naf.TFS        = NULL;      /* will contain frequency */
+  naf.ZAMP       = NULL;      /* will contain amplitude */
+  naf.ZTABS      = NULL;      /* will contain data to analyze */
+
+  /****************************************************/
+  /*               internal use in naf                */
+  naf.NERROR            = 0;
+  naf.ICPLX             = 1;
+  naf.IPRT              = 0;     /* 1 for diagnostics */
+  naf.NFPRT             = stdout; /* NULL   */
+  naf.NFS               = 0;
+  naf.IW                = 1;
+  naf.ISEC              = 1;
+  naf.EPSM              = 2.2204e-16;
+  naf.UNIANG            = 0;
+  naf.FREFON            = 0;
+  naf.ZALP              = NULL;
+  naf.m_iNbLineToIgnore = 1;      /* unused */
+  naf.m_dneps           = 1.E100;
+  naf.m_bFSTAB          = FALSE;  /* unused */
+  /*             end of interl use in naf             */
+  /****************************************************/
+
+  naf.TWIN = NULL; /* XRR */
+  naf.IFR0SET = FALSE;
+
+  /* NAFF initialization */
+  naf_initnaf(naf);
+  initialized = true;
+  return naf;
+
 }
 
 /***************************************************************************
@@ -453,7 +668,11 @@ static BOOL naf_mftnaf(t_naf& g_NAFVariable, int NBTERM, double EPS);
 static void naf_prtabs(t_naf& g_NAFVariable, int KTABS, t_complexe *ZTABS, int IPAS);
 static void naf_smoy(t_naf& g_NAFVariable, t_complexe *ZM);
 static BOOL naf_tessol(double EPS, double *TFSR, t_complexe *ZAMPR);
-static void naf_four1(double *DATA /*tableau commencant a l'indice 1 */, int NN, int ISIGN);
+static void naf_four1(double *DATA /*tableau commencant a l'indice 1 */, int NN, int ISIGN)
+#if NAF_USE_OPTIMIZE>0
+     __attribute__((unused))
+#endif
+     ;
 static void naf_puiss2(int NT, int *N2);
 /*v0.96 M. GASTINEAU 18/12/98 : modification du prototype */
 //void naf_iniwin();*//*remplacee par: */
@@ -490,16 +709,22 @@ static void naf_prosca(double F1, double F2, t_complexe* ZP)
      __attribute__((unused));
 static void naf_proder(t_naf& g_NAFVariable, double FS, double *DER, double *A, double *B,double *RM);
 static double naf_funcp(t_naf& g_NAFVariable, double X);
-static void naf_ztder(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST, double T0, double XH);
+static void naf_ztder(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST, double T0, double XH, t_complexe *ZT);
 static void naf_secantes(t_naf& g_NAFVariable, double X, double PASS, double EPS, double *XM, int IPRT, FILE *NFPRT);
 static double naf_func(t_naf& g_NAFVariable, double X);
 static void naf_maxiqua(t_naf& g_NAFVariable, double X, double PASS, double EPS, double *XM, double *YM, int IPRT, FILE *NFPRT);
 static void naf_frefin(t_naf& g_NAFVariable, double *FR, double *A, double *B, double *RM, const double RPAS0, const double RPREC);
-static void naf_ztpow2(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST);
+static void naf_ztpow2(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST, t_complexe *ZT);
 static BOOL naf_profre(t_naf& g_NAFVariable, double FS, double *A, double *B, double *RMD);
 static BOOL naf_proscaa(t_naf& g_NAFVariable, double F1, double F2, t_complexe *ZP);
 static BOOL naf_zardyd(t_complexe *ZT, int N, double H, t_complexe *ZOM);
-static void naf_ztpow2a(int N, int N1, t_complexe *ZTF, double *TW, t_complexe ZA, t_complexe ZAST);
+static void naf_ztpow2a(int N, int N1, t_complexe *ZTF, double *TW, t_complexe ZA, t_complexe ZAST, t_complexe *ZT);
+#if NAF_USE_OPTIMIZE>0
+static void naf_ztpuiss(int N1, double *ZTR, double *ZTI, t_complexe ZA, t_complexe ZAST);
+static void naf_fft_init(t_naf& g_NAFVariable, int KTABS2);
+static void naf_fft_clean(t_naf& g_NAFVariable);
+static void naf_fft(t_naf& g_NAFVariable, int KTABS2);
+#endif /*NAF_USE_OPTIMIZE*/
 
 
 static void naf_initnaf(t_naf& g_NAFVariable) {
@@ -525,6 +750,17 @@ static void naf_initnaf(t_naf& g_NAFVariable) {
       DIM2(g_NAFVariable.ZALP, (g_NAFVariable.NTERM+1), (g_NAFVariable.NTERM+1), t_complexe,"ZALP"); /*allocate(ZALP(1:NTERM,1:NTERM),stat = NERROR)*/
       SYSCHECKMALLOCSIZE(g_NAFVariable.ZTABS, t_complexe, g_NAFVariable.KTABS+1);/* allocate(ZTABS(0:KTABS),stat = NERROR)*/
       SYSCHECKMALLOCSIZE(g_NAFVariable.TWIN, double, g_NAFVariable.KTABS+1); /*allocate(TWIN(0:KTABS),stat = NERROR)*/
+      /* work areas of naf_fftmax, naf_profre, naf_proder, naf_proscaa, naf_gramsc, naf_modfre */
+      /* and of the power series, allocated once instead of at each call */
+      int KTABS2;
+      naf_puiss2(g_NAFVariable.KTABS+1,&KTABS2);
+      SYSCHECKMALLOCSIZE(g_NAFVariable.FFTTAB, double, 2*KTABS2);
+      SYSCHECKMALLOCSIZE(g_NAFVariable.RTAB, double, KTABS2);
+      SYSCHECKMALLOCSIZE(g_NAFVariable.ZTF, t_complexe, g_NAFVariable.KTABS+1);
+      SYSCHECKMALLOCSIZE(g_NAFVariable.ZTW, t_complexe, g_NAFVariable.KTABS+1);
+      SYSCHECKMALLOCSIZE(g_NAFVariable.ZTEE, t_complexe, g_NAFVariable.NTERM+1);
+      SYSCHECKMALLOCSIZE(g_NAFVariable.ZTN1, t_complexe, 64);
+      naf_fft_init(g_NAFVariable, KTABS2);
       /*v0.96 M. GASTINEAU 18/12/98 : modification du prototype */
       /*naf_iniwin();  */
       naf_iniwin(g_NAFVariable, g_NAFVariable.TWIN);
@@ -544,6 +780,13 @@ static void naf_cleannaf(t_naf& g_NAFVariable) {
       HFREE2(g_NAFVariable.ZALP);
       SYSFREE(g_NAFVariable.ZTABS);
       SYSFREE(g_NAFVariable.TWIN);
+      SYSFREE(g_NAFVariable.FFTTAB);
+      SYSFREE(g_NAFVariable.RTAB);
+      SYSFREE(g_NAFVariable.ZTF);
+      SYSFREE(g_NAFVariable.ZTW);
+      SYSFREE(g_NAFVariable.ZTEE);
+      SYSFREE(g_NAFVariable.ZTN1);
+      naf_fft_clean(g_NAFVariable);
       /* v0.96 M. GASTINEAU 06/01/99 : ajout */
       delete_list_fenetre_naf(g_NAFVariable.m_pListFen);
       g_NAFVariable.m_pListFen =NULL;
@@ -675,6 +918,12 @@ BOOL naf_mftnaf(t_naf& g_NAFVariable, int NBTERM, double EPS) {
 #if NAF_USE_OPTIMIZE==0
          naf_fftmax(g_NAFVariable, &FR);
 #else /*remplacee par:*/
+         if ((I==1) && g_NAFVariable.IFR0SET && (iFrMin==KTABS2))
+         {/* premier pic deja trouve par naf_fftpeak_batch */
+          FR=g_NAFVariable.IFR0*FREFO2;
+          g_NAFVariable.IFR0SET=FALSE;
+         }
+         else
          FR=naf_fftmax(g_NAFVariable, iFrMin,iFrMax,FREFO2,KTABS2);
 #endif /*NAF_USE_OPTIMIZE*/
 /*v0.96 M. GASTINEAU 14/01/99 : fin modification*/
@@ -873,11 +1122,8 @@ void naf_ztpow(int N, int N1, t_complexe *ZT, t_complexe ZA, t_complexe ZAST)
       t_complexe *pzarZT;
 #endif     /*NAF_USE_OPTIMIZE*/
 
-      if (N<N1-1)
-      {
-         printf("DANS ZTPOW, N = %d\n", N);
-         return;
-      }
+      /* fewer than N1 data: a single block of N+1 (returning would leave ZTF unset) */
+      if (N<N1-1) N1 = N+1;
 /*!----------! */
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE==0
@@ -1245,7 +1491,7 @@ double naf_fftmax(t_naf& g_NAFVariable, int p_iFrMin, int p_iFrMax, double FREFO
 /* la fonction retourne la frequence FR dertminee */
 /* On suppose p_iFrMin < p_iFrMax */
       double FR;
-      int   ISG,IPAS,I,INDX,IFR;
+      int   IPAS,I,INDX,IFR;
       /*double  FREFO2;*/
       double *pdTAB=NULL; /*=TAB*/
       double *RTAB=NULL;
@@ -1259,8 +1505,8 @@ double naf_fftmax(t_naf& g_NAFVariable, int p_iFrMin, int p_iFrMax, double FREFO
       iKTABS2 = KTABS2;
       iKTABS2m1 = iKTABS2-1;
 /*! */
-      SYSCHECKMALLOCSIZE(pdTAB,double,2*iKTABS2); /*  allocate(TAB(2*KTABS2),stat = NERROR)*/
-      SYSCHECKMALLOCSIZE(RTAB,double,iKTABS2);/*allocate(RTAB(0:KTABS2-1),stat = NERROR)*/
+      pdTAB = g_NAFVariable.FFTTAB; /*  allocate(TAB(2*KTABS2),stat = NERROR)*/
+      RTAB = g_NAFVariable.RTAB;/*allocate(RTAB(0:KTABS2-1),stat = NERROR)*/
 /*!*/
      /* FREFO2=(g_NAFVariable.FREFON*g_NAFVariable.KTABS)/iKTABS2;*//*v0.96 M. GASTINEAU 14/01/99 */
 /*!****************** */
@@ -1269,7 +1515,6 @@ double naf_fftmax(t_naf& g_NAFVariable, int p_iFrMin, int p_iFrMax, double FREFO
        fprintf(g_NAFVariable.NFPRT,"KTABS2= %d  FREFO2= %g\n",iKTABS2, FREFO2);
       }
 /*!****************! CALCUL DES FREQUENCES */
-      ISG=-1;
       dDIV=iKTABS2;
       IPAS=1;
       for(I=0, pdTABTemp1=pdTAB, pdTABTemp2=(double*)(g_NAFVariable.ZTABS);
@@ -1279,14 +1524,13 @@ double naf_fftmax(t_naf& g_NAFVariable, int p_iFrMin, int p_iFrMax, double FREFO
          *pdTABTemp1++ = (*pdTABTemp2++) * g_NAFVariable.TWIN[I];/*pdTAB(2*I+1)=DREAL(g_NAFVariable.ZTABS(I))*TWIN(I)*/
          *pdTABTemp1++ = (*pdTABTemp2++) * g_NAFVariable.TWIN[I]; /*pdTAB(2*I+2)=DIMAG(g_NAFVariable.ZTABS(I))*TWIN(I)*/
       }
-      naf_four1(pdTAB-1,iKTABS2,ISG);
+      naf_fft(g_NAFVariable, iKTABS2); /*naf_four1(pdTAB-1,iKTABS2,-1);*/
       for(I=0, pdTABTemp1=pdTAB, pdTABTemp2=pdTABTemp1+1;
           I<=iKTABS2m1;
           I++, pdTABTemp1+=2, pdTABTemp2+=2)
       {
          RTAB[I]=sqrt((*pdTABTemp1)*(*pdTABTemp1)+(*pdTABTemp2)*(*pdTABTemp2))/dDIV;
       }
-      SYSFREE(pdTAB);
 /*!**********************        CALL MODTAB(KTABS2,RTAB)*/
       /*v0.96 M. GASTINEAU 14/01/99 : modification pour le support des fenetres */
       /*INDX=naf_maxx(iKTABS2m1, RTAB);*//*naf_maxx(KTABS2,RTAB,&INDX);*/
@@ -1338,7 +1582,6 @@ double naf_fftmax(t_naf& g_NAFVariable, int p_iFrMin, int p_iFrMax, double FREFO
        fprintf(g_NAFVariable.NFPRT,"IFRMIN=%d IFRMAX=%d IFR=%d FR=%g RTAB=%g INDX=%d KTABS2=%d\n",p_iFrMin, p_iFrMax,
                IFR,FR, RTAB[INDX],INDX,iKTABS2);
       }
-      SYSFREE(RTAB);
       return FR;
       /* v0.96 M. GASTINEAU 14/01/99 : fin de modification */
 }/*      END SUBROUTINE FFTMAX*/
@@ -1416,7 +1659,225 @@ void naf_four1(double *DATA, int NN, int ISIGN)
         }
         MMAX=ISTEP;
       }
-}/*      END SUBROUTINE FOUR1*/
+}
+#if NAF_USE_OPTIMIZE>0
+/* FFT of naf_fftmax: transforms in place the KTABS2 complex points of FFTTAB (interleaved */
+/* real and imaginary parts, from index 0) with the sign of naf_four1(.., -1).            */
+/* by default the radix-2 transform of naf_four1, with its twiddle factors tabulated once */
+/* per work area (by the same recurrence, so the spectrum is identical) and butterflies   */
+/* ordered to run over contiguous data. compiled with NAF_USE_FFTW it is done by FFTW 3   */
+/* with a plan made once per work area.                                                   */
+#ifdef NAF_USE_FFTW
+
+static std::mutex naf_fftw_mutex; /* the FFTW planner is not thread-safe */
+
+void naf_fft_init(t_naf& g_NAFVariable, int KTABS2)
+{
+      std::lock_guard<std::mutex> lock(naf_fftw_mutex);
+      fftw_complex *pzTAB = reinterpret_cast<fftw_complex*>(g_NAFVariable.FFTTAB);
+      g_NAFVariable.FFTPLAN = fftw_plan_dft_1d(KTABS2, pzTAB, pzTAB, FFTW_FORWARD, FFTW_ESTIMATE);
+      g_NAFVariable.FFTROT  = NULL;
+}
+
+void naf_fft_clean(t_naf& g_NAFVariable)
+{
+      std::lock_guard<std::mutex> lock(naf_fftw_mutex);
+      fftw_destroy_plan(static_cast<fftw_plan>(g_NAFVariable.FFTPLAN));
+      g_NAFVariable.FFTPLAN = NULL;
+}
+
+void naf_fft(t_naf& g_NAFVariable, int KTABS2)
+{
+      (void)KTABS2;
+      fftw_execute(static_cast<fftw_plan>(g_NAFVariable.FFTPLAN));
+}
+
+#else /*NAF_USE_FFTW*/
+
+void naf_fft_init(t_naf& g_NAFVariable, int KTABS2)
+{
+      /* (WR,WI) of each stage MMAX=2,4,..,KTABS2, as computed by naf_four1 */
+      int N,M,MMAX;
+      double THETA,WPR,WPI,WR,WI,WTEMP;
+      double *pdROT;
+      SYSCHECKMALLOCSIZE(g_NAFVariable.FFTROT, double, 2*KTABS2);
+      g_NAFVariable.FFTPLAN = NULL;
+      pdROT = g_NAFVariable.FFTROT;
+      N=2*KTABS2;
+      MMAX=2;
+      while (N>MMAX)
+      {
+        THETA=6.28318530717959E0/(-1*MMAX);
+        WTEMP=sin(0.5E0*THETA);
+        WPR=-2.E0*WTEMP*WTEMP;
+        WPI=sin(THETA);
+        WR=1.E0;
+        WI=0.E0;
+        for (M=1; M<=MMAX; M+=2)
+        {
+          *pdROT++ = WR;
+          *pdROT++ = WI;
+          WTEMP=WR;
+          WR=WR*WPR-WI*WPI+WR;
+          WI=WI*WPR+WTEMP*WPI+WI;
+        }
+        MMAX=2*MMAX;
+      }
+}
+
+void naf_fft_clean(t_naf& g_NAFVariable)
+{
+      SYSFREE(g_NAFVariable.FFTROT);
+      g_NAFVariable.FFTROT = NULL;
+}
+
+void naf_fft(t_naf& g_NAFVariable, int KTABS2)
+{
+      int  N,I,J,M,MMAX,ISTEP,K;
+      double TEMPR,TEMPI;
+      double *DATA = g_NAFVariable.FFTTAB - 1; /* indices from 1, as in naf_four1 */
+      const double *pdROT = g_NAFVariable.FFTROT;
+      N=2*KTABS2;
+      J=1;
+      for(I=1;I<=N; I+=2)
+      {
+        if(J>I)
+        {
+          TEMPR=DATA[J];
+          TEMPI=DATA[J+1];
+          DATA[J]=DATA[I];
+          DATA[J+1]=DATA[I+1];
+          DATA[I]=TEMPR;
+          DATA[I+1]=TEMPI;
+        }
+        M=N/2;
+        while ((M>=2) && (J>M))
+        {
+          J-=M;
+          M >>=1;
+        };
+        J +=M;
+      }
+      MMAX=2;
+      while (N>MMAX)
+      {
+        ISTEP=2*MMAX;
+        /* the butterflies of a stage are independent: each block is swept over */
+        /* contiguous data and twiddle factors instead of naf_four1's strides    */
+        for (K=1; K<=N; K+=ISTEP)
+        {
+          double *__restrict pdI = DATA + K;
+          double *__restrict pdJ = DATA + K + MMAX;
+          for (M=0; M<MMAX; M+=2)
+          {
+            const double WR = pdROT[M], WI = pdROT[M+1];
+            TEMPR=WR*pdJ[M]-WI*pdJ[M+1];
+            TEMPI=WR*pdJ[M+1]+WI*pdJ[M];
+            pdJ[M]=pdI[M]-TEMPR;
+            pdJ[M+1]=pdI[M+1]-TEMPI;
+            pdI[M]=pdI[M]+TEMPR;
+            pdI[M+1]=pdI[M+1]+TEMPI;
+          }
+        }
+        pdROT += MMAX;
+        MMAX=ISTEP;
+      }
+}
+/* naf_fftmax without frequency windows for 'nb' signals at once: ZR and ZI hold their */
+/* real and imaginary parts by sample (0:KTABS) and signal (NaffBatch::block_size per   */
+/* sample). the windowed signals are transformed in lockstep, each butterfly running    */
+/* over the signals, with the arithmetic of naf_fft, so that IFR is the bin naf_fftmax  */
+/* would find for each signal.                                                          */
+void naf_fftpeak_batch(t_naf& g_NAFVariable, int nb, const double* ZR, const double* ZI, std::vector<double>& TR, std::vector<double>& TI, int* IFR)
+{
+      const int B = NaffBatch::block_size;
+      int  KTABS2,N,I,J,M,MMAX,ISTEP,K,L;
+      naf_puiss2(g_NAFVariable.KTABS+1,&KTABS2);
+      TR.resize(KTABS2*B); TI.resize(KTABS2*B);
+      for(I=0; I<KTABS2; I++)
+      {
+        const double W = g_NAFVariable.TWIN[I];
+        for(L=0; L<nb; L++)
+        {
+          TR[I*B+L] = ZR[I*B+L]*W;
+          TI[I*B+L] = ZI[I*B+L]*W;
+        }
+      }
+      /* permutation of naf_four1, on samples */
+      N=2*KTABS2;
+      J=1;
+      for(I=1;I<=N; I+=2)
+      {
+        if(J>I)
+        {
+          std::swap_ranges(&TR[(I/2)*B], &TR[(I/2)*B]+nb, &TR[(J/2)*B]);
+          std::swap_ranges(&TI[(I/2)*B], &TI[(I/2)*B]+nb, &TI[(J/2)*B]);
+        }
+        M=N/2;
+        while ((M>=2) && (J>M))
+        {
+          J-=M;
+          M >>=1;
+        };
+        J +=M;
+      }
+      const double *pdROT = g_NAFVariable.FFTROT;
+      MMAX=2;
+      while (N>MMAX)
+      {
+        ISTEP=2*MMAX;
+        for (K=0; K<N/2; K+=MMAX)
+        {
+          for (M=0; M<MMAX/2; M++)
+          {
+            const double WR = pdROT[2*M], WI = pdROT[2*M+1];
+            double *__restrict pdIR = &TR[(K+M)*B], *__restrict pdII = &TI[(K+M)*B];
+            double *__restrict pdJR = &TR[(K+M+MMAX/2)*B], *__restrict pdJI = &TI[(K+M+MMAX/2)*B];
+            for(L=0; L<nb; L++)
+            {
+              const double TEMPR=WR*pdJR[L]-WI*pdJI[L];
+              const double TEMPI=WR*pdJI[L]+WI*pdJR[L];
+              pdJR[L]=pdIR[L]-TEMPR;
+              pdJI[L]=pdII[L]-TEMPI;
+              pdIR[L]=pdIR[L]+TEMPR;
+              pdII[L]=pdII[L]+TEMPI;
+            }
+          }
+        }
+        pdROT += MMAX;
+        MMAX=ISTEP;
+      }
+      /* modulus and its maximum (naf_maxx), signal by signal */
+      const double dDIV=KTABS2;
+      double VMAX[B];
+      int INDX[B];
+      for(L=0; L<nb; L++)
+      {
+        VMAX[L]=sqrt(TR[L]*TR[L]+TI[L]*TI[L])/dDIV;
+        INDX[L]=0;
+      }
+      for(I=1; I<KTABS2; I++)
+      {
+        for(L=0; L<nb; L++)
+        {
+          const double R=sqrt(TR[I*B+L]*TR[I*B+L]+TI[I*B+L]*TI[I*B+L])/dDIV;
+          if (R>VMAX[L])
+          {
+            VMAX[L]=R;
+            INDX[L]=I;
+          }
+        }
+      }
+      for(L=0; L<nb; L++)
+      {
+        IFR[L]=((INDX[L]+1)<=(KTABS2/2))?INDX[L]:INDX[L]-KTABS2;
+      }
+}
+
+
+#endif /*NAF_USE_FFTW*/
+#endif /*NAF_USE_OPTIMIZE*/
+/*      END SUBROUTINE FOUR1*/
 
 
 /*      SUBROUTINE PUISS2(NT,N2)*/
@@ -1555,11 +2016,10 @@ void naf_modfre(t_naf& g_NAFVariable, int NUMFR, double *A, double *B)
 ! */
       int IT;
       t_complexe ZI,ZOM,ZA,ZEX,ZINC;
-      t_complexe *ZT=NULL;
+      t_complexe *ZT=g_NAFVariable.ZTW;
 
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE==0
-      SYSCHECKMALLOCSIZE(ZT,t_complexe, g_NAFVariable.KTABS+1); /*allocate(ZT(0:g_NAFVariable.KTABS),stat = NERROR)*/
       ZI = cmplx(0.E0,1.E0);
       ZOM=muldoublcomplexe(g_NAFVariable.TFS[NUMFR]/g_NAFVariable.UNIANG,ZI); /*ZOM=g_NAFVariable.TFS[NUMFR]/g_NAFVariable.UNIANG*ZI*/
       ZA=cmplx(*A,*B);
@@ -1613,12 +2073,9 @@ void naf_modfre(t_naf& g_NAFVariable, int NUMFR, double *A, double *B)
             /* g_NAFVariable.ZTABS(IT)=g_NAFVariable.ZTABS(IT)- DREAL(ZT(IT)) */
          }
       }
-      SYSFREE(ZT); /*deallocate(ZT)*/
 #else /*remplacee par:*/
       t_complexe *pzarTabs, *pzarZT;
       const int ikTabs=g_NAFVariable.KTABS; /*v0.96 M. GASTINEAU 12/01/99 : optimisation*/
-
-      SYSCHECKMALLOCSIZE(ZT,t_complexe, g_NAFVariable.KTABS+1); /*allocate(ZT(0:g_NAFVariable.KTABS),stat = NERROR)*/
       i_compl_cmplx(&ZI,0.E0,1.E0);
       ZOM=i_compl_muldoubl(g_NAFVariable.TFS[NUMFR]/g_NAFVariable.UNIANG,ZI); /*ZOM=g_NAFVariable.TFS[NUMFR]/g_NAFVariable.UNIANG*ZI*/
 
@@ -1679,7 +2136,6 @@ void naf_modfre(t_naf& g_NAFVariable, int NUMFR, double *A, double *B)
            /*v0.96 M. GASTINEAU 12/01/99 : fin modification */
          }
       }
-      SYSFREE(ZT); /*deallocate(ZT)*/
 #endif /*NAF_USE_OPTIMIZE==0*/
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
 }/*      END SUBROUTINE MODFRE*/
@@ -1720,24 +2176,20 @@ BOOL naf_gramsc(t_naf& g_NAFVariable, double FS, double A, double B)
 ! */
       int   I, J, K, NF, IT;
       double DIV;
-      t_complexe *ZTEE=NULL;
+      t_complexe *ZTEE=g_NAFVariable.ZTEE;
       t_complexe ZDIV,ZMUL,ZI,ZEX,ZINC,ZA,ZOM;
-      t_complexe *ZT=NULL;
+      t_complexe *ZT=g_NAFVariable.ZTW;
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE>0
       t_complexe *pzarTabs, *pzarZT;
       const int ikTabs=g_NAFVariable.KTABS; /*v0.96 M. GASTINEAU 12/01/99 : optimisation*/
 #endif /**/
-      SYSCHECKMALLOCSIZE(ZT, t_complexe, g_NAFVariable.KTABS+1); /*allocate(ZT(0:g_NAFVariable.KTABS),stat = NERROR)*/
-      SYSCHECKMALLOCSIZE(ZTEE, t_complexe, g_NAFVariable.NTERM+1); /*allocate(ZTEE(1:g_NAFVariable.NTERM),stat = NERROR)*/
 
 /*!----------! CALCUL DE ZTEE(I)=<EN,EI>*/
       for(I =1;I<=g_NAFVariable.NFS;I++)
       {
         if(naf_proscaa(g_NAFVariable, FS,g_NAFVariable.TFS[I],ZTEE+I)==FALSE)
         {
-         SYSFREE(ZT);
-         SYSFREE(ZTEE);
          return FALSE;
         }
       }
@@ -1944,8 +2396,6 @@ BOOL naf_gramsc(t_naf& g_NAFVariable, double FS, double A, double B)
       }
 #endif /*NAF_USE_OPTIMIZE==0*/
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
-      SYSFREE(ZT);
-      SYSFREE(ZTEE);
       return TRUE;
 }/*      END SUBROUTINE GRAMSC*/
 
@@ -2087,8 +2537,7 @@ void naf_proder(t_naf& g_NAFVariable, double FS, double *DER, double *A, double
       double  OM,ANG0,ANGI,H;
       t_complexe ZI,ZAC,ZINC,ZEX,ZB,/*ZT,*/ZA;
       int LTF;
-      t_complexe *ZTF=NULL;/*tableau de 1 a KTABS+1 */
-      SYSCHECKMALLOCSIZE(ZTF,t_complexe, g_NAFVariable.KTABS+1); /*allocate(ZTF(0:g_NAFVariable.KTABS),stat = NERROR)*/
+      t_complexe *ZTF=g_NAFVariable.ZTF;/*tableau de 1 a KTABS+1 */
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE==0
 /*!
@@ -2103,14 +2552,14 @@ void naf_proder(t_naf& g_NAFVariable, double FS, double *DER, double *A, double
       ZAC = expcomplexe (muldoublcomplexe(-ANG0,ZI));
       ZINC=  expcomplexe (muldoublcomplexe(-ANGI,ZI));
       ZEX = divcomplexe(ZAC,ZINC); /*ZEX = ZAC/ZINC*/
-      naf_ztpow2(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX); /*CALL  ZTPOW2(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX)*/
+      naf_ztpow2(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.ZTN1); /*CALL  ZTPOW2(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX)*/
 /*!------------------ TAILLE DU PAS*/
       H=1.E0/((double)LTF);
       naf_zardyd(ZTF,LTF,H,&ZA);
       *A = ZA.reel;
       *B = ZA.imag;
       *RM=module(ZA);
-      naf_ztder(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH); /*CALL ZTDER(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH)*/
+      naf_ztder(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH,g_NAFVariable.ZTN1); /*CALL ZTDER(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH)*/
       naf_zardyd(ZTF,LTF,H,&ZB);
       *DER=(mulcomplexe(conjcomplexe(ZA),ZB)).imag*2.E0;
 #else /*remplacee par: */
@@ -2126,25 +2575,24 @@ void naf_proder(t_naf& g_NAFVariable, double FS, double *DER, double *A, double
       ZAC = i_compl_exp (i_compl_muldoubl(-ANG0,ZI));
       ZINC=  i_compl_exp (i_compl_muldoubl(-ANGI,ZI));
       ZEX = i_compl_div(ZAC,ZINC); /*ZEX = ZAC/ZINC*/
-      naf_ztpow2(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX); /*CALL  ZTPOW2(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX)*/
+      naf_ztpow2(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.ZTN1); /*CALL  ZTPOW2(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX)*/
 /*!------------------ TAILLE DU PAS*/
       H=1.E0/((double)LTF);
       naf_zardyd(ZTF,LTF,H,&ZA);
       *A = ZA.reel;
       *B = ZA.imag;
       *RM=i_compl_module(ZA);
-      naf_ztder(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH); /*CALL ZTDER(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH)*/
+      naf_ztder(g_NAFVariable.KTABS,NVECT,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH,g_NAFVariable.ZTN1); /*CALL ZTDER(g_NAFVariable.KTABS+1,NVECT,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX,g_NAFVariable.T0,g_NAFVariable.XH)*/
       naf_zardyd(ZTF,LTF,H,&ZB);
       *DER=(i_compl_mul(i_compl_conj(&ZA),ZB)).imag*2.E0;
 #endif /*NAF_USE_OPTIMIZE==0*/
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
-      SYSFREE(ZTF);
 #undef NVECT
 }/*      END SUBROUTINE PRODER*/
 
 /*      SUBROUTINE ZTDER (N,N1,ZTF,ZTA,TW,ZA,ZAST,T0,XH)*/
 /*v0.96 M. GASTINEAU 09/09/98 : modification dans les boucles de I en I-1 */
-void naf_ztder(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST, double T0, double XH)
+void naf_ztder(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST, double T0, double XH, t_complexe *ZT)
 {
 /*!-----------------------------------------------------------------------
 !ZTPOW   CALCULE  ZTF(I) = ZTA(I)* TW(I)*ZAST*ZA**I *(T0+(I-1)*XH EN VECTORIEL
@@ -2162,14 +2610,8 @@ void naf_ztder(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_co
 !      */
       int I,INC,NT,IT,NX;
       t_complexe ZT1, ZINC;
-      t_complexe *ZT=NULL;
-
-      SYSCHECKMALLOCSIZE(ZT,t_complexe,N1); /*allocate(ZT(0:N1-1),stat = NERROR)*/
-      if (N<N1-1)
-      {
-         fprintf(stdout,"DANS ZTDER, N = %d\n", N);
-         return;
-      }
+      /* fewer than N1 data: a single block of N+1 (returning would leave ZTF unset) */
+      if (N<N1-1) N1 = N+1;
 /*!----------! */
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE==0
@@ -2211,41 +2653,37 @@ void naf_ztder(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_co
         /*ZTF(INC+I)=ZTA(INC+I)*TW(INC+I)*ZT(I)*ZINC*(T0+(INC+I-1)*XH)*/
       }
 #else /*remplacee par:*/
-      ZT[0] = i_compl_mul(ZAST,ZA);
-      for( I = 1; I<N1; I++)
-      {
-         ZT[I] = i_compl_mul(ZT[I-1],ZA);
-      }
-      for(I = 0; I<N1; I++)
-      {
-         ZTF[I] = i_compl_muldoubl((T0+(I)*XH)*TW[I], i_compl_mul(ZTA[I],ZT[I]));
-         /*ZTF(I) = ZTA(I)*TW(I)*ZT(I)*(T0+(I-1)*XH)*/
-      }
-      ZT1 = i_compl_div(ZT[N1-1],ZAST);
-      i_compl_cmplx(&ZINC,1,0);
-      INC =0;
+      /* the work area ZT(0:N1-1) holds the powers as separate real ZTR(0:N1-1) and    */
+      /* imaginary ZTI(0:N1-1) parts, so that the loops below are plain double arrays  */
+      /* the compiler can vectorize. the operations are those of i_compl_mul, in the   */
+      /* same order, so the results are unchanged.                                     */
+      double *ZTR = (double*)ZT, *ZTI = ZTR + N1;
+      double *__restrict pdZTF = (double*)ZTF;
+      naf_ztpuiss(N1, ZTR, ZTI, ZA, ZAST);
+      const double *__restrict pdZTA = (const double*)ZTA;
+      ZINC.reel = 1E0; ZINC.imag = 0E0;
+      i_compl_cmplx(&ZT1, ZTR[N1-1], ZTI[N1-1]);
+      ZT1 = i_compl_div(ZT1, ZAST);
       NT = (N+1)/N1;
-      for( IT = 2; IT<= NT; IT++)
+      for(IT = 1, INC = 0; IT <= NT+1; IT++, INC += N1)
       {
-         i_compl_pmul(&ZINC,&ZT1);
-         INC += N1; /*INC  = INC + N1*/
-         for(I = 0; I<N1; I++)
+         if (IT > 1) i_compl_pmul(&ZINC,&ZT1);
+         NX = (IT <= NT) ? N1 : (N+1)-NT*N1;
+         const double *__restrict pdA = pdZTA + 2*INC;
+         const double *__restrict pdW = TW + INC;
+         double *__restrict pdF = pdZTF + 2*INC;
+         for(I = 0; I < NX; I++)
          {
-           ZTF[INC+I]=i_compl_muldoubl((T0+(INC+I)*XH)*TW[INC+I],i_compl_mul(ZTA[INC+I],i_compl_mul(ZT[I],ZINC)));
            /*ZTF(INC+I)=ZTA(INC+I)*TW(INC+I)*ZT(I)*ZINC*(T0+(INC+I-1)*XH)*/
+           const double BR = ZTR[I]*ZINC.reel - ZTI[I]*ZINC.imag;
+           const double BI = ZTR[I]*ZINC.imag + ZTI[I]*ZINC.reel;
+           const double D  = (T0+(INC+I)*XH)*pdW[I];
+           pdF[2*I]   = D*(pdA[2*I]*BR - pdA[2*I+1]*BI);
+           pdF[2*I+1] = D*(pdA[2*I]*BI + pdA[2*I+1]*BR);
          }
       }
-      i_compl_pmul(&ZINC,&ZT1);
-      INC += N1; /*INC  = INC + N1*/
-      NX = (N+1)-NT*N1;
-      for (I = 0; I<NX; I++)
-      {
-        ZTF[INC+I]=i_compl_muldoubl(TW[INC+I]*(T0+(INC+I)*XH), i_compl_mul(ZTA[INC+I], i_compl_mul(ZT[I],ZINC)));
-        /*ZTF(INC+I)=ZTA(INC+I)*TW(INC+I)*ZT(I)*ZINC*(T0+(INC+I-1)*XH)*/
-      }
 #endif /*NAF_USE_OPTIMIZE==0*/
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
-      SYSFREE(ZT);
 }/*      END SUBROUTINE ZTDER*/
 
 /*      SUBROUTINE SECANTES(X,PASS,EPS,XM,IPRT,NFPRT)*/
@@ -2722,9 +3160,7 @@ BOOL naf_profre(t_naf& g_NAFVariable, double FS, double *A, double *B, double *R
       int LTF;
       double OM,ANG0,ANGI,H;
       t_complexe ZI,ZAC,ZINC,ZEX,ZA;
-      t_complexe *ZTF=NULL;
-
-      SYSCHECKMALLOCSIZE(ZTF, t_complexe, g_NAFVariable.KTABS+1); /*allocate(ZTF(0:g_NAFVariable.KTABS),stat = g_NAFVariable.NERROR)*/
+      t_complexe *ZTF=g_NAFVariable.ZTF;
 /*!
 !------------------ CONVERSION DE FS EN RD/AN*/
       OM=FS/g_NAFVariable.UNIANG ;
@@ -2752,12 +3188,11 @@ BOOL naf_profre(t_naf& g_NAFVariable, double FS, double *A, double *B, double *R
 #endif /*NAF_USE_OPTIMIZE==0*/
 
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
-      naf_ztpow2(g_NAFVariable.KTABS,64,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX); /*CALL  ZTPOW2(g_NAFVariable.KTABS+1,64,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX)*/
+      naf_ztpow2(g_NAFVariable.KTABS,64,ZTF,g_NAFVariable.ZTABS,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.ZTN1); /*CALL  ZTPOW2(g_NAFVariable.KTABS+1,64,ZTF,g_NAFVariable.ZTABS,TWIN,ZINC,ZEX)*/
 /*!------------------ TAILLE DU PAS*/
       H=1.E0/((double)LTF);
       if (naf_zardyd(ZTF,LTF,H,&ZA)==FALSE)
       {
-       SYSFREE(ZTF);
        return FALSE;
       }
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
@@ -2769,12 +3204,11 @@ BOOL naf_profre(t_naf& g_NAFVariable, double FS, double *A, double *B, double *R
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
       *A = ZA.reel;
       *B = ZA.imag;
-      SYSFREE(ZTF);
       return TRUE;
 }/*      END SUBROUTINE PROFRE*/
 
 /*      SUBROUTINE ZTPOW2 (N,N1,ZTF,ZTA,TW,ZA,ZAST)*/
-void naf_ztpow2(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST)
+void naf_ztpow2(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_complexe ZA, t_complexe ZAST, t_complexe *ZT)
 {
 /*!-----------------------------------------------------------------------
 !     ZTPOW   CALCULE  ZTF(I) = ZTA(I)* TW(I)*ZAST*ZA**I EN VECTORIEL
@@ -2792,17 +3226,8 @@ void naf_ztpow2(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_c
 !               */
       int INC,NT,IT,I,NX;
       t_complexe ZT1,ZINC;
-      t_complexe *ZT=NULL;
-/* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
-#if NAF_USE_OPTIMIZE>0
-      t_complexe *pzarZT;
-#endif /**/
-      SYSCHECKMALLOCSIZE(ZT,t_complexe, N1); /*allocate(ZT(0:N1-1),stat = nerror)*/
-      if (N<N1-1)
-      {
-         fprintf(stdout,"DANS ZTPOW, N = %d\n", N);
-         return;
-      }
+      /* fewer than N1 data: a single block of N+1 (returning would leave ZTF unset) */
+      if (N<N1-1) N1 = N+1;
 /*!----------! */
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE==0
@@ -2838,40 +3263,33 @@ void naf_ztpow2(int N, int N1, t_complexe *ZTF, t_complexe *ZTA, double *TW, t_c
        ZTF[INC +I] = muldoublcomplexe(TW[INC+I], mulcomplexe(mulcomplexe(ZTA[INC+I], ZT[I]),ZINC));
       }
 #else /*remplacee par:*/
-      ZT[0] = i_compl_mul(ZAST,ZA);
-      for(I = 1, pzarZT=ZT+1; I<N1; I++, pzarZT++)
-      {
-         *pzarZT=i_compl_mul(*(pzarZT-1), ZA); /*ZT(I) = ZT(I-1)*ZA*/
-      }
-      for(I = 0; I<N1; I++)
-      {
-         ZTF[I]=i_compl_muldoubl(TW[I], i_compl_mul(ZTA[I], ZT[I])); /*ZTF(I) = ZTA(I)*TW(I)*ZT(I)*/
-      }
-      ZT1= i_compl_div(ZT[N1-1], ZAST); /*ZT1 = ZT(N1-1)/ZAST*/
-      i_compl_cmplx(&ZINC,1E0,0E0);
-      INC =0;
+      /* split real and imaginary parts of ZT, as in naf_ztder */
+      double *ZTR = (double*)ZT, *ZTI = ZTR + N1;
+      double *__restrict pdZTF = (double*)ZTF;
+      naf_ztpuiss(N1, ZTR, ZTI, ZA, ZAST);
+      const double *__restrict pdZTA = (const double*)ZTA;
+      ZINC.reel = 1E0; ZINC.imag = 0E0;
+      i_compl_cmplx(&ZT1, ZTR[N1-1], ZTI[N1-1]);
+      ZT1 = i_compl_div(ZT1, ZAST); /*ZT1 = ZT(N1-1)/ZAST*/
       NT = (N+1)/N1;
-      for(IT = 2;IT<= NT; IT++)
+      for(IT = 1, INC = 0; IT <= NT+1; IT++, INC += N1)
       {
-         i_compl_pmul(&ZINC,&ZT1); /*ZINC = ZINC*ZT1*/
-         INC += N1; /*INC  = INC + N1*/
-         for(I = 0; I< N1;I++)
+         if (IT > 1) i_compl_pmul(&ZINC,&ZT1); /*ZINC = ZINC*ZT1*/
+         NX = (IT <= NT) ? N1 : N+1-NT*N1;
+         const double *__restrict pdA = pdZTA + 2*INC;
+         const double *__restrict pdW = TW + INC;
+         double *__restrict pdF = pdZTF + 2*INC;
+         for(I = 0; I < NX; I++)
          {
             /*ZTF(INC +I) = ZTA(INC+I)*TW(INC+I)*ZT(I)*ZINC*/
-            ZTF[INC +I] = i_compl_muldoubl(TW[INC+I], i_compl_mul(i_compl_mul(ZTA[INC+I], ZT[I]),ZINC));
+            const double AR = pdA[2*I]*ZTR[I] - pdA[2*I+1]*ZTI[I];
+            const double AI = pdA[2*I]*ZTI[I] + pdA[2*I+1]*ZTR[I];
+            pdF[2*I]   = pdW[I]*(AR*ZINC.reel - AI*ZINC.imag);
+            pdF[2*I+1] = pdW[I]*(AR*ZINC.imag + AI*ZINC.reel);
          }
       }
-      i_compl_pmul(&ZINC,&ZT1); /*ZINC = ZINC*ZT1*/
-      INC += N1; /*INC  = INC + N1*/
-      NX = N+1-NT*N1;
-      for(I = 0; I< NX; I++)
-      {
-          /*  ZTF(INC +I) = ZTA(INC+I)*TW(INC+I)*ZT(I)*ZINC*/
-       ZTF[INC +I] = i_compl_muldoubl(TW[INC+I], i_compl_mul(i_compl_mul(ZTA[INC+I], ZT[I]),ZINC));
-      }
 #endif /*NAF_USE_OPTIMIZE==0*/
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
-      SYSFREE(ZT);
 }/*      END SUBROUTINE ZTPOW2*/
 
 /*      SUBROUTINE INIWIN*/
@@ -3135,9 +3553,7 @@ BOOL naf_proscaa(t_naf& g_NAFVariable, double F1, double F2, t_complexe *ZP)
       int LTF;
       double OM,ANG0,ANGI,H;
       t_complexe ZI,ZAC,ZINC,ZEX;
-      t_complexe *ZTF=NULL;
-
-      SYSCHECKMALLOCSIZE(ZTF, t_complexe, g_NAFVariable.KTABS+1); /*allocate(ZTF(0:g_NAFVariable.KTABS),stat = nerror)*/
+      t_complexe *ZTF=g_NAFVariable.ZTF;
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE==0
       ZI=cmplx(0.E0,1.E0);
@@ -3149,7 +3565,7 @@ BOOL naf_proscaa(t_naf& g_NAFVariable, double F1, double F2, t_complexe *ZP)
       ZAC= expcomplexe(muldoublcomplexe(-ANG0, ZI)); /*ZAC = EXP (-ZI*ANG0)*/
       ZINC=expcomplexe(muldoublcomplexe(-ANGI, ZI)); /*ZINC= EXP (-ZI*ANGI)*/
       ZEX= divcomplexe(ZAC, ZINC); /*ZEX = ZAC/ZINC*/
-      naf_ztpow2a(g_NAFVariable.KTABS,64,ZTF,g_NAFVariable.TWIN,ZINC,ZEX);/*CALL  ZTPOW2A(g_NAFVariable.KTABS+1,64,ZTF,TWIN,ZINC,ZEX)*/
+      naf_ztpow2a(g_NAFVariable.KTABS,64,ZTF,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.ZTN1);/*CALL  ZTPOW2A(g_NAFVariable.KTABS+1,64,ZTF,TWIN,ZINC,ZEX)*/
 #else/*remplacee par:*/
       i_compl_cmplx(&ZI,0.E0,1.E0);
 /*!----------! FREQUENCES EN UNITE D'ANGLE PAR UNITE DE TEMPS*/
@@ -3160,7 +3576,7 @@ BOOL naf_proscaa(t_naf& g_NAFVariable, double F1, double F2, t_complexe *ZP)
       ZAC= i_compl_exp(i_compl_muldoubl(-ANG0, ZI)); /*ZAC = EXP (-ZI*ANG0)*/
       ZINC=i_compl_exp(i_compl_muldoubl(-ANGI, ZI)); /*ZINC= EXP (-ZI*ANGI)*/
       ZEX= i_compl_div(ZAC, ZINC); /*ZEX = ZAC/ZINC*/
-      naf_ztpow2a(g_NAFVariable.KTABS,64,ZTF,g_NAFVariable.TWIN,ZINC,ZEX);/*CALL  ZTPOW2A(g_NAFVariable.KTABS+1,64,ZTF,TWIN,ZINC,ZEX)*/
+      naf_ztpow2a(g_NAFVariable.KTABS,64,ZTF,g_NAFVariable.TWIN,ZINC,ZEX,g_NAFVariable.ZTN1);/*CALL  ZTPOW2A(g_NAFVariable.KTABS+1,64,ZTF,TWIN,ZINC,ZEX)*/
 #endif /*NAF_USE_OPTIMIZE==0*/
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
 
@@ -3169,15 +3585,13 @@ BOOL naf_proscaa(t_naf& g_NAFVariable, double F1, double F2, t_complexe *ZP)
       /*CALL ZARDYD(ZTF,LTF+1,H,ZP)*/
       if (naf_zardyd(ZTF,LTF,H,ZP)==FALSE)
       {
-       SYSFREE(ZTF);
        return FALSE;
       }
-      SYSFREE(ZTF);
       return TRUE;
 }/*      END SUBROUTINE PROSCAA*/
 
 /*      SUBROUTINE ZTPOW2A (N,N1,ZTF,TW,ZA,ZAST)*/
-void naf_ztpow2a(int N, int N1, t_complexe *ZTF, double *TW, t_complexe ZA, t_complexe ZAST)
+void naf_ztpow2a(int N, int N1, t_complexe *ZTF, double *TW, t_complexe ZA, t_complexe ZAST, t_complexe *ZT)
 {
 /*!-----------------------------------------------------------------------
 !     ZTPOW   CALCULE  ZTF(I) = TW(I)*ZAST*ZA**I EN VECTORIEL
@@ -3195,14 +3609,8 @@ void naf_ztpow2a(int N, int N1, t_complexe *ZTF, double *TW, t_complexe ZA, t_co
 !      */
       int I,INC,IT, NX,NT;
       t_complexe ZT1,ZINC;
-      t_complexe *ZT=NULL;
-
-      SYSCHECKMALLOCSIZE(ZT, t_complexe, N1); /*allocate(ZT(0:N1-1),stat = nerror)*/
-      if (N<N1-1)
-      {
-         fprintf(stdout,"DANS ZTPOW, N = %d\n",N);
-         return;
-      }
+      /* fewer than N1 data: a single block of N+1 (returning would leave ZTF unset) */
+      if (N<N1-1) N1 = N+1;
 /*!----------! */
 /* v0.96 M. GASTINEAU 01/12/98 : utilisation des fonctions  complexes inlines et optimisation */
 #if NAF_USE_OPTIMIZE==0
@@ -3237,40 +3645,45 @@ void naf_ztpow2a(int N, int N1, t_complexe *ZTF, double *TW, t_complexe ZA, t_co
             ZTF[INC +I] = muldoublcomplexe(TW[INC+I],mulcomplexe(ZT[I],ZINC));/*ZTF(INC +I) = TW(INC+I)*ZT(I)*ZINC*/
       }
 #else /*remplacee par:*/
-      ZT[0] = i_compl_mul(ZAST,ZA);
-      for(I = 1; I<N1; I++)
-      {
-         ZT[I] = i_compl_mul(ZT[I-1],ZA);
-      }
-      for(I = 0;I<N1; I++)
-      {
-         ZTF[I] = i_compl_muldoubl(TW[I],ZT[I]);
-      }
-      ZT1 = i_compl_div(ZT[N1-1],ZAST); /*ZT1 = ZT(N1-1)/ZAST*/
-      i_compl_cmplx(&ZINC,1E0,0E0);
-      INC =0;
-      NT = (N+1)/N1  ;
-      for(IT = 2;IT<= NT; IT++)
+      /* split real and imaginary parts of ZT, as in naf_ztder */
+      double *ZTR = (double*)ZT, *ZTI = ZTR + N1;
+      double *__restrict pdZTF = (double*)ZTF;
+      naf_ztpuiss(N1, ZTR, ZTI, ZA, ZAST);
+      ZINC.reel = 1E0; ZINC.imag = 0E0;
+      i_compl_cmplx(&ZT1, ZTR[N1-1], ZTI[N1-1]);
+      ZT1 = i_compl_div(ZT1, ZAST); /*ZT1 = ZT(N1-1)/ZAST*/
+      NT = (N+1)/N1;
+      for(IT = 1, INC = 0; IT <= NT+1; IT++, INC += N1)
       {
-         i_compl_pmul(&ZINC,&ZT1); /*ZINC = ZINC*ZT1*/
-         INC += N1; /*INC  = INC + N1*/
-         for(I = 0; I<N1; I++)
+         if (IT > 1) i_compl_pmul(&ZINC,&ZT1); /*ZINC = ZINC*ZT1*/
+         NX = (IT <= NT) ? N1 : N+1-NT*N1;
+         const double *__restrict pdW = TW + INC;
+         double *__restrict pdF = pdZTF + 2*INC;
+         for(I = 0; I < NX; I++)
          {
-            ZTF[INC +I] = i_compl_muldoubl(TW[INC+I],i_compl_mul(ZT[I],ZINC));/*ZTF(INC +I) = TW(INC+I)*ZT(I)*ZINC*/
-
+            /*ZTF(INC +I) = TW(INC+I)*ZT(I)*ZINC*/
+            pdF[2*I]   = pdW[I]*(ZTR[I]*ZINC.reel - ZTI[I]*ZINC.imag);
+            pdF[2*I+1] = pdW[I]*(ZTR[I]*ZINC.imag + ZTI[I]*ZINC.reel);
          }
       }
-      i_compl_pmul(&ZINC,&ZT1); /*ZINC = ZINC*ZT1*/
-      INC += N1; /*INC  = INC + N1*/
-      NX = N+1-NT*N1;
-      for(I = 0;I< NX; I++)
-      {
-            ZTF[INC +I] = i_compl_muldoubl(TW[INC+I],i_compl_mul(ZT[I],ZINC));/*ZTF(INC +I) = TW(INC+I)*ZT(I)*ZINC*/
-      }
 #endif /*NAF_USE_OPTIMIZE==0*/
 /* v0.96 M. GASTINEAU 01/12/98 : fin optimisation */
-      SYSFREE(ZT);
-}/*      END SUBROUTINE ZTPOW2A*/
+}
+#if NAF_USE_OPTIMIZE>0
+/* ZT(I) = ZAST*ZA**(I+1), I=0..N1-1, in separate real and imaginary parts */
+void naf_ztpuiss(int N1, double *ZTR, double *ZTI, t_complexe ZA, t_complexe ZAST)
+{
+      int I;
+      t_complexe Z = i_compl_mul(ZAST,ZA);
+      ZTR[0] = Z.reel; ZTI[0] = Z.imag;
+      for(I = 1; I<N1; I++)
+      {
+         Z = i_compl_mul(Z,ZA); /*ZT(I) = ZT(I-1)*ZA*/
+         ZTR[I] = Z.reel; ZTI[I] = Z.imag;
+      }
+}
+#endif /*NAF_USE_OPTIMIZE*/
+/*      END SUBROUTINE ZTPOW2A*/
 
 /*      SUBROUTINE CORRECTION(FREQ)*/
 void naf_correction(t_naf& g_NAFVariable, double *FREQ)
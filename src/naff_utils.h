@@ -129,6 +129,18 @@ struct stnaf {
     /* Ximenes XRR 2015-08-20, trying to get rid of all global variables */
     double* TWIN;
     double  AF,BF;
+
+    /* work areas allocated by naf_initnaf, so that the analysis does not allocate */
+    double*     FFTTAB; /* data of the FFT of naf_fftmax (2*KTABS2) */
+    double*     RTAB;   /* modulus of the FFT of naf_fftmax (0:KTABS2-1) */
+    t_complexe* ZTF;    /* integrands of naf_profre, naf_proder and naf_proscaa (0:KTABS) */
+    t_complexe* ZTW;    /* terms subtracted by naf_gramsc and naf_modfre (0:KTABS) */
+    t_complexe* ZTEE;   /* scalar products of naf_gramsc (1:NTERM) */
+    t_complexe* ZTN1;   /* powers of naf_ztpow2, naf_ztpow2a and naf_ztder (0:63), as real and imaginary parts */
+    double*     FFTROT; /* twiddle factors of the internal FFT of naf_fft (2*KTABS2) */
+    void*       FFTPLAN;/* plan of naf_fft when it uses an external FFT library */
+    int         IFR0;   /* FFT bin of the first frequency, found beforehand for a batch of signals */
+    BOOL        IFR0SET;/* TRUE if naf_mftnaf should start from IFR0 instead of its own FFT */
 };
 
 typedef struct stnaf t_naf;
@@ -16,6 +16,14 @@
 
 #include <trackcpp/optics.h>
 #include <trackcpp/linalg.h>
+#include <trackcpp/tpsa.h>
+#include <trackcpp/multithreads.h>
+#include <gsl/gsl_eigen.h>
+#include <cstring>
+#include <complex>
+#include <array>
+#include <functional>
+#include <algorithm>
 
 double get_magnetic_rigidity(const double energy) {
     double gamma = (energy/1e6) / (electron_rest_energy_MeV);
@@ -40,156 +48,1455 @@ std::ostream& operator<< (std::ostream &out, const Twiss& tw) {
   return out;
 }
 
-//#define TIMEIT
-#ifdef TIMEIT
-#include <chrono>
-#endif
+// blocks of a transfer matrix that propagate the uncoupled twiss parameters of each plane:
+// m11, m12, m21, m22 and the dispersion column d1, d2
+struct TwissBlocks {
+  double x[6];
+  double y[6];
+  TwissBlocks(const double (&m)[6][6]) :
+    x{m[0][0], m[0][1], m[1][0], m[1][1], m[0][4], m[1][4]},
+    y{m[2][2], m[2][3], m[3][2], m[3][3], m[2][4], m[3][4]} {}
+};
 
-Status::type calc_twiss(const Accelerator& accelerator, const Pos<double>& fixed_point, Matrix& m66, std::vector<Twiss>& twiss, Twiss twiss0, bool closed_flag) {
+// phase advance, in [0, 2 pi), of a plane with transfer blocks 'b' and initial beta and alpha
+static double raw_phase(const double (&b)[6], double beta0, double alpha0) {
+  const double mu = std::atan2(b[1], b[0] * beta0 - b[1] * alpha0);
+  return (mu < 0) ? mu + 2*M_PI : mu;
+}
 
-#ifdef TIMEIT
-  auto start = std::chrono::steady_clock::now();
-  auto end = std::chrono::steady_clock::now();
-  auto diff = end - start;
-#endif
+// with phase advances below pi per element, a raw phase that drops by more than pi has wrapped around 2 pi
+static bool phase_wrapped(double mu, double mu_prev) { return mu < mu_prev - M_PI; }
 
-#ifdef TIMEIT
-  start = std::chrono::steady_clock::now();
-#endif
+static void twiss_plane(const double (&b)[6], double beta0, double alpha0, const Vector& eta0, double& beta, double& alpha, double& mu, Vector& eta) {
+  const double c = b[0] * beta0 - b[1] * alpha0;
+  const double s = b[2] * beta0 - b[3] * alpha0;
+  beta  = (c * c + b[1] * b[1]) / beta0;
+  alpha = -(c * s + b[1] * b[3]) / beta0;
+  mu    = raw_phase(b, beta0, alpha0);
+  eta[0] = b[4] + b[0] * eta0[0] + b[1] * eta0[1];
+  eta[1] = b[5] + b[2] * eta0[0] + b[3] * eta0[1];
+}
 
-  // propagates fixed point to find closed orbit
-  Pos<double> fp = fixed_point;
-  std::vector<Pos<double>> closed_orbit;
-  Plane::type lost_plane;
-  unsigned int element_offset = 0;
-  Status::type status = track_linepass(accelerator, fp, closed_orbit, element_offset, lost_plane, true);
-  if (status != Status::success) return status;
-  if (not closed_flag) closed_orbit.pop_back();
-
-  // std::vector<Pos<double>> closed_orbit0;
-  // if (not accelerator.cavity_on) {
-  //   Pos<double> fp = fixed_point; fp.de = 0;
-  //   Status::type status = track_linepass(accelerator, fp, closed_orbit0, element_offset, lost_plane, true);
-  //   if (status != Status::success) return status;
-  // }
-
-#ifdef TIMEIT
-  end = std::chrono::steady_clock::now(); diff = end - start;
-  std::cout << "calc_twiss::close_orbit: " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
-#endif
-
-#ifdef TIMEIT
-  start = std::chrono::steady_clock::now();
-#endif
-
-  // finds accumulated transfer matrices
-
-  // std::vector<Matrix> atm0;
-  // if (not accelerator.cavity_on) {
-  //   status = track_findm66 (accelerator, closed_orbit0, atm0, m66);
-  //   if (status != Status::success) return status;
-  //   if (closed_flag) atm.push_back(atm.back());
-  // }
-
-  std::vector<Matrix> atm;
-  Pos<double> v0;
-  status = track_findm66 (accelerator, closed_orbit, atm, m66, v0);
+// optical functions at the end of a line with transfer blocks 'b' (accumulated from its start),
+// in closed form from those at its start 'tw0'. phases are raw, in [0, 2 pi), and do not include
+// the phases of 'tw0'. orbit and position of 'tw' are left as they are.
+static void twiss_from_blocks(const Twiss& tw0, const TwissBlocks& b, Twiss& tw) {
+  twiss_plane(b.x, tw0.betax, tw0.alphax, tw0.etax, tw.betax, tw.alphax, tw.mux, tw.etax);
+  twiss_plane(b.y, tw0.betay, tw0.alphay, tw0.etay, tw.betay, tw.alphay, tw.muy, tw.etay);
+}
+
+// twiss of a periodic solution from accumulated blocks, in chunks that are independent tasks.
+// phases are unwrapped as a parallel prefix: a first stage evaluates the closed forms and counts
+// the phase wraps of each chunk, and a second stage adds the wraps of all preceding chunks.
+static const unsigned int twiss_chunk_size = 1024;
+
+struct TwissChunks {
+  std::vector<Twiss>*              twiss;
+  const std::vector<TwissBlocks>*  blocks;   // blocks[i-1] is accumulated up to the entrance of twiss[i]
+  std::vector<unsigned int>        wrapsx, wrapsy;
+
+  unsigned int nr_chunks() const { return (twiss->size() - 1 + twiss_chunk_size - 1) / twiss_chunk_size; }
+
+  // raw phases at twiss[i]
+  void phases(unsigned int i, double& mux, double& muy) const {
+    const Twiss& tw0 = (*twiss)[0];
+    if (i == 0) { mux = muy = 0; return; }
+    mux = raw_phase((*blocks)[i-1].x, tw0.betax, tw0.alphax);
+    muy = raw_phase((*blocks)[i-1].y, tw0.betay, tw0.alphay);
+  }
+
+  void evaluate(unsigned int chunk) {
+    const unsigned int first = 1 + chunk * twiss_chunk_size;
+    const unsigned int last = std::min<unsigned int>(first + twiss_chunk_size, twiss->size());
+    std::vector<Twiss>& tw = *twiss;
+    double mux, muy;
+    phases(first-1, mux, muy);
+    wrapsx[chunk] = wrapsy[chunk] = 0;
+    for(unsigned int i=first; i<last; ++i) {
+      twiss_from_blocks(tw[0], (*blocks)[i-1], tw[i]);
+      if (phase_wrapped(tw[i].mux, mux)) wrapsx[chunk]++;
+      if (phase_wrapped(tw[i].muy, muy)) wrapsy[chunk]++;
+      mux = tw[i].mux; muy = tw[i].muy;
+    }
+  }
+
+  void unwrap(unsigned int chunk) {
+    const unsigned int first = 1 + chunk * twiss_chunk_size;
+    const unsigned int last = std::min<unsigned int>(first + twiss_chunk_size, twiss->size());
+    std::vector<Twiss>& tw = *twiss;
+    unsigned int nx = 0, ny = 0;
+    for(unsigned int c=0; c<chunk; ++c) { nx += wrapsx[c]; ny += wrapsy[c]; }
+    double mux, muy;
+    phases(first-1, mux, muy);
+    for(unsigned int i=first; i<last; ++i) {
+      const double rawx = tw[i].mux, rawy = tw[i].muy;
+      if (phase_wrapped(rawx, mux)) nx++;
+      if (phase_wrapped(rawy, muy)) ny++;
+      tw[i].mux = tw[0].mux + rawx + 2*M_PI*nx;
+      tw[i].muy = tw[0].muy + rawy + 2*M_PI*ny;
+      mux = rawx; muy = rawy;
+    }
+  }
+};
+
+static void twiss_from_accumulated_blocks(std::vector<Twiss>& twiss, const std::vector<TwissBlocks>& blocks, unsigned int nr_threads) {
+
+  TwissChunks chunks;
+  chunks.twiss = &twiss;
+  chunks.blocks = &blocks;
+  const unsigned int nr_chunks = chunks.nr_chunks();
+  chunks.wrapsx.resize(nr_chunks); chunks.wrapsy.resize(nr_chunks);
+
+  if ((nr_threads <= 1) or (nr_chunks <= 1)) {
+    for(unsigned int c=0; c<nr_chunks; ++c) chunks.evaluate(c);
+    for(unsigned int c=0; c<nr_chunks; ++c) chunks.unwrap(c);
+    return;
+  }
+
+  run_parallel_tasks(nr_chunks, std::min(nr_threads, nr_chunks), [&chunks](long chunk) { chunks.evaluate(chunk); });
+  run_parallel_tasks(nr_chunks, std::min(nr_threads, nr_chunks), [&chunks](long chunk) { chunks.unwrap(chunk); });
+
+}
+
+// tracks the first-order map of 'element' around the orbit 'co' at its entrance, restarting it
+// from the identity, so that the element matrix comes out directly in 'm'. 'co' is advanced to
+// the exit of the element and checked for losses as in 'track_linepass'. the map along
+// multipoles and bends is passed to 'observer'.
+template <typename O = KickObserver>
+static Status::type track_element_matrix(const Element& element, const Accelerator& accelerator, Pos<double>& co, double (&m)[6][6], O observer = O()) {
+
+  Pos<Tpsa<6,1>> map;
+  map.rx = Tpsa<6,1>(co.rx, 0); map.px = Tpsa<6,1>(co.px, 1);
+  map.ry = Tpsa<6,1>(co.ry, 2); map.py = Tpsa<6,1>(co.py, 3);
+  map.de = Tpsa<6,1>(co.de, 4); map.dl = Tpsa<6,1>(co.dl, 5);
+  Status::type status;
+  if (element.pass_method == PassMethod::pm_bnd_mpole_symplectic4_pass) {
+    status = bnd_mpole_symplectic4_pass(map, element, element.polynom_a, element.polynom_b, accelerator, observer);
+  } else if (element.pass_method == PassMethod::pm_str_mpole_symplectic4_pass) {
+    status = str_mpole_symplectic4_pass(map, element, element.polynom_a, element.polynom_b, accelerator, observer);
+  } else {
+    status = track_elementpass(element, map, accelerator);
+  }
+  co.rx = map.rx.c[0]; co.px = map.px.c[0];
+  co.ry = map.ry.c[0]; co.py = map.py.c[0];
+  co.de = map.de.c[0]; co.dl = map.dl.c[0];
+
+  if ((not std::isfinite(co.rx)) or ((accelerator.vchamber_on) and ((co.rx < element.hmin) or (co.rx > element.hmax))) or
+      (not std::isfinite(co.ry)) or ((accelerator.vchamber_on) and ((co.ry < element.vmin) or (co.ry > element.vmax)))) {
+    return (status == Status::success) ? Status::particle_lost : status;
+  }
   if (status != Status::success) return status;
-  if (closed_flag) atm.push_back(atm.back());
-
-
-
-#ifdef TIMEIT
-  end = std::chrono::steady_clock::now(); diff = end - start;
-  std::cout << "calc_twiss::findm66: " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
-#endif
-
-#ifdef TIMEIT
-  start = std::chrono::steady_clock::now();
-#endif
-
-  // initial twiss parameters
-  twiss.clear(); twiss.reserve(atm.size());
-  if (twiss0.isundef()) { // case of periodic solution
-    twiss0.spos = 0.0;
-    // --- beta functions
-    double sin_mux = sgn(m66[0][1]) * std::sqrt(-m66[0][1]*m66[1][0]-pow(m66[0][0]-m66[1][1],2)/4.0);
-    double sin_muy = sgn(m66[2][3]) * std::sqrt(-m66[2][3]*m66[3][2]-pow(m66[2][2]-m66[3][3],2)/4.0);
-    twiss0.alphax = (m66[0][0]-m66[1][1])/2.0/sin_mux;
-    twiss0.alphay = (m66[2][2]-m66[3][3])/2.0/sin_muy;
-    twiss0.betax  =  m66[0][1]/sin_mux;
-    twiss0.betay  =  m66[2][3]/sin_muy;
-    // --- closed orbit
-    twiss0.co = closed_orbit[0];
-    // --- dispersion function based on eta = (1 - M)^(-1) D
-    Vector Dx({m66[0][4], m66[1][4]});
-    Vector Dy({m66[2][4], m66[3][4]});
-    Matrix eye2({{1,0},{0,1}});
-    Matrix mx; m66.getM(mx, 2, 2, 0, 0); mx.linear_combination(1.0,eye2,-1.0,mx); mx.inverse();
-    Matrix my; m66.getM(my, 2, 2, 2, 2); my.linear_combination(1.0,eye2,-1.0,my); my.inverse();
-    twiss0.etax.multiplication(mx, Dx);
-    twiss0.etay.multiplication(my, Dy);
+
+  for(unsigned int j=0; j<6; ++j) {
+    m[0][j] = map.rx.c[j+1]; m[1][j] = map.px.c[j+1]; m[2][j] = map.ry.c[j+1];
+    m[3][j] = map.py.c[j+1]; m[4][j] = map.de.c[j+1]; m[5][j] = map.dl.c[j+1];
   }
-  twiss.push_back(twiss0);
+  return Status::success;
+
+}
+
+// r = a * b, for 6x6 matrices (r may not alias a or b)
+static void multiply_m66(const double (&a)[6][6], const double (&b)[6][6], double (&r)[6][6]) {
+  for(unsigned int i=0; i<6; ++i) {
+    for(unsigned int j=0; j<6; ++j) {
+      double v = 0;
+      for(unsigned int k=0; k<6; ++k) v += a[i][k] * b[k][j];
+      r[i][j] = v;
+    }
+  }
+}
+
+// tracks the element matrices of the whole lattice along the orbit that starts at
+// 'fixed_point', with no inversions. 'element_matrix' is called with the index of each
+// element, the orbit at its exit, its matrix and the accumulated matrix up to its exit.
+// 'm66' is the product of all of them.
+static Status::type track_element_matrices(const Accelerator& accelerator, const Pos<double>& fixed_point, double (&m66)[6][6],
+                                           const std::function<void(unsigned int, const Pos<double>&, const double (&)[6][6], const double (&)[6][6])>& element_matrix) {
 
-#ifdef TIMEIT
-  end = std::chrono::steady_clock::now(); diff = end - start;
-  std::cout << "calc_twiss::twiss0: " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
-#endif
+  const std::vector<Element>& lattice = accelerator.lattice;
 
+  Pos<double> co = fixed_point;
+  double m[6][6], t[6][6];
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m66[i][j] = (i == j) ? 1 : 0;
 
-#ifdef TIMEIT
-  start = std::chrono::steady_clock::now();
-#endif
+  for(unsigned int i=0; i<lattice.size(); ++i) {
+    Status::type status = track_element_matrix(lattice[i], accelerator, co, m);
+    if (status != Status::success) return status;
+    multiply_m66(m, m66, t);
+    std::memcpy(m66, t, sizeof(t));
+    element_matrix(i, co, m, m66);
+  }
+
+  return Status::success;
+
+}
+
+// optical functions (phases are set to zero) of the periodic solution of the one-turn matrix 'm'
+static void periodic_twiss(const double (&m)[6][6], Twiss& tw0) {
+  // --- beta functions
+  double sin_mux = sgn(m[0][1]) * std::sqrt(-m[0][1]*m[1][0]-pow(m[0][0]-m[1][1],2)/4.0);
+  double sin_muy = sgn(m[2][3]) * std::sqrt(-m[2][3]*m[3][2]-pow(m[2][2]-m[3][3],2)/4.0);
+  tw0.alphax = (m[0][0]-m[1][1])/2.0/sin_mux;
+  tw0.alphay = (m[2][2]-m[3][3])/2.0/sin_muy;
+  tw0.betax  =  m[0][1]/sin_mux;
+  tw0.betay  =  m[2][3]/sin_muy;
+  tw0.mux = tw0.muy = 0;
+  // --- dispersion function based on eta = (1 - M)^(-1) D
+  const double detx = (1-m[0][0])*(1-m[1][1]) - m[0][1]*m[1][0];
+  const double dety = (1-m[2][2])*(1-m[3][3]) - m[2][3]*m[3][2];
+  tw0.etax = Vector({((1-m[1][1])*m[0][4] + m[0][1]*m[1][4])/detx, (m[1][0]*m[0][4] + (1-m[0][0])*m[1][4])/detx});
+  tw0.etay = Vector({((1-m[3][3])*m[2][4] + m[2][3]*m[3][4])/dety, (m[3][2]*m[2][4] + (1-m[2][2])*m[3][4])/dety});
+}
+
+// calc_twiss
+// ----------
+// twiss parameters at the entrance of every element (and at the end of the lattice, if
+// 'closed_flag') from a single propagation of element matrices along the orbit that starts at
+// 'fixed_point'. each entry is evaluated in closed form from the accumulated matrix up to it.
+// with 'twiss0' given, entries are emitted as the map is tracked; otherwise the periodic
+// solution is used, the uncoupled blocks of the accumulated matrices are kept until the one-turn
+// matrix is known and the entries are then evaluated in chunks by 'nr_threads' threads.
+// 'm66' is the transfer matrix of the whole lattice.
+Status::type calc_twiss(const Accelerator& accelerator, const Pos<double>& fixed_point, Matrix& m66, std::vector<Twiss>& twiss, Twiss twiss0, bool closed_flag, unsigned int nr_threads) {
+
+  const std::vector<Element>& lattice = accelerator.lattice;
+  const unsigned int nr_twiss = closed_flag ? lattice.size() + 1 : lattice.size();
+  const bool periodic = twiss0.isundef();
 
-  for(unsigned int i=1; i<atm.size(); ++i) {
+  Status::type status;
+  double m[6][6];
+  std::vector<TwissBlocks> blocks;
+  double mux = 0, muy = 0;
+  unsigned int nx = 0, ny = 0;
 
-    const Matrix& tm = atm[i];
+  twiss.clear();
+  twiss.reserve(nr_twiss);
+  if (periodic) {
+    blocks.reserve(nr_twiss - 1);
+    twiss0 = Twiss();
+    twiss0.co = fixed_point;
+  }
+  twiss.push_back(twiss0);
+
+  status = track_element_matrices(accelerator, fixed_point, m, [&](unsigned int i, const Pos<double>& co, const double (&)[6][6], const double (&acc)[6][6]) {
+    if (twiss.size() == nr_twiss) return;
     Twiss tw;
-    tw.spos = twiss.back().spos + accelerator.lattice[i-1].length;
-    // --- beta functions
-    tw.betax = (std::pow(tm[0][0] * twiss0.betax - tm[0][1] * twiss0.alphax, 2) + pow(tm[0][1], 2)) / twiss0.betax;
-    tw.betay = (std::pow(tm[2][2] * twiss0.betay - tm[2][3] * twiss0.alphay, 2) + pow(tm[2][3], 2)) / twiss0.betay;
-    tw.alphax = -((tm[0][0] * twiss0.betax - tm[0][1] * twiss0.alphax) * (tm[1][0] * twiss0.betax - tm[1][1] * twiss0.alphax) + tm[0][1]*tm[1][1])/twiss0.betax;
-    tw.alphay = -((tm[2][2] * twiss0.betay - tm[2][3] * twiss0.alphay) * (tm[3][2] * twiss0.betay - tm[3][3] * twiss0.alphay) + tm[2][3]*tm[3][3])/twiss0.betay;
-    tw.mux = std::atan(tm[0][1]/(tm[0][0] * twiss0.betax - tm[0][1] * twiss0.alphax));
-    tw.muy = std::atan(tm[2][3]/(tm[2][2] * twiss0.betay - tm[2][3] * twiss0.alphay));
-
-    // --- closed orbit
-    tw.co = closed_orbit[i];
-
-    // --- dispersion function
-    Matrix t1(atm[i-1]); t1.inverse();
-    Matrix T; T.multiplication(atm[i],t1);
-    Vector Dx({T[0][4], T[1][4]});
-    Vector Dy({T[2][4], T[3][4]});
-    Matrix mx; T.getMx(mx);
-    Matrix my; T.getMy(my);
-    tw.etax.multiplication(mx, twiss[i-1].etax);
-    tw.etay.multiplication(my, twiss[i-1].etay);
-    tw.etax = Dx + tw.etax.multiplication(mx, twiss[i-1].etax);
-    tw.etay = Dy + tw.etay.multiplication(my, twiss[i-1].etay);
+    tw.spos = twiss.back().spos + lattice[i].length;
+    tw.co = co;
+    if (periodic) {
+      blocks.push_back(TwissBlocks(acc));
+    } else {
+      twiss_from_blocks(twiss0, TwissBlocks(acc), tw);
+      if (phase_wrapped(tw.mux, mux)) nx++;
+      if (phase_wrapped(tw.muy, muy)) ny++;
+      mux = tw.mux; muy = tw.muy;
+      tw.mux = twiss0.mux + mux + 2*M_PI*nx;
+      tw.muy = twiss0.muy + muy + 2*M_PI*ny;
+    }
+    twiss.push_back(tw);
+  });
+  if (status != Status::success) return status;
+
+  m66 = Matrix(6);
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m66[i][j] = m[i][j];
+
+  if (periodic) {
+    periodic_twiss(m, twiss[0]);
+    twiss_from_accumulated_blocks(twiss, blocks, nr_threads);
+  }
+
+  return Status::success;
+}
+
+
+// calc_twiss_offmomentum
+// ----------------------
+// closed orbits, one-turn matrices, tunes and twiss for a list of energy deviations. the list is
+// split into contiguous blocks, one task each, run by 'nr_threads' threads. within a block, the
+// 4D closed orbit of each energy deviation is searched starting from the orbit extrapolated from
+// its neighbours. deviations whose orbit or optics cannot be found get empty twiss and nan
+// tunes, and the status of the first of them is returned.
+
+struct OffMomentumScan {
+  const Accelerator*                accelerator;
+  const std::vector<double>*        energy_offsets;
+  std::vector<std::vector<Twiss> >* twiss;
+  std::vector<Matrix>*              m66;
+  std::vector<double>*              tunex;
+  std::vector<double>*              tuney;
+  std::vector<Status::type>         status;
+  unsigned int                      nr_blocks;
+
+  void run_block(unsigned int block) {
+    const unsigned int n = energy_offsets->size();
+    const unsigned int first = (block * n) / nr_blocks, last = ((block+1) * n) / nr_blocks;
+    const std::vector<double>& dp = *energy_offsets;
+    std::vector<Pos<double> > closed_orbit;
+    Pos<double> guess(0);
+    int prev = -1, prev2 = -1;   // last orbits found in the block
+    for(unsigned int k=first; k<last; ++k) {
+      if ((prev >= 0) and (prev2 >= 0) and (dp[prev] != dp[prev2])) {
+        const Pos<double>& p1 = (*twiss)[prev][0].co;
+        const Pos<double>& p2 = (*twiss)[prev2][0].co;
+        guess = p1 + (p1 - p2) * ((dp[k] - dp[prev]) / (dp[prev] - dp[prev2]));
+      } else if (prev >= 0) {
+        guess = (*twiss)[prev][0].co;
+      }
+      guess.de = dp[k];
+      (*tunex)[k] = (*tuney)[k] = nan("");
+      if ((status[k] = track_findorbit4(*accelerator, closed_orbit, guess)) != Status::success) continue;
+      std::vector<Twiss>& tw = (*twiss)[k];
+      if ((status[k] = calc_twiss(*accelerator, closed_orbit[0], (*m66)[k], tw, Twiss(), true)) != Status::success) { tw.clear(); continue; }
+      // tunes from the phases at the end of the lattice, which is then dropped as in 'calc_twiss'
+      (*tunex)[k] = tw.back().mux / (2*M_PI);
+      (*tuney)[k] = tw.back().muy / (2*M_PI);
+      tw.pop_back();
+      prev2 = prev; prev = k;
+    }
+  }
+};
+
+Status::type calc_twiss_offmomentum(const Accelerator& accelerator, const std::vector<double>& energy_offsets, std::vector<std::vector<Twiss> >& twiss, std::vector<Matrix>& m66, std::vector<double>& tunex, std::vector<double>& tuney, unsigned int nr_threads) {
+
+  const unsigned int n = energy_offsets.size();
+  twiss.assign(n, std::vector<Twiss>());
+  m66.assign(n, Matrix());
+  tunex.assign(n, nan(""));
+  tuney.assign(n, nan(""));
+
+  OffMomentumScan scan;
+  scan.accelerator = &accelerator;
+  scan.energy_offsets = &energy_offsets;
+  scan.twiss = &twiss; scan.m66 = &m66;
+  scan.tunex = &tunex; scan.tuney = &tuney;
+  scan.status.assign(n, Status::success);
+  scan.nr_blocks = std::max(1u, std::min(nr_threads, n));
+
+  if (scan.nr_blocks <= 1) {
+    scan.run_block(0);
+  } else {
+    run_parallel_tasks(scan.nr_blocks, scan.nr_blocks, [&scan](long block) { scan.run_block(block); });
+  }
+
+  for(auto status : scan.status) if (status != Status::success) return status;
+  return Status::success;
+
+}
+
+
+// calc_tune_series
+// ----------------
+// tunes as power series of the energy deviation from a single pass of a truncated power series
+// map in which the energy deviation is a variable. the map of the transverse deviations from
+// 'fixed_point' is solved order by order for its dispersive fixed point, and the derivatives of
+// the map composed along it give the one-turn matrix, and the tunes, as series of the energy
+// deviation.
+
+// value of 'f' with its variables replaced by the series 'args'
+template <unsigned int V, unsigned int N, typename S>
+static S compose(const Tpsa<V,N>& f, const S (&args)[V]) {
+  S powers[V][N+1];
+  for(unsigned int v=0; v<V; ++v) {
+    powers[v][0] = S(1);
+    for(unsigned int p=1; p<=N; ++p) powers[v][p] = powers[v][p-1] * args[v];
+  }
+  S r;
+  unsigned int power[V];
+  for(unsigned int i=0; i<Tpsa<V,N>::last_at_order(f.get_order()); ++i) {
+    if (f.c[i] == 0) continue;
+    f.get_power(i, power);
+    S term(f.c[i]);
+    for(unsigned int v=0; v<V; ++v) if (power[V-1-v] > 0) term *= powers[v][power[V-1-v]];
+    r += term;
+  }
+  return r;
+}
+
+template <unsigned int K>
+static Status::type tune_series(const Accelerator& accelerator, const Pos<double>& fixed_point, std::vector<double>& tunex, std::vector<double>& tuney) {
+
+  // transverse coordinates (variables 0 to 3) and energy deviation (variable 4), to order K in
+  // the energy deviation and linear in the transverse coordinates
+  typedef Tpsa<5,K+1> T;
+  typedef Tpsa<1,K>   S;
+
+  Pos<T> map;
+  map.rx = T(fixed_point.rx, 0); map.px = T(fixed_point.px, 1);
+  map.ry = T(fixed_point.ry, 2); map.py = T(fixed_point.py, 3);
+  map.de = T(fixed_point.de, 4); map.dl = T(fixed_point.dl);
+  for(const auto& element : accelerator.lattice) {
+    Status::type status = track_elementpass(element, map, accelerator);
+    if ((not std::isfinite(map.rx.c[0])) or (not std::isfinite(map.ry.c[0]))) return (status == Status::success) ? Status::particle_lost : status;
+    if (status != Status::success) return status;
+  }
+  const T g[4] = {map.rx - fixed_point.rx, map.px - fixed_point.px, map.ry - fixed_point.ry, map.py - fixed_point.py};
+
+  // fixed point z(delta) = g(z(delta), delta), order by order: (1 - M) z_k = [g(z_<k, delta)]_k
+  std::vector<Pos<double> > one_minus_m(6, 0);
+  matrix6_set_identity_posvec(one_minus_m);
+  for(unsigned int j=0; j<4; ++j) {
+    one_minus_m[j].rx -= g[0].c[j+1]; one_minus_m[j].px -= g[1].c[j+1];
+    one_minus_m[j].ry -= g[2].c[j+1]; one_minus_m[j].py -= g[3].c[j+1];
+  }
+  S z[5] = {S(0), S(0), S(0), S(0), S(0, 0)};
+  for(unsigned int k=0; k<=K; ++k) {
+    const S r[4] = {compose(g[0], z), compose(g[1], z), compose(g[2], z), compose(g[3], z)};
+    const Pos<double> a = linalg_solve4_posvec(one_minus_m, Pos<double>(r[0].c[k], r[1].c[k], r[2].c[k], r[3].c[k], 0, 0));
+    z[0].set_c(k) += a.rx; z[1].set_c(k) += a.px;
+    z[2].set_c(k) += a.ry; z[3].set_c(k) += a.py;
+  }
+
+  // tune of each plane from the trace of its block of the one-turn matrix around the fixed point
+  auto tune = [&](unsigned int i) {
+    const S m11 = compose(D(g[i], i), z),   m12 = compose(D(g[i], i+1), z);
+    const S m22 = compose(D(g[i+1], i+1), z);
+    const S cos_mu = (m11 + m22) / 2.0;
+    const S sin_mu = ((m12.c[0] < 0) ? -1.0 : 1.0) * sqrt(1 - cos_mu * cos_mu);
+    // phase advance relative to its on-momentum value, which keeps the argument of atan small
+    const double cos0 = cos_mu.c[0], sin0 = sin_mu.c[0];
+    double mu0 = std::atan2(sin0, cos0);
+    if (mu0 < 0) mu0 += 2*M_PI;
+    S mu = mu0 + atan((sin_mu * cos0 - cos_mu * sin0) / (cos_mu * cos0 + sin_mu * sin0));
+    mu /= 2*M_PI;
+    std::vector<double> series(K+1);
+    for(unsigned int k=0; k<=K; ++k) series[k] = mu.c[k];
+    return series;
+  };
+  tunex = tune(0);
+  tuney = tune(2);
+  return Status::success;
+
+}
+
+Status::type calc_tune_series(const Accelerator& accelerator, const Pos<double>& fixed_point, unsigned int order, std::vector<double>& tunex, std::vector<double>& tuney) {
+  switch (order) {
+  case 1: return tune_series<1>(accelerator, fixed_point, tunex, tuney);
+  case 2: return tune_series<2>(accelerator, fixed_point, tunex, tuney);
+  case 3: return tune_series<3>(accelerator, fixed_point, tunex, tuney);
+  case 4: return tune_series<4>(accelerator, fixed_point, tunex, tuney);
+  default: return Status::not_implemented;
+  }
+}
+
+
+// calc_optics_jacobian
+// --------------------
+// the knobs are variables of the maps of their elements, which are tracked to second order in the
+// coordinates around the orbit. in the same pass, the derivatives of the orbit and of the
+// accumulated matrix are propagated with respect to each knob, and with respect to each coordinate
+// of the initial orbit, from which the change of the periodic orbit with the knob is solved at the
+// end and added. derivatives of the twiss are then taken from those of the accumulated matrices by
+// central differences of the closed forms, which need no further tracking.
+
+// tracks 'map' through 'element' with the parameter of 'knob' shifted by the variable 6 of 'map'
+template <typename T>
+static Status::type track_knob_elementpass(const Element& element, const OpticsKnob& knob, Pos<T>& map, const Accelerator& accelerator) {
+
+  const T variable(0, 6);
+  switch (element.pass_method) {
+  case PassMethod::pm_str_mpole_symplectic4_pass:
+  case PassMethod::pm_bnd_mpole_symplectic4_pass: {
+    if ((knob.parameter != OpticsKnob::polynom_a) and (knob.parameter != OpticsKnob::polynom_b)) break;
+    // the kicks use the entries that both polynoms have
+    const unsigned int n = std::min(element.polynom_a.size(), element.polynom_b.size());
+    std::vector<T> polynom_a(std::max(n, knob.n + 1), T(0)), polynom_b(polynom_a);
+    for(unsigned int i=0; i<n; ++i) { polynom_a[i] = T(element.polynom_a[i]); polynom_b[i] = T(element.polynom_b[i]); }
+    ((knob.parameter == OpticsKnob::polynom_a) ? polynom_a : polynom_b)[knob.n] += variable;
+    if (element.pass_method == PassMethod::pm_str_mpole_symplectic4_pass) {
+      return str_mpole_symplectic4_pass(map, element, polynom_a, polynom_b, accelerator);
+    } else {
+      return bnd_mpole_symplectic4_pass(map, element, polynom_a, polynom_b, accelerator);
+    }
+  }
+  case PassMethod::pm_corrector_pass:
+    if (knob.parameter == OpticsKnob::hkick) return corrector_pass(map, element, element.hkick + variable, T(element.vkick), accelerator);
+    if (knob.parameter == OpticsKnob::vkick) return corrector_pass(map, element, T(element.hkick), element.vkick + variable, accelerator);
+    break;
+  case PassMethod::pm_cavity_pass:
+    if (knob.parameter == OpticsKnob::voltage) return cavity_pass(map, element, element.voltage + variable, accelerator);
+    break;
+  }
+  return Status::passmethod_not_implemented;
+
+}
+
+// derivatives of the map of an element around the orbit at its entrance
+struct ElementDerivatives {
+  double m[6][6];         // first derivatives, m[i][j] = d f_i / d z_j
+  double h[6][6][6];      // second derivatives, h[i][j][k] = d2 f_i / d z_j d z_k
+  double dv[6];           // with respect to the knob: d f_i / d k
+  double dm[6][6];        // and d2 f_i / d k d z_j
+};
+
+// tracks the second-order map of 'element' around the orbit 'co' at its entrance, which is
+// advanced to its exit. with a 'knob', the map type T has its parameter as a seventh variable.
+template <typename T>
+static Status::type track_element_derivatives(const Element& element, const OpticsKnob* knob, const Accelerator& accelerator, Pos<double>& co, ElementDerivatives& d) {
+
+  Pos<T> map;
+  map.rx = T(co.rx, 0); map.px = T(co.px, 1);
+  map.ry = T(co.ry, 2); map.py = T(co.py, 3);
+  map.de = T(co.de, 4); map.dl = T(co.dl, 5);
+  Status::type status = (knob != nullptr) ? track_knob_elementpass(element, *knob, map, accelerator) : track_elementpass(element, map, accelerator);
+  co.rx = map.rx.c[0]; co.px = map.px.c[0];
+  co.ry = map.ry.c[0]; co.py = map.py.c[0];
+  co.de = map.de.c[0]; co.dl = map.dl.c[0];
+
+  if ((not std::isfinite(co.rx)) or ((accelerator.vchamber_on) and ((co.rx < element.hmin) or (co.rx > element.hmax))) or
+      (not std::isfinite(co.ry)) or ((accelerator.vchamber_on) and ((co.ry < element.vmin) or (co.ry > element.vmax)))) {
+    return (status == Status::success) ? Status::particle_lost : status;
+  }
+  if (status != Status::success) return status;
+
+  const T* f[6] = {&map.rx, &map.px, &map.ry, &map.py, &map.de, &map.dl};
+  for(unsigned int i=0; i<6; ++i) {
+    for(unsigned int j=0; j<6; ++j) {
+      d.m[i][j] = f[i]->c[j+1];
+      const T dfj = D(*f[i], j);
+      for(unsigned int k=0; k<6; ++k) d.h[i][j][k] = dfj.c[k+1];
+    }
+    if (knob == nullptr) continue;
+    d.dv[i] = f[i]->c[7];
+    const T dfk = D(*f[i], 6);
+    for(unsigned int j=0; j<6; ++j) d.dm[i][j] = dfk.c[j+1];
+  }
+  return Status::success;
+
+}
+
+// derivatives of the orbit and of the accumulated matrix along one direction
+struct OpticsDerivative {
+  double dz[6];
+  double dm[6][6];
+  bool   active;   // whether it may be nonzero
+};
+
+// twiss (with raw phases) at the end of the accumulated matrix 'm' of the periodic solution of
+// the one-turn matrix 'm1', and the raw phases of the one-turn matrix
+static void periodic_twiss_at(const double (&m1)[6][6], const double (&m)[6][6], Twiss& tw, double& mux1, double& muy1) {
+  Twiss tw0;
+  periodic_twiss(m1, tw0);
+  twiss_from_blocks(tw0, TwissBlocks(m), tw);
+  const TwissBlocks b1(m1);
+  mux1 = raw_phase(b1.x, tw0.betax, tw0.alphax);
+  muy1 = raw_phase(b1.y, tw0.betay, tw0.alphay);
+}
+
+// difference of two raw phases, across the wrap around 2 pi
+static double phase_difference(double mu1, double mu2) {
+  double d = mu1 - mu2;
+  if (d > M_PI) d -= 2*M_PI;
+  if (d < -M_PI) d += 2*M_PI;
+  return d;
+}
+
+Status::type calc_optics_jacobian(const Accelerator& accelerator, const Pos<double>& fixed_point, const std::vector<OpticsKnob>& knobs, const std::vector<unsigned int>& elements, std::vector<Twiss>& twiss, std::vector<std::vector<Twiss> >& jacobian, std::vector<double>& dtunex, std::vector<double>& dtuney) {
+
+  const std::vector<Element>& lattice = accelerator.lattice;
+  const unsigned int nr_coords = accelerator.cavity_on ? 6 : 4;   // coordinates of the periodic orbit
+  const unsigned int nr_directions = nr_coords + knobs.size();
+
+  std::vector<std::vector<unsigned int> > element_knobs(lattice.size());
+  for(unsigned int k=0; k<knobs.size(); ++k) {
+    for(const auto& e : knobs[k].elements) {
+      if (e >= lattice.size()) return Status::inconsistent_dimensions;
+      element_knobs[e].push_back(k);
+    }
+  }
+  std::vector<std::vector<unsigned int> > observations(lattice.size() + 1);
+  for(unsigned int i=0; i<elements.size(); ++i) {
+    if (elements[i] > lattice.size()) return Status::inconsistent_dimensions;
+    observations[elements[i]].push_back(i);
+  }
+
+  // state at the entrance of the observed elements
+  struct Observation {
+    double spos;
+    Pos<double> co;
+    double m[6][6];
+    std::vector<OpticsDerivative> derivatives;
+  };
+  std::vector<Observation> observed(elements.size());
+
+  std::vector<OpticsDerivative> derivatives(nr_directions);
+  for(unsigned int d=0; d<nr_directions; ++d) {
+    OpticsDerivative& der = derivatives[d];
+    std::memset(der.dz, 0, sizeof(der.dz)); std::memset(der.dm, 0, sizeof(der.dm));
+    der.active = (d < nr_coords);
+    if (der.active) der.dz[d] = 1;
+  }
+
+  Pos<double> co = fixed_point;
+  double m[6][6], t[6][6], hz[6][6];
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m[i][j] = (i == j) ? 1 : 0;
+  double spos = 0;
+  ElementDerivatives ed;
+  std::vector<ElementDerivatives> knob_ed;
+
+  for(unsigned int e=0; e<=lattice.size(); ++e) {
+
+    for(const auto& i : observations[e]) {
+      observed[i].spos = spos;
+      observed[i].co = co;
+      std::memcpy(observed[i].m, m, sizeof(m));
+      observed[i].derivatives = derivatives;
+    }
+    if (e == lattice.size()) break;
+
+    const Pos<double> co0 = co;
+    Status::type status;
+    if (element_knobs[e].empty()) {
+      status = track_element_derivatives<Tpsa<6,2> >(lattice[e], nullptr, accelerator, co, ed);
+    } else {
+      knob_ed.resize(element_knobs[e].size());
+      for(unsigned int k=0; k<element_knobs[e].size(); ++k) {
+        co = co0;
+        status = track_element_derivatives<Tpsa<7,2> >(lattice[e], &knobs[element_knobs[e][k]], accelerator, co, knob_ed[k]);
+        if (status != Status::success) return status;
+      }
+      std::memcpy(ed.m, knob_ed[0].m, sizeof(ed.m)); std::memcpy(ed.h, knob_ed[0].h, sizeof(ed.h));
+    }
+    if (status != Status::success) return status;
+
+    // dz' = M dz + dv, dm' = M dm + (H dz) m + dM m
+    for(unsigned int d=0; d<nr_directions; ++d) {
+      OpticsDerivative& der = derivatives[d];
+      if (not der.active) continue;
+      multiply_m66(ed.m, der.dm, t);
+      bool orbit_changed = false;
+      for(unsigned int j=0; j<6; ++j) orbit_changed = orbit_changed or (der.dz[j] != 0);
+      if (orbit_changed) {
+        for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) {
+          double v = 0;
+          for(unsigned int k=0; k<6; ++k) v += ed.h[i][j][k] * der.dz[k];
+          hz[i][j] = v;
+        }
+        multiply_m66(hz, m, der.dm);
+        for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) der.dm[i][j] += t[i][j];
+      } else {
+        std::memcpy(der.dm, t, sizeof(t));
+      }
+      double dz[6];
+      for(unsigned int i=0; i<6; ++i) {
+        double v = 0;
+        for(unsigned int j=0; j<6; ++j) v += ed.m[i][j] * der.dz[j];
+        dz[i] = v;
+      }
+      std::memcpy(der.dz, dz, sizeof(dz));
+    }
+    for(unsigned int k=0; k<element_knobs[e].size(); ++k) {
+      OpticsDerivative& der = derivatives[nr_coords + element_knobs[e][k]];
+      multiply_m66(knob_ed[k].dm, m, t);
+      for(unsigned int i=0; i<6; ++i) {
+        der.dz[i] += knob_ed[k].dv[i];
+        for(unsigned int j=0; j<6; ++j) der.dm[i][j] += t[i][j];
+      }
+      der.active = true;
+    }
+
+    multiply_m66(ed.m, m, t);
+    std::memcpy(m, t, sizeof(t));
+    spos += lattice[e].length;
+
+  }
+
+  // change of the periodic orbit with each knob, (1 - M) dz0 = dz
+  std::vector<Pos<double> > one_minus_m(6, 0);
+  matrix6_set_identity_posvec(one_minus_m);
+  for(unsigned int j=0; j<nr_coords; ++j) {
+    one_minus_m[j].rx -= m[0][j]; one_minus_m[j].px -= m[1][j];
+    one_minus_m[j].ry -= m[2][j]; one_minus_m[j].py -= m[3][j];
+    one_minus_m[j].de -= m[4][j]; one_minus_m[j].dl -= m[5][j];
+  }
+  std::vector<std::vector<double> > dz0(knobs.size(), std::vector<double>(6, 0));
+  for(unsigned int k=0; k<knobs.size(); ++k) {
+    const double* dz = derivatives[nr_coords + k].dz;
+    Pos<double> b(dz[0], dz[1], dz[2], dz[3], 0, 0), r;
+    if (nr_coords == 6) {
+      b.de = dz[4]; b.dl = dz[5];
+      r = linalg_solve6_posvec(one_minus_m, b);
+    } else {
+      r = linalg_solve4_posvec(one_minus_m, b);
+    }
+    const double v[6] = {r.rx, r.px, r.ry, r.py, r.de, r.dl};
+    for(unsigned int c=0; c<nr_coords; ++c) dz0[k][c] = v[c];
+  }
+
+  // total derivative along knob k, including that of the periodic orbit
+  auto total = [&](const std::vector<OpticsDerivative>& der, unsigned int k, double (&dz)[6], double (&dm)[6][6]) {
+    const OpticsDerivative& dk = der[nr_coords + k];
+    std::memcpy(dz, dk.dz, sizeof(dz)); std::memcpy(dm, dk.dm, sizeof(dm));
+    for(unsigned int c=0; c<nr_coords; ++c) {
+      const double f = dz0[k][c];
+      if (f == 0) continue;
+      for(unsigned int i=0; i<6; ++i) {
+        dz[i] += f * der[c].dz[i];
+        for(unsigned int j=0; j<6; ++j) dm[i][j] += f * der[c].dm[i][j];
+      }
+    }
+  };
+
+  twiss.resize(elements.size());
+  jacobian.assign(knobs.size(), std::vector<Twiss>(elements.size()));
+  dtunex.resize(knobs.size()); dtuney.resize(knobs.size());
+  double mux1, muy1;
+  for(unsigned int i=0; i<elements.size(); ++i) {
+    periodic_twiss_at(m, observed[i].m, twiss[i], mux1, muy1);
+    twiss[i].spos = observed[i].spos;
+    twiss[i].co = observed[i].co;
+  }
+
+  double dm1[6][6], dz[6], dm[6][6];
+  double mp[6][6], mm[6][6], m1p[6][6], m1m[6][6];
+  Twiss twp, twm;
+  double muxp, muyp, muxm, muym;
+  for(unsigned int k=0; k<knobs.size(); ++k) {
+    total(derivatives, k, dz, dm1);
+    for(unsigned int i=0; i<=elements.size(); ++i) {
+      // the last pass is for the tunes, with the accumulated matrix of the whole lattice
+      const bool tunes = (i == elements.size());
+      if (tunes) {
+        std::memcpy(dm, dm1, sizeof(dm)); std::memcpy(mp, m, sizeof(m)); std::memset(dz, 0, sizeof(dz));
+      } else {
+        total(observed[i].derivatives, k, dz, dm); std::memcpy(mp, observed[i].m, sizeof(mp));
+      }
+      double scale = 0;
+      for(unsigned int r=0; r<6; ++r) for(unsigned int c=0; c<6; ++c) scale = std::max(scale, std::max(std::fabs(dm[r][c]), std::fabs(dm1[r][c])));
+      const double h = (scale > 0) ? 1e-6 / scale : 1;
+      std::memcpy(mm, mp, sizeof(mm));
+      for(unsigned int r=0; r<6; ++r) for(unsigned int c=0; c<6; ++c) {
+        mp[r][c] += h * dm[r][c];  mm[r][c] -= h * dm[r][c];
+        m1p[r][c] = m[r][c] + h * dm1[r][c];  m1m[r][c] = m[r][c] - h * dm1[r][c];
+      }
+      periodic_twiss_at(m1p, mp, twp, muxp, muyp);
+      periodic_twiss_at(m1m, mm, twm, muxm, muym);
+      if (tunes) {
+        dtunex[k] = phase_difference(muxp, muxm) / (2*h) / (2*M_PI);
+        dtuney[k] = phase_difference(muyp, muym) / (2*h) / (2*M_PI);
+        continue;
+      }
+      Twiss& jac = jacobian[k][i];
+      jac.spos   = 0;
+      jac.co     = Pos<double>(dz[0], dz[1], dz[2], dz[3], dz[4], dz[5]);
+      jac.betax  = (twp.betax - twm.betax) / (2*h);    jac.betay  = (twp.betay - twm.betay) / (2*h);
+      jac.alphax = (twp.alphax - twm.alphax) / (2*h);  jac.alphay = (twp.alphay - twm.alphay) / (2*h);
+      jac.mux    = phase_difference(twp.mux, twm.mux) / (2*h);
+      jac.muy    = phase_difference(twp.muy, twm.muy) / (2*h);
+      for(unsigned int j=0; j<2; ++j) {
+        jac.etax[j] = (twp.etax[j] - twm.etax[j]) / (2*h);
+        jac.etay[j] = (twp.etay[j] - twm.etay[j]) / (2*h);
+      }
+    }
+  }
+
+  return Status::success;
+
+}
+
+
+// calc_orbit_response_matrix
+// --------------------------
+// the analytic mode evaluates the fixed-energy response of the periodic orbit to thin kicks,
+//   dx_i / dtheta_j = sqrt(beta_i beta_j) cos(|mu_i - mu_j| - pi nu) / (2 sin(pi nu)),
+// with the optics of a single 'calc_twiss' and those of each corrector at its middle, propagated
+// from its entrance through its first half (averaging the entrance and exit optics of 10 cm long
+// correctors is off by about 1e-3 of the largest response). the
+// tracking mode finds the closed orbit (6D if the cavity is on, otherwise 4D) with each corrector
+// kicked by +kick/2 and -kick/2, starting from the unperturbed orbit. correctors are split into
+// contiguous blocks, one task each, each with its own copy of the accelerator to kick.
+
+static Status::type track_findorbit(const Accelerator& accelerator, std::vector<Pos<double> >& closed_orbit, const Pos<double>& fixed_point_guess) {
+  if (accelerator.cavity_on) return track_findorbit6(accelerator, closed_orbit, fixed_point_guess);
+  return track_findorbit4(accelerator, closed_orbit, fixed_point_guess);
+}
+
+// corrector elements and thick multipoles, whose dipolar terms can be kicked
+static bool is_corrector(const Element& element) {
+  switch (element.pass_method) {
+  case PassMethod::pm_corrector_pass:
+    return true;
+  case PassMethod::pm_str_mpole_symplectic4_pass:
+  case PassMethod::pm_bnd_mpole_symplectic4_pass:
+    return element.length != 0;
+  }
+  return false;
+}
+
+// adds a kick of 'kick' [rad] in the plane of 'horizontal' to a corrector or a multipole
+static Status::type add_corrector_kick(Element& element, bool horizontal, double kick) {
+  if (not is_corrector(element)) return Status::passmethod_not_implemented;
+  if (element.pass_method == PassMethod::pm_corrector_pass) {
+    (horizontal ? element.hkick : element.vkick) += kick;
+  } else {
+    // the dipolar terms kick by -length * polynom_b[0] and +length * polynom_a[0]
+    if (element.polynom_a.empty()) element.polynom_a.resize(1, 0);
+    if (element.polynom_b.empty()) element.polynom_b.resize(1, 0);
+    if (horizontal) {
+      element.polynom_b[0] -= kick / element.length;
+    } else {
+      element.polynom_a[0] += kick / element.length;
+    }
+  }
+  return Status::success;
+}
+
+// optics at the middle of 'lattice[idx]', from those at its entrance, 'twiss0'
+static Status::type twiss_at_middle(const Accelerator& accelerator, unsigned int idx, const Twiss& twiss0, Twiss& twiss) {
+  const Element& element = accelerator.lattice[idx];
+  twiss = twiss0;
+  if (element.length == 0) return Status::success;
+  // first half of the element, without its exit edge and transformations, then a marker at its end
+  const Element marker = Element::marker("middle");
+  Element half(element);
+  half.length /= 2; half.angle /= 2;
+  half.angle_out = 0; half.fint_out = 0;
+  half.nr_steps = std::max(1, (half.nr_steps + 1) / 2);
+  std::copy(marker.t_out, marker.t_out+6, half.t_out);
+  std::copy(marker.r_out, marker.r_out+36, half.r_out);
+  Accelerator first_half(accelerator);
+  first_half.lattice.assign(1, half);
+  first_half.lattice.push_back(marker);
+  Matrix m66;
+  std::vector<Twiss> tw;
+  Status::type status = calc_twiss(first_half, twiss0.co, m66, tw, twiss0, false);
+  if (status == Status::success) twiss = tw.back();
+  return status;
+}
+
+struct OrbitResponseScan {
+  const Accelerator*               accelerator;
+  const std::vector<unsigned int>* bpms;
+  const std::vector<unsigned int>* correctors;    // horizontal ones, then vertical ones
+  unsigned int                     nr_hcorrectors;
+  Pos<double>                      fixed_point;   // of the unperturbed lattice
+  double                           kick;
+  std::vector<double>*             respm;
+  std::vector<Status::type>        status;
+  unsigned int                     nr_blocks;
+
+  void run_block(unsigned int block) {
+    const unsigned int n = correctors->size();
+    const unsigned int first = (block * n) / nr_blocks, last = ((block+1) * n) / nr_blocks;
+    const unsigned int nr_bpms = bpms->size();
+    Accelerator kicked(*accelerator);
+    std::vector<Pos<double> > orbitp, orbitm;
+    for(unsigned int j=first; j<last; ++j) {
+      Element& element = kicked.lattice[(*correctors)[j]];
+      const Element original(element);
+      const bool horizontal = (j < nr_hcorrectors);
+      if ((status[j] = add_corrector_kick(element, horizontal, kick/2)) == Status::success) {
+        status[j] = track_findorbit(kicked, orbitp, fixed_point);
+      }
+      element = original;
+      if ((status[j] == Status::success) and ((status[j] = add_corrector_kick(element, horizontal, -kick/2)) == Status::success)) {
+        status[j] = track_findorbit(kicked, orbitm, fixed_point);
+      }
+      element = original;
+      if (status[j] == Status::success) {
+        // bpms at the end of the lattice see the closed orbit at its start, as in the analytic mode
+        orbitp.push_back(orbitp.front());
+        orbitm.push_back(orbitm.front());
+      }
+      for(unsigned int i=0; i<nr_bpms; ++i) {
+        const unsigned int b = (*bpms)[i];
+        double& rx = (*respm)[i * n + j];
+        double& ry = (*respm)[(nr_bpms + i) * n + j];
+        if (status[j] != Status::success) { rx = ry = nan(""); continue; }
+        rx = (orbitp[b].rx - orbitm[b].rx) / kick;
+        ry = (orbitp[b].ry - orbitm[b].ry) / kick;
+      }
+    }
+  }
+};
+
+Status::type calc_orbit_response_matrix(const Accelerator& accelerator, const std::vector<unsigned int>& bpms, const std::vector<unsigned int>& hcorrectors, const std::vector<unsigned int>& vcorrectors, std::vector<double>& respm, OrbitResponse::type mode, unsigned int nr_threads, double kick) {
+
+  const std::vector<Element>& lattice = accelerator.lattice;
+  std::vector<unsigned int> correctors(hcorrectors);
+  correctors.insert(correctors.end(), vcorrectors.begin(), vcorrectors.end());
+  const unsigned int nr_bpms = bpms.size(), n = correctors.size();
+  for(const auto& i : bpms) if (i > lattice.size()) return Status::inconsistent_dimensions;
+  for(const auto& j : correctors) if (j >= lattice.size()) return Status::inconsistent_dimensions;
+  for(const auto& j : correctors) if (not is_corrector(lattice[j])) return Status::passmethod_not_implemented;
+  respm.assign(2 * nr_bpms * n, 0);
+
+  Status::type status;
+  std::vector<Pos<double> > closed_orbit;
+  if ((status = track_findorbit(accelerator, closed_orbit, Pos<double>(0))) != Status::success) return status;
+
+  if (mode == OrbitResponse::analytic) {
+    Matrix m66;
+    std::vector<Twiss> twiss;
+    if ((status = calc_twiss(accelerator, closed_orbit[0], m66, twiss, Twiss(), true)) != Status::success) return status;
+    const double tunex = twiss.back().mux / (2*M_PI), tuney = twiss.back().muy / (2*M_PI);
+    const double fx = 1 / (2 * std::sin(M_PI * tunex)), fy = 1 / (2 * std::sin(M_PI * tuney));
+    for(unsigned int j=0; j<n; ++j) {
+      Twiss tm;
+      if ((status = twiss_at_middle(accelerator, correctors[j], twiss[correctors[j]], tm)) != Status::success) return status;
+      const bool horizontal = (j < hcorrectors.size());
+      const double beta = horizontal ? tm.betax : tm.betay;
+      const double mu   = horizontal ? tm.mux : tm.muy;
+      for(unsigned int i=0; i<nr_bpms; ++i) {
+        const Twiss& tb = twiss[bpms[i]];
+        if (horizontal) {
+          respm[i * n + j] = fx * std::sqrt(tb.betax * beta) * std::cos(std::fabs(tb.mux - mu) - M_PI * tunex);
+        } else {
+          respm[(nr_bpms + i) * n + j] = fy * std::sqrt(tb.betay * beta) * std::cos(std::fabs(tb.muy - mu) - M_PI * tuney);
+        }
+      }
+    }
+    return Status::success;
+  }
+
+  OrbitResponseScan scan;
+  scan.accelerator = &accelerator;
+  scan.bpms = &bpms;
+  scan.correctors = &correctors;
+  scan.nr_hcorrectors = hcorrectors.size();
+  scan.fixed_point = closed_orbit[0];
+  scan.kick = kick;
+  scan.respm = &respm;
+  scan.status.assign(n, Status::success);
+  scan.nr_blocks = std::max(1u, std::min(nr_threads, n));
+
+  if (scan.nr_blocks <= 1) {
+    scan.run_block(0);
+  } else {
+    run_parallel_tasks(scan.nr_blocks, scan.nr_blocks, [&scan](long block) { scan.run_block(block); });
+  }
+
+  for(auto status : scan.status) if (status != Status::success) return status;
+  return Status::success;
+
+}
+
 
+// calc_radiation_integrals
+// ------------------------
+// the integrals are accumulated as the element matrices are tracked, before the periodic optics
+// at the start of the lattice are known. with X = (eta, eta') and X(s) = M(s) X0 + D(s), where
+// M and D are the accumulated horizontal block and dispersion column, I1 and I4 are linear in X0,
+// and, with u = M^-1 D, H(s) = (X0 + u)' G0 (X0 + u), where G0 = [gamma0 alpha0; alpha0 beta0],
+// so that I5 follows from moments of u. inside bends, integrands are sampled around each kick of
+// the integrator with the length of the kick, as radiation is applied in tracking.
+
+// moments of the radiation integrals, in terms of the periodic optics at the start of the lattice
+struct RadiationMoments {
+  double i2, i3;
+  double i1[3], i4[3];    // coefficients of eta0, eta0' and 1
+  double i5[6];           // integrals of |h|^3 times 1, u1, u2, u1^2, u1 u2, u2^2
+};
+
+// accumulates the moments along a bend whose map is tracked from the identity at its entrance,
+// where the accumulated matrix of the lattice is 'm'
+struct RadiationObserver {
+  RadiationMoments* moments;
+  const double (*m)[6];
+  double irho, k;
+
+  // horizontal rows of the accumulated matrix up to 'map'
+  void rows(const Pos<Tpsa<6,1> >& map, double (&a)[2][6]) const {
+    const Tpsa<6,1>* f[2] = {&map.rx, &map.px};
+    for(unsigned int i=0; i<2; ++i) {
+      for(unsigned int j=0; j<6; ++j) {
+        double v = 0;
+        for(unsigned int l=0; l<6; ++l) v += f[i]->c[l+1] * m[l][j];
+        a[i][j] = v;
+      }
+    }
+  }
+
+  void edge(const Pos<Tpsa<6,1> >& map, const double& edge_angle) {
+    double a[2][6];
+    rows(map, a);
+    const double w = -irho * irho * std::tan(edge_angle);
+    moments->i4[0] += w * a[0][0]; moments->i4[1] += w * a[0][1]; moments->i4[2] += w * a[0][4];
+  }
+
+  void kick(const Pos<Tpsa<6,1> >& map, const double& length) {
+    double a[2][6];
+    rows(map, a);
+    const double h3 = std::fabs(irho * irho * irho) * length;
+    const double w1 = irho * length, w4 = irho * (irho * irho + 2 * k) * length;
+    moments->i1[0] += w1 * a[0][0]; moments->i1[1] += w1 * a[0][1]; moments->i1[2] += w1 * a[0][4];
+    moments->i4[0] += w4 * a[0][0]; moments->i4[1] += w4 * a[0][1]; moments->i4[2] += w4 * a[0][4];
+    moments->i2 += irho * irho * length;
+    moments->i3 += h3;
+    const double det = a[0][0] * a[1][1] - a[0][1] * a[1][0];
+    const double u1 = ( a[1][1] * a[0][4] - a[0][1] * a[1][4]) / det;
+    const double u2 = (-a[1][0] * a[0][4] + a[0][0] * a[1][4]) / det;
+    moments->i5[0] += h3;           moments->i5[1] += h3 * u1;      moments->i5[2] += h3 * u2;
+    moments->i5[3] += h3 * u1 * u1; moments->i5[4] += h3 * u1 * u2; moments->i5[5] += h3 * u2 * u2;
+  }
+};
+
+Status::type calc_radiation_integrals(const Accelerator& accelerator, const Pos<double>& fixed_point, Matrix& m66, std::vector<Twiss>& twiss, RadiationIntegrals& integrals, unsigned int nr_threads) {
+
+  const std::vector<Element>& lattice = accelerator.lattice;
+
+  Status::type status;
+  RadiationMoments moments;
+  std::memset(&moments, 0, sizeof(moments));
+  std::vector<TwissBlocks> blocks;
+  blocks.reserve(lattice.size());
+  twiss.clear();
+  twiss.reserve(lattice.size());
+  Twiss twiss0;
+  twiss0.co = fixed_point;
+  twiss.push_back(twiss0);
+
+  Pos<double> co = fixed_point;
+  double m[6][6], em[6][6], t[6][6];
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m[i][j] = (i == j) ? 1 : 0;
+  for(unsigned int i=0; i<lattice.size(); ++i) {
+    const Element& element = lattice[i];
+    if ((element.pass_method == PassMethod::pm_bnd_mpole_symplectic4_pass) and (element.length != 0)) {
+      RadiationObserver observer;
+      observer.moments = &moments;
+      observer.m = m;
+      observer.irho = element.angle / element.length;
+      observer.k = (element.polynom_b.size() > 1) ? element.polynom_b[1] : 0;
+      status = track_element_matrix(element, accelerator, co, em, observer);
+    } else {
+      status = track_element_matrix(element, accelerator, co, em);
+    }
+    if (status != Status::success) return status;
+    multiply_m66(em, m, t);
+    std::memcpy(m, t, sizeof(t));
+    if (twiss.size() == lattice.size()) continue;
+    Twiss tw;
+    tw.spos = twiss.back().spos + element.length;
+    tw.co = co;
     twiss.push_back(tw);
+    blocks.push_back(TwissBlocks(m));
+  }
+
+  m66 = Matrix(6);
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m66[i][j] = m[i][j];
+  periodic_twiss(m, twiss[0]);
+  twiss_from_accumulated_blocks(twiss, blocks, nr_threads);
+
+  // integrals with the periodic optics at the start
+  const Twiss& tw0 = twiss[0];
+  const double e0 = tw0.etax[0], ep0 = tw0.etax[1];
+  const double beta0 = tw0.betax, alpha0 = tw0.alphax, gamma0 = (1 + alpha0 * alpha0) / beta0;
+  const double* u = moments.i5;
+  integrals.i1 = moments.i1[0] * e0 + moments.i1[1] * ep0 + moments.i1[2];
+  integrals.i2 = moments.i2;
+  integrals.i3 = moments.i3;
+  integrals.i4 = moments.i4[0] * e0 + moments.i4[1] * ep0 + moments.i4[2];
+  integrals.i5 = gamma0 * (e0 * e0 * u[0] + 2 * e0 * u[1] + u[3]) +
+                 2 * alpha0 * (e0 * ep0 * u[0] + e0 * u[2] + ep0 * u[1] + u[4]) +
+                 beta0 * (ep0 * ep0 * u[0] + 2 * ep0 * u[2] + u[5]);
 
+  // equilibrium parameters
+  const double length = accelerator.get_length();
+  const double gamma = accelerator.energy / (electron_rest_energy_MeV * 1e6);
+  const double beta = std::sqrt(1 - 1 / (gamma * gamma));
+  const double cgamma = 4 * M_PI * electron_radius / 3 / std::pow(electron_rest_energy_MeV / 1e3, 3);   // [m/GeV^3]
+  const double cq = 55 / (32 * std::sqrt(3.0)) * reduced_planck_constant * light_speed / electron_rest_energy;   // [m]
+  const double revolution_period = length / (beta * light_speed);
+  integrals.alphac  = integrals.i1 / length;
+  integrals.u0      = cgamma / (2 * M_PI) * std::pow(accelerator.energy / 1e9, 4) * integrals.i2 * 1e9;
+  integrals.jx      = 1 - integrals.i4 / integrals.i2;
+  integrals.jy      = 1;
+  integrals.je      = 2 + integrals.i4 / integrals.i2;
+  integrals.taux    = 2 * accelerator.energy * revolution_period / (integrals.jx * integrals.u0);
+  integrals.tauy    = 2 * accelerator.energy * revolution_period / (integrals.jy * integrals.u0);
+  integrals.taue    = 2 * accelerator.energy * revolution_period / (integrals.je * integrals.u0);
+  integrals.espread = gamma * std::sqrt(cq * integrals.i3 / (integrals.je * integrals.i2));
+  integrals.emitx   = cq * gamma * gamma * integrals.i5 / (integrals.jx * integrals.i2);
+
+  return Status::success;
+
+}
+
+
+// calc_beam_envelope
+// ------------------
+// Ohmi's envelope method. with the element matrices M_i of the radiating lattice around the 6D
+// closed orbit and the diffusion matrices B_i of quantum excitation in each element, the beam
+// matrix at the start is the periodic solution of S0 = M S0 M' + B, where M is the one-turn
+// matrix and B the diffusion accumulated along the turn, B(i+1) = M_i B(i) M_i' + B_i. with the
+// accumulated matrices A(i) and B(i) stored in the same pass, S(i) = A(i) S0 A(i)' + B(i).
+
+// accumulates, in 'd', the diffusion along a multipole or bend whose map is tracked from the
+// identity at its entrance, in the coordinates of the entrance: the diffusion bb v v' of each
+// kick, as in AT's findmpoleraddiffmatrix, is carried back by the inverse of the map up to it.
+struct DiffusionObserver {
+  const Element* element;
+  double irho;
+  double factor;        // cu * re * lambdabar * gamma^5
+  double (*d)[6];
+
+  template <typename T> void edge(const Pos<T>& pos, const double& edge_angle) {}
+
+  void kick(const Pos<Tpsa<6,1> >& map, const double& length) {
+    const Pos<double> orbit(map.rx.c[0], map.px.c[0], map.ry.c[0], map.py.c[0], map.de.c[0], map.dl.c[0]);
+    double real_sum, imag_sum;
+    calcpolykick<double>(orbit, element->polynom_a, element->polynom_b, real_sum, imag_sum);
+    const double pnorm = 1 / (1 + orbit.de);
+    const double rx = orbit.rx, px = orbit.px * pnorm, ry = orbit.ry, py = orbit.py * pnorm;
+    const double b2p = b2_perp(imag_sum, real_sum + irho, rx, px, ry, py, irho);
+    const double bb = factor * length * b2p * std::sqrt(b2p) * std::pow(1 + orbit.de, 4) *
+                      (1 + irho * rx + (px * px + py * py) / 2);
+    if (bb == 0) return;
+
+    const Tpsa<6,1>* f[6] = {&map.rx, &map.px, &map.ry, &map.py, &map.de, &map.dl};
+    std::vector<Pos<double> > columns(6);
+    for(unsigned int j=0; j<6; ++j) {
+      columns[j] = Pos<double>(f[0]->c[j+1], f[1]->c[j+1], f[2]->c[j+1], f[3]->c[j+1], f[4]->c[j+1], f[5]->c[j+1]);
+    }
+    const Pos<double> u = linalg_solve6_posvec(columns, Pos<double>(0, px, 0, py, 1, 0));
+    const double w[6] = {u.rx, u.px, u.ry, u.py, u.de, u.dl};
+    for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) d[i][j] += bb * w[i] * w[j];
+  }
+};
+
+// r = a * b * a', for 6x6 matrices (r may not alias a or b)
+static void congruence_m66(const double (&a)[6][6], const double (&b)[6][6], double (&r)[6][6]) {
+  double t[6][6];
+  multiply_m66(a, b, t);
+  for(unsigned int i=0; i<6; ++i) {
+    for(unsigned int j=0; j<6; ++j) {
+      double v = 0;
+      for(unsigned int k=0; k<6; ++k) v += t[i][k] * a[j][k];
+      r[i][j] = v;
+    }
   }
+}
 
-  // unwraps betatron phases
-  std::vector<double> jumpx(twiss.size(),0);
-  std::vector<double> jumpy(twiss.size(),0);
-  for(unsigned int i=1; i<twiss.size(); ++i) {
-    if (twiss[i].mux < twiss[i-1].mux) jumpx[i] = jumpx[i-1] + M_PI; else jumpx[i] = jumpx[i-1];
-    if (twiss[i].muy < twiss[i-1].muy) jumpy[i] = jumpy[i-1] + M_PI; else jumpy[i] = jumpy[i-1];
-    twiss[i-1].mux += jumpx[i-1];
-    twiss[i-1].muy += jumpy[i-1];
+// periodic solution s of s = m s m' + b, as a linear system in the 36 entries of s
+static Status::type solve_lyapunov_m66(const double (&m)[6][6], const double (&b)[6][6], double (&s)[6][6]) {
+
+  gsl_matrix* k = gsl_matrix_alloc(36,36);
+  gsl_vector* v = gsl_vector_alloc(36);
+  gsl_vector* x = gsl_vector_alloc(36);
+  gsl_permutation* p = gsl_permutation_alloc(36);
+  for(unsigned int i=0; i<6; ++i) {
+    for(unsigned int j=0; j<6; ++j) {
+      gsl_vector_set(v, 6*i+j, b[i][j]);
+      for(unsigned int r=0; r<6; ++r) {
+        for(unsigned int c=0; c<6; ++c) {
+          gsl_matrix_set(k, 6*i+j, 6*r+c, ((i == r) and (j == c) ? 1 : 0) - m[i][r] * m[j][c]);
+        }
+      }
+    }
+  }
+  int sign; gsl_linalg_LU_decomp(k, p, &sign);
+  const double det = gsl_linalg_LU_det(k, sign);
+  if ((det != 0) and std::isfinite(det)) gsl_linalg_LU_solve(k, p, v, x);
+  for(unsigned int i=0; i<6; ++i) {
+    for(unsigned int j=0; j<6; ++j) s[i][j] = 0.5 * (gsl_vector_get(x, 6*i+j) + gsl_vector_get(x, 6*j+i));
   }
-  twiss.back().mux += jumpx.back();
-  twiss.back().muy += jumpy.back();
+  gsl_matrix_free(k);
+  gsl_vector_free(v);
+  gsl_vector_free(x);
+  gsl_permutation_free(p);
+  return ((det != 0) and std::isfinite(det)) ? Status::success : Status::findorbit_one_turn_matrix_problem;
+
+}
 
-#ifdef TIMEIT
-  end = std::chrono::steady_clock::now(); diff = end - start;
-  std::cout << "calc_twiss::propagation: " << std::chrono::duration <double, std::milli> (diff).count() << " ms" << std::endl;
-#endif
+Status::type calc_beam_envelope(const Accelerator& accelerator, const Pos<double>& fixed_point, Matrix& m66, std::vector<Matrix>& sigmas, BeamEnvelope& envelope) {
 
+  if ((not accelerator.radiation_on) or (not accelerator.cavity_on)) return Status::not_implemented;
+
+  const std::vector<Element>& lattice = accelerator.lattice;
+  const double gamma = accelerator.energy / (electron_rest_energy_MeV * 1e6);
+  const double beta = std::sqrt(1 - 1 / (gamma * gamma));
+  const double cu = 55 / (24 * std::sqrt(3.0));
+  const double lambdabar = reduced_planck_constant * light_speed / electron_rest_energy;   // [m]
+  const double factor = cu * electron_radius * lambdabar * std::pow(gamma, 5);
+
+  // accumulated matrices and diffusion at the entrance of every element
+  std::vector<std::array<double,36> > accumulated(lattice.size());
+  std::vector<std::array<double,36> > diffusion(lattice.size());
+  Pos<double> co = fixed_point;
+  double m[6][6], b[6][6], em[6][6], eb[6][6], t[6][6];
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m[i][j] = (i == j) ? 1 : 0;
+  std::memset(b, 0, sizeof(b));
+  for(unsigned int i=0; i<lattice.size(); ++i) {
+    const Element& element = lattice[i];
+    std::memcpy(accumulated[i].data(), m, sizeof(m));
+    std::memcpy(diffusion[i].data(), b, sizeof(b));
+    std::memset(eb, 0, sizeof(eb));
+    DiffusionObserver observer;
+    observer.element = &element;
+    observer.irho = ((element.pass_method == PassMethod::pm_bnd_mpole_symplectic4_pass) and (element.length != 0)) ? element.angle / element.length : 0;
+    observer.factor = factor;
+    observer.d = eb;
+    Status::type status = track_element_matrix(element, accelerator, co, em, observer);
+    if (status != Status::success) return status;
+    congruence_m66(em, eb, t);        // diffusion of the element at its exit
+    congruence_m66(em, b, eb);
+    for(unsigned int r=0; r<6; ++r) for(unsigned int c=0; c<6; ++c) b[r][c] = eb[r][c] + t[r][c];
+    multiply_m66(em, m, t);
+    std::memcpy(m, t, sizeof(t));
+  }
+  m66 = Matrix(6);
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m66[i][j] = m[i][j];
+
+  // equilibrium beam matrix at the start and along the lattice
+  double s0[6][6];
+  Status::type status = solve_lyapunov_m66(m, b, s0);
+  if (status != Status::success) return status;
+  sigmas.resize(lattice.size());
+  for(unsigned int i=0; i<lattice.size(); ++i) {
+    const double (&a)[6][6] = *reinterpret_cast<const double (*)[6][6]>(accumulated[i].data());
+    const double (&d)[6][6] = *reinterpret_cast<const double (*)[6][6]>(diffusion[i].data());
+    congruence_m66(a, s0, t);
+    Matrix& sigma = sigmas[i];
+    sigma = Matrix(6);
+    for(unsigned int r=0; r<6; ++r) for(unsigned int c=0; c<6; ++c) sigma[r][c] = t[r][c] + d[r][c];
+  }
+
+  // eigenmodes of the one-turn matrix, identified by the plane where their eigenvectors are largest
+  gsl_matrix* gm = gsl_matrix_alloc(6,6);
+  gsl_vector_complex* eval = gsl_vector_complex_alloc(6);
+  gsl_matrix_complex* evec = gsl_matrix_complex_alloc(6,6);
+  gsl_eigen_nonsymmv_workspace* w = gsl_eigen_nonsymmv_alloc(6);
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) gsl_matrix_set(gm, i, j, m[i][j]);
+  gsl_eigen_nonsymmv(gm, eval, evec, w);
+  std::complex<double> lambda[6], v[6][6];
+  for(unsigned int k=0; k<6; ++k) {
+    const gsl_complex z = gsl_vector_complex_get(eval, k);
+    lambda[k] = std::complex<double>(GSL_REAL(z), GSL_IMAG(z));
+    for(unsigned int i=0; i<6; ++i) {
+      const gsl_complex e = gsl_matrix_complex_get(evec, i, k);
+      v[k][i] = std::complex<double>(GSL_REAL(e), GSL_IMAG(e));
+    }
+  }
+  gsl_eigen_nonsymmv_free(w);
+  gsl_matrix_complex_free(evec);
+  gsl_vector_complex_free(eval);
+  gsl_matrix_free(gm);
+
+  const double revolution_period = accelerator.get_length() / (beta * light_speed);
+  bool used[6] = {false, false, false, false, false, false};
+  double tunes[3], taus[3], emits[3];
+  for(unsigned int p=0; p<3; ++p) {
+    int mode = -1;
+    double largest = 0;
+    for(unsigned int k=0; k<6; ++k) {
+      if (used[k] or (lambda[k].imag() <= 0)) continue;
+      double norm = 0;
+      for(unsigned int i=0; i<6; ++i) norm += std::norm(v[k][i]);
+      const double fraction = (std::norm(v[k][2*p]) + std::norm(v[k][2*p+1])) / norm;
+      if (fraction > largest) { largest = fraction; mode = k; }
+    }
+    if (mode < 0) return Status::findorbit_one_turn_matrix_problem;
+    used[mode] = true;
+
+    // with the symplectic form s, emittances are |u^* S u| / |v^* u| where u = s v
+    const std::complex<double>* e = v[mode];
+    std::complex<double> u[6];
+    for(unsigned int q=0; q<3; ++q) { u[2*q] = e[2*q+1]; u[2*q+1] = -e[2*q]; }
+    std::complex<double> vsv = 0, usu = 0;
+    for(unsigned int i=0; i<6; ++i) {
+      vsv += std::conj(e[i]) * u[i];
+      for(unsigned int j=0; j<6; ++j) usu += std::conj(u[i]) * s0[i][j] * u[j];
+    }
+    emits[p] = std::abs(usu) / std::abs(vsv);
+    taus[p] = -revolution_period / std::log(std::abs(lambda[mode]));
+    // the eigenvalue exp(i mu) of a positive beta has Im(conj(v_q) v_p) > 0
+    double mu = std::arg(lambda[mode]);
+    if ((std::conj(e[2*p]) * e[2*p+1]).imag() < 0) mu = -mu;
+    tunes[p] = mu / (2 * M_PI);
+    if (tunes[p] < 0) tunes[p] += 1;
+  }
+
+  envelope.tunex   = tunes[0];
+  envelope.tuney   = tunes[1];
+  envelope.tunes   = std::min(tunes[2], 1 - tunes[2]);
+  envelope.taux    = taus[0];
+  envelope.tauy    = taus[1];
+  envelope.taue    = taus[2];
+  envelope.emitx   = emits[0];
+  envelope.emity   = emits[1];
+  envelope.emite   = emits[2];
+  envelope.espread = std::sqrt(s0[4][4]);
+  envelope.bunlen  = std::sqrt(s0[5][5]);
+
+  return Status::success;
+
+}
+
+
+// OpticsContext
+// -------------
+
+OpticsContext::AffineMap::AffineMap() : length(0) {
+  for(unsigned int i=0; i<6; ++i) {
+    for(unsigned int j=0; j<6; ++j) m[i][j] = (i == j) ? 1 : 0;
+    v[i] = 0;
+  }
+}
+
+// map of 'first' followed by 'second'
+OpticsContext::AffineMap OpticsContext::compose(const AffineMap& first, const AffineMap& second) {
+  AffineMap r;
+  multiply_m66(second.m, first.m, r.m);
+  for(unsigned int i=0; i<6; ++i) {
+    double v = second.v[i];
+    for(unsigned int k=0; k<6; ++k) v += second.m[i][k] * first.v[k];
+    r.v[i] = v;
+  }
+  r.length = first.length + second.length;
+  return r;
+}
+
+Status::type OpticsContext::element_map(unsigned int element, AffineMap& map) const {
+  Pos<double> co = orbit[element];
+  Status::type status = track_element_matrix(accelerator->lattice[element], *accelerator, co, map.m);
+  if (status != Status::success) return status;
+  // out = co + m (in - orbit), written as out = m in + v
+  const double in[6] = {orbit[element].rx, orbit[element].px, orbit[element].ry, orbit[element].py, orbit[element].de, orbit[element].dl};
+  const double out[6] = {co.rx, co.px, co.ry, co.py, co.de, co.dl};
+  for(unsigned int i=0; i<6; ++i) {
+    double v = out[i];
+    for(unsigned int k=0; k<6; ++k) v -= map.m[i][k] * in[k];
+    map.v[i] = v;
+  }
+  map.length = accelerator->lattice[element].length;
+  return Status::success;
+}
+
+Status::type OpticsContext::build(const Accelerator& accelerator_, const Pos<double>& fixed_point) {
+
+  accelerator = &accelerator_;
+  const unsigned int n = accelerator->lattice.size();
+  for(leaves = 1; leaves < n; leaves *= 2);
+  nodes.assign(2*leaves, AffineMap());
+  dirty.clear();
+
+  // reference orbit at the entrance of each element
+  orbit.resize(n);
+  double m66[6][6];
+  if (n > 0) orbit[0] = fixed_point;
+  Status::type status = track_element_matrices(accelerator_, fixed_point, m66, [&](unsigned int i, const Pos<double>& co, const double (&)[6][6], const double (&)[6][6]) {
+    if (i+1 < n) orbit[i+1] = co;
+  });
+  if (status != Status::success) { accelerator = nullptr; return status; }
+
+  for(unsigned int i=0; i<n; ++i) {
+    if ((status = element_map(i, nodes[leaves+i])) != Status::success) { accelerator = nullptr; return status; }
+  }
+  for(unsigned int i=leaves-1; i>0; --i) nodes[i] = compose(nodes[2*i], nodes[2*i+1]);
   return Status::success;
+
+}
+
+void OpticsContext::set_dirty(unsigned int element) {
+  dirty.push_back(element);
+}
+
+Status::type OpticsContext::update() {
+
+  if (accelerator == nullptr) return Status::uninitialized_memory;
+  std::sort(dirty.begin(), dirty.end());
+  dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+  // recomputes the maps of dirty elements, then the products above them, level by level
+  std::vector<unsigned int> level;
+  for(auto element : dirty) {
+    if (element >= accelerator->lattice.size()) { dirty.clear(); return Status::inconsistent_dimensions; }
+    Status::type status = element_map(element, nodes[leaves+element]);
+    if (status != Status::success) return status;
+    level.push_back(leaves+element);
+  }
+  dirty.clear();
+  while ((not level.empty()) and (level[0] > 1)) {
+    unsigned int nr_parents = 0;
+    for(auto node : level) {
+      const unsigned int parent = node / 2;
+      if ((nr_parents > 0) and (level[nr_parents-1] == parent)) continue;
+      nodes[parent] = compose(nodes[2*parent], nodes[2*parent+1]);
+      level[nr_parents++] = parent;
+    }
+    level.resize(nr_parents);
+  }
+  return Status::success;
+
+}
+
+OpticsContext::AffineMap OpticsContext::prefix_map(unsigned int element) const {
+  // descends from the root, composing the nodes that cover elements [0, element)
+  AffineMap r;
+  unsigned int node = 1, width = leaves;
+  while (element > 0) {
+    if (element == width) { r = compose(r, nodes[node]); break; }
+    width /= 2;
+    if (element >= width) { r = compose(r, nodes[2*node]); element -= width; node = 2*node+1; }
+    else node = 2*node;
+  }
+  return r;
+}
+
+void OpticsContext::get_m66(Matrix& m66) const {
+  m66 = Matrix(6);
+  for(unsigned int i=0; i<6; ++i) for(unsigned int j=0; j<6; ++j) m66[i][j] = nodes[1].m[i][j];
+}
+
+Pos<double> OpticsContext::get_closed_orbit() const {
+
+  // fixed point of the one-turn map, in 4D (energy deviation of the reference orbit) unless the cavity is on
+  if ((accelerator == nullptr) or orbit.empty()) return Pos<double>(0);
+  const AffineMap& map = nodes[1];
+  const Pos<double>& ref = orbit[0];
+  std::vector<Pos<double> > M(6, 0);
+  for(unsigned int j=0; j<6; ++j) {
+    Pos<double>& col = M[j];
+    col.rx = -map.m[0][j]; col.px = -map.m[1][j]; col.ry = -map.m[2][j];
+    col.py = -map.m[3][j]; col.de = -map.m[4][j]; col.dl = -map.m[5][j];
+  }
+  M[0].rx += 1; M[1].px += 1; M[2].ry += 1; M[3].py += 1; M[4].de += 1; M[5].dl += 1;
+  Pos<double> b(map.v[0], map.v[1], map.v[2], map.v[3], map.v[4], map.v[5]);
+  if (accelerator->cavity_on) return linalg_solve6_posvec(M, b);
+  b.rx += map.m[0][4] * ref.de + map.m[0][5] * ref.dl; b.px += map.m[1][4] * ref.de + map.m[1][5] * ref.dl;
+  b.ry += map.m[2][4] * ref.de + map.m[2][5] * ref.dl; b.py += map.m[3][4] * ref.de + map.m[3][5] * ref.dl;
+  Pos<double> co = linalg_solve4_posvec(M, b);
+  co.de = ref.de; co.dl = ref.dl;
+  return co;
+
+}
+
+void OpticsContext::get_tunes(double& tunex, double& tuney) const {
+  const double (&m)[6][6] = nodes[1].m;
+  const double sin_mux = sgn(m[0][1]) * std::sqrt(-m[0][1]*m[1][0]-pow(m[0][0]-m[1][1],2)/4.0);
+  const double sin_muy = sgn(m[2][3]) * std::sqrt(-m[2][3]*m[3][2]-pow(m[2][2]-m[3][3],2)/4.0);
+  tunex = std::atan2(sin_mux, (m[0][0]+m[1][1])/2.0) / (2*M_PI);
+  tuney = std::atan2(sin_muy, (m[2][2]+m[3][3])/2.0) / (2*M_PI);
+  if (tunex < 0) tunex += 1;
+  if (tuney < 0) tuney += 1;
+}
+
+Status::type OpticsContext::get_twiss(const std::vector<unsigned int>& elements, std::vector<Twiss>& twiss, Twiss twiss0) const {
+
+  if (accelerator == nullptr) return Status::uninitialized_memory;
+  const Pos<double> co = get_closed_orbit();
+  const double co0[6] = {co.rx, co.px, co.ry, co.py, co.de, co.dl};
+  if (twiss0.isundef()) {
+    periodic_twiss(nodes[1].m, twiss0);
+    twiss0.spos = 0;
+  }
+
+  twiss.clear();
+  for(auto element : elements) {
+    if (element > accelerator->lattice.size()) return Status::inconsistent_dimensions;
+    const AffineMap map = prefix_map(element);
+    Twiss tw;
+    tw.spos = twiss0.spos + map.length;
+    double x[6];
+    for(unsigned int i=0; i<6; ++i) {
+      x[i] = map.v[i];
+      for(unsigned int k=0; k<6; ++k) x[i] += map.m[i][k] * co0[k];
+    }
+    tw.co = Pos<double>(x[0], x[1], x[2], x[3], x[4], x[5]);
+    twiss_from_blocks(twiss0, TwissBlocks(map.m), tw);
+    tw.mux = std::fmod(twiss0.mux + tw.mux, 2*M_PI);
+    tw.muy = std::fmod(twiss0.muy + tw.muy, 2*M_PI);
+    twiss.push_back(tw);
+  }
+  return Status::success;
+
 }
@@ -17,6 +17,8 @@
 #include <trackcpp/trackcpp.h>
 #include <vector>
 #include <cstdlib>
+#include <fstream>
+#include <algorithm>
 
 void print_header (FILE* fp) {
 	fprintf(fp, "# %s\n", string_version.c_str());
@@ -122,11 +124,7 @@ Status::type print_tracking_ringpass(const Accelerator& accelerator, const std::
 	return Status::success;
 }
 
-Status::type print_dynapgrid(const Accelerator& accelerator, const std::vector<DynApGridPoint>& grid, const std::string& label, const std::string& filename, bool print_tunes) {
-
-	FILE* fp;
-	fp = fopen(filename.c_str(), "w");
-	if (fp == nullptr) return Status::file_not_opened;
+static void print_dynapgrid_header(FILE* fp, const Accelerator& accelerator, const std::string& label, bool print_tunes, bool print_chaos) {
 
 	const char str[] = "------------------------";
 
@@ -138,27 +136,124 @@ Status::type print_dynapgrid(const Accelerator& accelerator, const std::vector<D
 	fprintf(fp, "# radiation_state   : %s\n", accelerator.radiation_on ? "on" : "off");
 	fprintf(fp, "# chamber_state     : %s\n", accelerator.vchamber_on ? "on" : "off");
 	fprintf(fp, "\n");
-	if (print_tunes) {
-		fprintf(fp, "%-5s %-5s %-5s %-5s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s\n",  "# s_e", "l_t", "l_e", "l_p", "start_s[m]", "rx[m]", "ry[m]", "de", "px[rad]", "py[rad]", "dl[m]", "nux1", "nuy1", "nux2", "nuy2");
-		fprintf(fp, "%-5s %-5s %-5s %-5s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s %-24s\n",  "# ---", "-----", "-----", "-----", str, str, str, str, str, str, str, str, str, str, str);
-	} else {
-		fprintf(fp, "%-5s %-5s %-5s %-5s %-24s %-24s %-24s %-24s %-24s %-24s %-24s\n",  "# s_e", "l_t", "l_e", "l_p", "start_s[m]", "rx[m]", "ry[m]", "de", "px[rad]", "py[rad]", "dl[m]");
-		fprintf(fp, "%-5s %-5s %-5s %-5s %-24s %-24s %-24s %-24s %-24s %-24s %-24s\n",  "# ---", "-----", "-----", "-----", str, str, str, str, str, str, str);
+	fprintf(fp, "%-5s %-5s %-5s %-5s %-24s %-24s %-24s %-24s %-24s %-24s %-24s",  "# s_e", "l_t", "l_e", "l_p", "start_s[m]", "rx[m]", "ry[m]", "de", "px[rad]", "py[rad]", "dl[m]");
+	if (print_tunes) fprintf(fp, " %-24s %-24s %-24s %-24s", "nux1", "nuy1", "nux2", "nuy2");
+	if (print_chaos) fprintf(fp, " %-24s", "chaos");
+	fprintf(fp, "\n");
+	fprintf(fp, "%-5s %-5s %-5s %-5s %-24s %-24s %-24s %-24s %-24s %-24s %-24s",  "# ---", "-----", "-----", "-----", str, str, str, str, str, str, str);
+	if (print_tunes) fprintf(fp, " %-24s %-24s %-24s %-24s", str, str, str, str);
+	if (print_chaos) fprintf(fp, " %-24s", str);
+	fprintf(fp, "\n");
+
+}
+
+static void print_dynapgrid_point(FILE* fp, const DynApGridPoint& point, const std::vector<double>& s, bool print_tunes, bool print_chaos) {
+
+	const Pos<double>& p = point.p;
+	fprintf(fp, "%-5i %-5i %-5i %-5i %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E",  point.start_element, point.lost_turn, point.lost_element, point.lost_plane, s[point.start_element], p.rx, p.ry, p.de, p.px, p.py, p.dl);
+	if (print_tunes) fprintf(fp, " %+24.17E %+24.17E %+24.17E %+24.17E", point.nux1, point.nuy1, point.nux2, point.nuy2);
+	if (print_chaos) fprintf(fp, " %+24.17E", point.chaos);
+	fprintf(fp, "\n");
+
+}
+
+Status::type print_dynapgrid(const Accelerator& accelerator, const std::vector<DynApGridPoint>& grid, const std::string& label, const std::string& filename, bool print_tunes, bool print_chaos) {
+
+	FILE* fp;
+	fp = fopen(filename.c_str(), "w");
+	if (fp == nullptr) return Status::file_not_opened;
+
+	print_dynapgrid_header(fp, accelerator, label, print_tunes, print_chaos);
+	std::vector<double> s = latt_findspos(accelerator.lattice, latt_range(accelerator.lattice));
+	for(unsigned int i=0; i<grid.size(); ++i) {
+		print_dynapgrid_point(fp, grid[i], s, print_tunes, print_chaos);
 	}
 
+	fclose(fp);
+	return Status::success;
+}
+
+// partial files of sharded runs: the 'print_dynapgrid' output preceded by the shard
+// information and with each line of data prefixed with the index of its grid point.
+Status::type print_dynapgrid_partial(const Accelerator& accelerator, const std::vector<DynApGridPoint>& grid, const std::vector<unsigned int>& points, unsigned int shard_index, unsigned int nr_shards, const std::string& label, const std::string& filename, bool print_tunes, bool print_chaos) {
+
+	FILE* fp;
+	fp = fopen(filename.c_str(), "w");
+	if (fp == nullptr) return Status::file_not_opened;
+
+	fprintf(fp, "# [dynap_partial]\n");
+	fprintf(fp, "# shard             : %u/%u\n", shard_index, nr_shards);
+	fprintf(fp, "# grid_size         : %lu\n", grid.size());
+	print_dynapgrid_header(fp, accelerator, label, print_tunes, print_chaos);
 	std::vector<double> s = latt_findspos(accelerator.lattice, latt_range(accelerator.lattice));
-	if (print_tunes) {
-		for(unsigned int i=0; i<grid.size(); ++i) {
-			const Pos<double>& p = grid[i].p;
-			fprintf(fp, "%-5i %-5i %-5i %-5i %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E\n",  grid[i].start_element, grid[i].lost_turn, grid[i].lost_element, grid[i].lost_plane, s[grid[i].start_element], p.rx, p.ry, p.de, p.px, p.py, p.dl, grid[i].nux1, grid[i].nuy1, grid[i].nux2, grid[i].nuy2);
+	for(unsigned int i=0; i<points.size(); ++i) {
+		fprintf(fp, "%-7u ", points[i]);
+		print_dynapgrid_point(fp, grid[points[i]], s, print_tunes, print_chaos);
+	}
+
+	fclose(fp);
+	return Status::success;
+}
+
+Status::type merge_dynapgrid_partials(const std::vector<std::string>& partial_filenames, const std::string& filename) {
+
+	std::vector<std::string> header;
+	std::vector<std::string> lines;
+	std::vector<bool>        filled;
+	std::vector<bool>        merged_shards;
+	unsigned int nr_shards = 0;
+
+	for(unsigned int f=0; f<partial_filenames.size(); ++f) {
+		std::ifstream fi(partial_filenames[f].c_str());
+		if (fi.bad() or not fi.is_open()) return Status::file_not_found;
+		std::string line;
+		if (not std::getline(fi, line) or (line != "# [dynap_partial]")) return Status::file_not_opened;
+		unsigned int shard_index, shard_nr_shards;
+		unsigned long grid_size;
+		if (not std::getline(fi, line) or (sscanf(line.c_str(), "# shard : %u/%u", &shard_index, &shard_nr_shards) != 2)) return Status::file_not_opened;
+		if (not std::getline(fi, line) or (sscanf(line.c_str(), "# grid_size : %lu", &grid_size) != 1)) return Status::file_not_opened;
+		if (f == 0) {
+			nr_shards = shard_nr_shards;
+			lines.resize(grid_size);
+			filled.resize(grid_size, false);
+			merged_shards.resize(nr_shards, false);
+		} else if ((shard_nr_shards != nr_shards) or (grid_size != lines.size())) {
+			return Status::inconsistent_dimensions;
+		}
+		if (shard_index >= nr_shards) return Status::inconsistent_dimensions;
+		if (merged_shards[shard_index]) return Status::partial_file_repeated;
+		merged_shards[shard_index] = true;
+		// the header of every partial file must be that of the first one, so that
+		// partial files of different runs are not merged
+		std::vector<std::string> file_header;
+		while (std::getline(fi, line)) {
+			if (line.empty() or (line[0] == '#')) {
+				file_header.push_back(line);
+				continue;
+			}
+			size_t pos = line.find(' ');
+			unsigned long idx = std::strtoul(line.substr(0, pos).c_str(), nullptr, 10);
+			if ((pos == std::string::npos) or (idx >= lines.size())) return Status::inconsistent_dimensions;
+			lines[idx] = line.substr(std::max(pos, (size_t) 7) + 1);
+			filled[idx] = true;
 		}
-	} else {
-		for(unsigned int i=0; i<grid.size(); ++i) {
-			const Pos<double>& p = grid[i].p;
-			fprintf(fp, "%-5i %-5i %-5i %-5i %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E %+24.17E\n",  grid[i].start_element, grid[i].lost_turn, grid[i].lost_element, grid[i].lost_plane, s[grid[i].start_element], p.rx, p.ry, p.de, p.px, p.py, p.dl);
+		if (f == 0) {
+			header = file_header;
+		} else if (file_header != header) {
+			return Status::partial_file_mismatch;
 		}
 	}
 
+	// all grid points must have been computed by one of the shards
+	for(unsigned int i=0; i<filled.size(); ++i) {
+		if (not filled[i]) return Status::inconsistent_dimensions;
+	}
+
+	FILE* fp;
+	fp = fopen(filename.c_str(), "w");
+	if (fp == nullptr) return Status::file_not_opened;
+	for(unsigned int i=0; i<header.size(); ++i) fprintf(fp, "%s\n", header[i].c_str());
+	for(unsigned int i=0; i<lines.size(); ++i) fprintf(fp, "%s\n", lines[i].c_str());
 	fclose(fp);
 	return Status::success;
 }
@@ -19,6 +19,9 @@
 #include <ctime>
 #include <chrono>
 #include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 
 int test_printlattice(const Accelerator& accelerator) {
   latt_print(accelerator.lattice);
@@ -492,6 +495,203 @@ int test_calc_twiss() {
 
 }
 
+// periodic twiss with 1 and 4 threads: the lattice has more than one chunk of
+// elements, so the phase unwrapping across chunks is exercised.
+int test_calc_twiss_threads() {
+
+  Accelerator accelerator;
+  std::string fname("tests/si_v07_c05.txt");
+  Status::type status = read_flat_file(fname, accelerator);
+  if (status != Status::success) {
+    std::cerr << "could not open flat_file!" << std::endl;
+    return status;
+  }
+  accelerator.cavity_on = false;
+  accelerator.radiation_on = false;
+  accelerator.vchamber_on = false;
+
+  std::vector<Pos<double>> closed_orbit;
+  status = track_findorbit4(accelerator, closed_orbit);
+  if (status != Status::success) {
+    std::cerr << "could not find 4d closed orbit" << std::endl;
+    return status;
+  }
+
+  std::vector<Twiss> twiss1, twiss4;
+  Matrix m66;
+  status = calc_twiss(accelerator, closed_orbit[0], m66, twiss1, Twiss(), false, 1);
+  if (status == Status::success) status = calc_twiss(accelerator, closed_orbit[0], m66, twiss4, Twiss(), false, 4);
+  if (status != Status::success) {
+    std::cerr << "could not calculate twiss" << std::endl;
+    return status;
+  }
+
+  unsigned int nr_diffs = (twiss1.size() == twiss4.size()) ? 0 : 1;
+  for(unsigned int i=0; (nr_diffs == 0) and (i<twiss1.size()); ++i) {
+    const Twiss& a = twiss1[i];
+    const Twiss& b = twiss4[i];
+    if ((a.mux != b.mux) or (a.muy != b.muy) or (a.betax != b.betax) or (a.betay != b.betay) or
+        (a.alphax != b.alphax) or (a.alphay != b.alphay) or (a.etax[0] != b.etax[0]) or (a.etay[0] != b.etay[0])) nr_diffs++;
+  }
+  std::cout << "calc_twiss with 1 and 4 threads (" << twiss1.size() << " elements): " << (nr_diffs ? "DIFFERENT" : "identical") << std::endl;
+
+  // unwrapped phases never decrease along the ring
+  unsigned int nr_decreasing = 0;
+  for(unsigned int i=1; i<twiss4.size(); ++i) {
+    if ((twiss4[i].mux < twiss4[i-1].mux) or (twiss4[i].muy < twiss4[i-1].muy)) nr_decreasing++;
+  }
+  std::cout << "calc_twiss phases decreasing at " << nr_decreasing << " elements" << std::endl;
+  return (nr_diffs or nr_decreasing) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
+
+// accelerator and grid of the dynap run tests
+static Status::type read_dynap_test_accelerator(Accelerator& accelerator) {
+  std::string fname("tests/si_v07_c05.txt");
+  Status::type status = read_flat_file(fname, accelerator);
+  if (status != Status::success) {
+    std::cerr << "could not open flat_file!" << std::endl;
+    return status;
+  }
+  accelerator.energy = 3e9;
+  accelerator.harmonic_number = 864;
+  accelerator.cavity_on = false;
+  accelerator.radiation_on = false;
+  accelerator.vchamber_on = true;
+  return Status::success;
+}
+
+static Status::type run_dynap_test(const Accelerator& accelerator, std::vector<DynApGridPoint>& grid, DynApRunOptions* run_options) {
+  std::vector<Pos<double>> cod;
+  return dynap_xy(accelerator, cod, 200, Pos<double>(0), 9, -0.012, 0.012, 3, 0.0005, 0.003, true, grid, 4, MidPlaneSymmetry::automatic, run_options);
+}
+
+static std::string read_text_file(const std::string& filename) {
+  std::ifstream fi(filename.c_str());
+  std::stringstream ss;
+  ss << fi.rdbuf();
+  return ss.str();
+}
+
+// dynap_xy in 3 shards merged with 'merge_dynapgrid_partials' gives the file of the full run
+int test_dynap_merge() {
+
+  Accelerator accelerator;
+  Status::type status = read_dynap_test_accelerator(accelerator);
+  if (status != Status::success) return status;
+
+  std::vector<DynApGridPoint> grid;
+  status = run_dynap_test(accelerator, grid, nullptr);
+  if (status == Status::success) status = print_dynapgrid(accelerator, grid, "[dynap_xy]", "tests_dynap_full_out.txt");
+
+  std::vector<std::string> partial_filenames;
+  const unsigned int nr_shards = 3;
+  for(unsigned int i=0; (status == Status::success) and (i<nr_shards); ++i) {
+    DynApRunOptions run_options;
+    run_options.shard_index = i;
+    run_options.nr_shards = nr_shards;
+    partial_filenames.push_back("tests_dynap_shard_" + std::to_string(i) + "_out.txt");
+    status = run_dynap_test(accelerator, grid, &run_options);
+    if (status == Status::success) status = print_dynapgrid_partial(accelerator, grid, run_options.computed, i, nr_shards, "[dynap_xy]", partial_filenames.back());
+  }
+  if (status == Status::success) status = merge_dynapgrid_partials(partial_filenames, "tests_dynap_merged_out.txt");
+  if (status != Status::success) {
+    std::cerr << string_error_messages[status] << std::endl;
+    return status;
+  }
+
+  const bool same = read_text_file("tests_dynap_merged_out.txt") == read_text_file("tests_dynap_full_out.txt");
+  std::cout << "dynap_xy merged from " << nr_shards << " shards: " << (same ? "identical" : "DIFFERENT") << " to the full run" << std::endl;
+  std::remove("tests_dynap_full_out.txt");
+  std::remove("tests_dynap_merged_out.txt");
+  for(unsigned int i=0; i<partial_filenames.size(); ++i) std::remove(partial_filenames[i].c_str());
+  return same ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
+
+// dynap_xy resumed from the checkpoint of an interrupted run gives the file of the full run.
+// the interrupted run is emulated by the first of two shards, which checkpoints half the tasks.
+int test_dynap_resume() {
+
+  Accelerator accelerator;
+  Status::type status = read_dynap_test_accelerator(accelerator);
+  if (status != Status::success) return status;
+
+  // the final progress report of each run gives the number of tasks it tracked
+  long nr_full_tasks = 0, nr_resumed_tasks = 0;
+  std::vector<DynApGridPoint> grid;
+  set_thread_progress_report(3600, false, [&nr_full_tasks](const ThreadProgress& p) { nr_full_tasks = p.nr_tasks; });
+  status = run_dynap_test(accelerator, grid, nullptr);
+  set_thread_progress_report(0);
+  if (status == Status::success) status = print_dynapgrid(accelerator, grid, "[dynap_xy]", "tests_dynap_full_out.txt");
+
+  DynApRunOptions interrupted;
+  interrupted.nr_shards = 2;
+  interrupted.checkpoint_filename = "tests_dynap_checkpoint.txt";
+  std::remove(interrupted.checkpoint_filename.c_str());
+  if (status == Status::success) status = run_dynap_test(accelerator, grid, &interrupted);
+
+  DynApRunOptions resumed;
+  resumed.checkpoint_filename = interrupted.checkpoint_filename;
+  resumed.resume = true;
+  set_thread_progress_report(3600, false, [&nr_resumed_tasks](const ThreadProgress& p) { nr_resumed_tasks = p.nr_tasks; });
+  if (status == Status::success) status = run_dynap_test(accelerator, grid, &resumed);
+  set_thread_progress_report(0);
+  if (status == Status::success) status = print_dynapgrid(accelerator, grid, "[dynap_xy]", "tests_dynap_resumed_out.txt");
+  if (status != Status::success) {
+    std::cerr << string_error_messages[status] << std::endl;
+    return status;
+  }
+
+  const bool same = read_text_file("tests_dynap_resumed_out.txt") == read_text_file("tests_dynap_full_out.txt");
+  const bool skipped = (nr_resumed_tasks > 0) and (nr_resumed_tasks < nr_full_tasks);
+  std::cout << "dynap_xy resumed with " << nr_resumed_tasks << " of " << nr_full_tasks << " tasks: " << (same ? "identical" : "DIFFERENT") << " to the full run" << std::endl;
+  std::remove("tests_dynap_full_out.txt");
+  std::remove("tests_dynap_resumed_out.txt");
+  std::remove(interrupted.checkpoint_filename.c_str());
+  return (same and skipped) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
+
+// the fmap of dynap_scan analysed in batches by 'NaffBatch' gives the tunes of the
+// analysis of one particle at a time
+int test_dynap_fmap_batch() {
+
+  Accelerator accelerator;
+  Status::type status = read_dynap_test_accelerator(accelerator);
+  if (status != Status::success) return status;
+
+  DynApScan scan;
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::rx, 15, -0.012, 0.012));
+  scan.axes.push_back(DynApScanAxis::range(DynApScanAxis::ry, 3, 0.0005, 0.003));
+  scan.nr_turns = 252;
+  scan.analysis = dynap_analysis_diffusion;
+
+  std::vector<Pos<double>> cod;
+  std::vector<DynApGridPoint> grid1, grid2;
+  status = dynap_scan(accelerator, cod, scan, true, grid1, 4);
+  scan.batch_analysis = dynap_analysis_diffusion_batch;
+  if (status == Status::success) status = dynap_scan(accelerator, cod, scan, false, grid2, 4);
+  if (status != Status::success) {
+    std::cerr << string_error_messages[status] << std::endl;
+    return status;
+  }
+
+  unsigned int nr_diffs = 0;
+  for(unsigned int i=0; i<grid1.size(); ++i) {
+    const DynApGridPoint& a = grid1[i];
+    const DynApGridPoint& b = grid2[i];
+    if ((a.lost_turn != b.lost_turn) or (a.lost_element != b.lost_element) or (a.lost_plane != b.lost_plane)) { nr_diffs++; continue; }
+    const double tunes_a[] = {a.nux1, a.nuy1, a.nux2, a.nuy2}, tunes_b[] = {b.nux1, b.nuy1, b.nux2, b.nuy2};
+    for(unsigned int k=0; k<4; ++k) {
+      if ((tunes_a[k] != tunes_b[k]) and not (std::isnan(tunes_a[k]) and std::isnan(tunes_b[k]))) { nr_diffs++; break; }
+    }
+  }
+  std::cout << "fmap of " << grid1.size() << " points in batches: " << nr_diffs << " differ from the unbatched analysis" << std::endl;
+  return nr_diffs ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}
+
 int test_matrix_inversion() {
 
 
@@ -606,6 +806,12 @@ int cmd_tests(const std::vector<std::string>& args) {
   //test_matrix_inversion();
   //test_new_write_flat_file();
 
-  return 0;
+  int nr_failed = 0;
+  if (test_calc_twiss_threads() != EXIT_SUCCESS) nr_failed++;
+  if (test_dynap_merge() != EXIT_SUCCESS) nr_failed++;
+  if (test_dynap_resume() != EXIT_SUCCESS) nr_failed++;
+  if (test_dynap_fmap_batch() != EXIT_SUCCESS) nr_failed++;
+
+  return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 
 }
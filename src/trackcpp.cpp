@@ -21,6 +21,7 @@
 
 
 bool verbose_on = true;
+bool verbose_tasks_on = false;
 
 bool isfinite(const double& v) {
 	return std::isfinite(v);